@@ -0,0 +1,365 @@
+#include <lum/aot.h>
+#include <lum/env.h>
+#include <lum/fn.h>
+#include <lum/namespace.h>
+#include <algorithm>
+#include <iomanip>
+#include <unordered_set>
+
+namespace lum {
+
+// ---- registration ----
+
+static AotTable* aot_tables = 0;
+
+void aot_register(AotTable* table) {
+  table->next = aot_tables;
+  aot_tables = table;
+}
+
+
+bool aot_attach(Code* code) {
+  if (aot_tables == 0) {
+    return false;
+  }
+  uint64_t fingerprint = aot_fingerprint(code);
+  for (const AotTable* t = aot_tables; t != 0; t = t->next) {
+    for (size_t i = 0; i != t->count; ++i) {
+      if (t->entries[i].fingerprint == fingerprint) {
+        code->native = t->entries[i].native;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+std::vector<const char*> aot_sources() {
+  std::vector<const char*> sources;
+  for (const AotTable* t = aot_tables; t != 0; t = t->next) {
+    if (t->source != 0) {
+      sources.push_back(t->source);
+    }
+  }
+  std::reverse(sources.begin(), sources.end());
+  return sources;
+}
+
+
+// FNV-1a, 64 bit
+static inline void mix(uint64_t& h, const void* data, size_t size) {
+  const uint8_t* p = (const uint8_t*)data;
+  for (size_t i = 0; i != size; ++i) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+}
+
+uint64_t aot_fingerprint(const Code* code) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  mix(h, &code->reg_count, sizeof(code->reg_count));
+  for (const Instr& i : code->instrs) {
+    uint8_t bytes[] = {(uint8_t)i.op, i.a, i.b, i.c};
+    mix(h, bytes, sizeof(bytes));
+  }
+  for (Type type : code->param_types) {
+    mix(h, &type, sizeof(type));
+  }
+  // Numbers are inlined into generated code, other constants are not
+  for (Cell* c : code->consts) {
+    Type type = Cell::typeOf(c);
+    mix(h, &type, sizeof(type));
+    if (type == Type::INT || type == Type::FLOAT) {
+      int64_t bits = Cell::intValue(c);
+      if (type == Type::FLOAT) {
+        double f = Cell::floatValue(c);
+        memcpy(&bits, &f, sizeof(bits));
+      }
+      mix(h, &bits, sizeof(bits));
+    }
+  }
+  for (const Var* var : code->vars) {
+    const char* name = var->symbol()->c_str();
+    mix(h, name, strlen(name) + 1);
+  }
+  return h;
+}
+
+
+// ---- code generation ----
+
+namespace {
+
+struct Unit {
+  std::vector<std::pair<std::string,const Code*>> codes; // name, code
+  std::unordered_set<const Fn*> fns;
+  std::unordered_set<uint64_t>  fingerprints;
+};
+
+// Add the code of `fn`, and of the functions created in its body
+void add_fn(Unit& unit, const Fn* fn, const std::string& name) {
+  if (!unit.fns.insert(fn).second) {
+    return;
+  }
+  const Code* codes[] = {fn->_code, fn->_special};
+  for (const Code* code : codes) {
+    if (code == 0) {
+      continue;
+    }
+    if (unit.fingerprints.insert(aot_fingerprint(code)).second) {
+      unit.codes.emplace_back(name, code);
+    }
+    for (Cell* c : code->consts) {
+      if (Cell::typeOf(c) == Type::FN) {
+        add_fn(unit, (const Fn*)c->value.p, name + " (inner fn)");
+      }
+    }
+  }
+}
+
+const char* arith_name(Op op) {
+  switch (op) {
+    case Op::ADD: { return "ADD"; }
+    case Op::SUB: { return "SUB"; }
+    case Op::MUL: { return "MUL"; }
+    case Op::DIV: { return "DIV"; }
+    default:      { return "REM"; }
+  }
+}
+
+// The C++ expression computing typed operation `op` on `x` and `y`
+std::string typed_expr(Op op, const std::string& x, const std::string& y) {
+  switch (op) {
+    case Op::ADDI: case Op::ADDF: { return x + " + " + y; }
+    case Op::SUBI: case Op::SUBF: { return x + " - " + y; }
+    case Op::MULI: case Op::MULF: { return x + " * " + y; }
+    case Op::DIVI: case Op::DIVF: { return x + " / " + y; }
+    case Op::REMI: { return x + " % " + y; }
+    default:       { return "fmod(" + x + ", " + y + ")"; }
+  }
+}
+
+std::string reg(uint32_t r) {
+  return "r[" + std::to_string(r) + "]";
+}
+
+void emit_code(std::ostream& out, const std::string& fn_name,
+               const std::string& name, const Code* code)
+{
+  out << "// " << name << "\n"
+      << "static Cell* " << fn_name << "(Env* env, const Code* code) {\n"
+      << "  Cell* const* k = code->consts.data();\n"
+      << "  Var* const* v = code->vars.data();\n"
+      << "  (void)k; (void)v;\n"
+      << "  Reg r[" << std::max(code->reg_count, 1u) << "];\n";
+  std::unordered_set<size_t> labels; // instructions which are jumped to
+  for (const Instr& i : code->instrs) {
+    if (i.op == Op::JMP || i.op == Op::JMPF || i.op == Op::JMPX) {
+      labels.insert(i.bx());
+    }
+  }
+  for (size_t n = 0; n != code->instrs.size(); ++n) {
+    const Instr& i = code->instrs[n];
+    std::string a = reg(i.a);
+    if (labels.count(n) != 0) {
+      out << " L" << n << ":\n";
+    }
+    out << "  ";
+    switch (i.op) {
+      case Op::LOADK: {
+        Cell* c = code->consts[i.bx()];
+        Type type = Cell::typeOf(c);
+        if (type == Type::INT) {
+          int64_t n = Cell::intValue(c);
+          out << a << ".type = Type::INT; " << a << ".value.i = ";
+          if (n == INT64_MIN) {
+            out << "INT64_MIN;";
+          } else {
+            out << n << "LL;";
+          }
+        } else if (type == Type::FLOAT) {
+          // As bits, so that the value is exact
+          double f = Cell::floatValue(c);
+          uint64_t bits;
+          memcpy(&bits, &f, sizeof(bits));
+          out << a << ".type = Type::FLOAT; "
+              << a << ".value.i = (int64_t)0x" << std::hex << bits
+              << std::dec << "ULL; // " << f;
+        } else {
+          out << "vm_load(" << a << ", k[" << i.bx() << "]);";
+        }
+        break;
+      }
+      case Op::LOCAL: {
+        out << "vm_load(" << a << ", env->get_local(" << i.bx() << "));";
+        break;
+      }
+      case Op::LOCALI: {
+        out << a << ".type = Type::INT; " << a << ".value.i = "
+            << "Cell::intValue(env->get_local(" << i.bx() << "));";
+        break;
+      }
+      case Op::LOCALF: {
+        out << a << ".type = Type::FLOAT; " << a << ".value.f = "
+            << "Cell::floatValue(env->get_local(" << i.bx() << "));";
+        break;
+      }
+      case Op::VAR: {
+        out << "vm_load(" << a << ", v[" << i.bx() << "]->get()); // "
+            << code->vars[i.bx()]->symbol()->c_str();
+        break;
+      }
+      case Op::EVAL: {
+        out << "if (!vm_eval(env, " << a << ", k[" << i.bx() << "])) "
+            << "{ return 0; }";
+        break;
+      }
+      case Op::NUM: {
+        out << "if (!vm_check_number(" << a << ")) { return 0; }";
+        break;
+      }
+      case Op::ADD:
+      case Op::SUB:
+      case Op::MUL:
+      case Op::DIV:
+      case Op::REM: {
+        out << "if (!vm_arith(Op::" << arith_name(i.op) << ", " << a << ", "
+            << reg(i.b) << ", " << reg(i.c) << ")) { return 0; }";
+        break;
+      }
+      case Op::ADDI:
+      case Op::SUBI:
+      case Op::MULI:
+      case Op::DIVI:
+      case Op::REMI: {
+        out << a << ".value.i = " << typed_expr(i.op, reg(i.b) + ".value.i",
+                                                reg(i.c) + ".value.i")
+            << "; " << a << ".type = Type::INT;";
+        break;
+      }
+      case Op::ADDF:
+      case Op::SUBF:
+      case Op::MULF:
+      case Op::DIVF:
+      case Op::REMF: {
+        out << a << ".value.f = " << typed_expr(i.op, reg(i.b) + ".value.f",
+                                                reg(i.c) + ".value.f")
+            << "; " << a << ".type = Type::FLOAT;";
+        break;
+      }
+      case Op::JMP: {
+        out << "goto L" << i.bx() << ";";
+        break;
+      }
+      case Op::JMPF: {
+        out << "if (vm_is_false(" << a << ")) { goto L" << i.bx() << "; }";
+        break;
+      }
+      case Op::JMPX: {
+        out << "if (!vm_is_applicable(" << a << ")) { goto L" << i.bx()
+            << "; }";
+        break;
+      }
+      case Op::CALL: {
+        out << "if (!vm_call(env, &" << a << ", " << (uint32_t)i.b << ")) "
+            << "{ return 0; }";
+        break;
+      }
+      case Op::TAIL: {
+        out << "return vm_tail(env, &" << a << ", " << (uint32_t)i.b << ");";
+        break;
+      }
+      case Op::RET: {
+        out << "return vm_box(" << a << ");";
+        break;
+      }
+    }
+    out << "\n";
+  }
+  out << "}\n\n";
+}
+
+// Write `s` as a C++ string literal, a line at a time
+void emit_string(std::ostream& out, const char* s) {
+  out << "  \"";
+  for (; *s != 0; ++s) {
+    unsigned char c = (unsigned char)*s;
+    if (c == '\n') {
+      out << "\\n\"";
+      if (s[1] == 0) {
+        return;
+      }
+      out << "\n  \"";
+    } else if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20 || c >= 0x7f || c == '?') {
+      // With all three octal digits, so that a digit which follows is not
+      // taken for one. Question marks could start a trigraph.
+      out << '\\' << (char)('0' + (c >> 6)) << (char)('0' + ((c >> 3) & 7))
+          << (char)('0' + (c & 7));
+    } else {
+      out << c;
+    }
+  }
+  out << "\"";
+}
+
+} // namespace
+
+
+size_t aot_emit(Namespace* ns, std::ostream& out, const char* source) {
+  // Functions bound to the Vars of the namespace, by name
+  std::vector<std::pair<std::string,const Fn*>> fns;
+  spinlock_lock(ns->mappings._lock);
+  for (const auto& entry : ns->mappings._map) {
+    Cell* value = entry.second.get();
+    if (value != 0 && Cell::typeOf(value) == Type::FN) {
+      const Fn* fn = (const Fn*)value->value.p;
+      fns.emplace_back(entry.second.symbol()->c_str(),
+                       (fn->_proto != 0) ? fn->_proto : fn);
+    }
+  }
+  spinlock_unlock(ns->mappings._lock);
+  std::sort(fns.begin(), fns.end());
+
+  Unit unit;
+  for (const auto& fn : fns) {
+    add_fn(unit, fn.second, fn.first);
+  }
+
+  out << "// Compiled ahead of time from namespace " << ns->name()->c_str()
+      << " by `lum --aot`\n"
+      << "#include <lum/aot.h>\n"
+      << "#include <lum/env.h>\n"
+      << "#include <lum/var.h>\n"
+      << "#include <cmath>\n\n"
+      << "namespace {\n"
+      << "using namespace lum;\n\n";
+  for (size_t i = 0; i != unit.codes.size(); ++i) {
+    emit_code(out, "lum_aot_" + std::to_string(i), unit.codes[i].first,
+              unit.codes[i].second);
+  }
+  out << "const AotEntry kEntries[] = {\n";
+  for (size_t i = 0; i != unit.codes.size(); ++i) {
+    out << "  {0x" << std::hex << aot_fingerprint(unit.codes[i].second)
+        << std::dec << "ULL, lum_aot_" << i << "},\n";
+  }
+  if (unit.codes.empty()) {
+    out << "  {0, 0},\n";
+  }
+  out << "};\n\n";
+  if (source != 0) {
+    out << "const char kSource[] =\n";
+    emit_string(out, source);
+    out << ";\n\n";
+  }
+  out << "AotTable table = {kEntries, " << unit.codes.size() << ", "
+      << (source != 0 ? "kSource" : "0") << ", 0};\n"
+      << "struct Registration {\n"
+      << "  Registration() { aot_register(&table); }\n"
+      << "} registration;\n\n"
+      << "} // namespace\n";
+  return unit.codes.size();
+}
+
+} // namespace lum
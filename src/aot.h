@@ -0,0 +1,71 @@
+#ifndef _LUM_AOT_H_
+#define _LUM_AOT_H_
+
+#include <lum/common.h>
+#include <lum/vm.h>
+#include <iosfwd>
+
+namespace lum {
+
+struct Namespace;
+
+// Ahead-of-time compilation.
+//
+// `lum --aot FILE [NS]` evaluates the forms in FILE and writes C++ source
+// for the bytecode (see vm.h) of every function defined in namespace NS,
+// by default the current one after evaluating FILE, to stdout. The source
+// builds with the system compiler against the public headers, and is linked
+// with liblum.a and lum's own main (src/main.cc):
+//
+//   lum --aot app.lum > app_aot.cc
+//   c++ -std=c++11 -pthread -Iinclude -c app_aot.cc
+//   c++ -pthread app_aot.o main.o lib/liblum.a -o app
+//   ./app
+//
+// The generated source embeds FILE as well, which main evaluates when it is
+// run without arguments, so the program does not need FILE at run time. The
+// functions are still created by evaluating it, as they are made of cells
+// which only exist at run time, and then find their compiled code.
+//
+// A generated translation unit registers a table of its functions when the
+// program starts. Code::create then looks up each function body it
+// translates in the registered tables, by a fingerprint of its bytecode,
+// and if it was compiled ahead of time uses that as its native code. The
+// function runs as machine code from its first call, instead of after
+// Fn::kJitAfter calls. Registers become C++ locals, so unboxed ints and
+// floats of specialized code stay in machine registers, and calls to BIFs
+// are applied directly (see vm_eval).
+
+struct AotEntry {
+  uint64_t fingerprint; // see aot_fingerprint
+  Cell* (*native)(Env*, const Code*);
+};
+
+struct AotTable {
+  const AotEntry* entries;
+  size_t          count;
+  const char*     source; // the Lum source compiled, or NULL
+  AotTable*       next;
+};
+
+// Register `table`. Generated code does this from a static initializer.
+void aot_register(AotTable* table);
+
+// Set code->native to a registered function which was compiled from the
+// same bytecode, if any. Returns true if one was found.
+bool aot_attach(Code* code);
+
+// The sources of the registered tables which have one, in the order they
+// were registered
+std::vector<const char*> aot_sources();
+
+// Hash of the instructions, types and constants of `code`
+uint64_t aot_fingerprint(const Code* code);
+
+// Write C++ source for the code of the functions defined in `ns`, and of
+// functions created inside of them, to `out`, along with `source` if not
+// NULL. Returns the number of code objects written.
+size_t aot_emit(Namespace* ns, std::ostream& out, const char* source=0);
+
+} // namespace lum
+#endif // _LUM_AOT_H_
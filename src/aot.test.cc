@@ -0,0 +1,94 @@
+#include <lum/aot.h>
+#include <lum/fn.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <sstream>
+#include "test.h"
+
+using namespace lum;
+
+// What `lum --aot` writes for aot.test.lum, which defines the functions made
+// below as user/sq, and user/tri calling it. The Makefile generates it, and
+// passes its path in.
+#include LUM_AOT_TEST_SOURCE
+
+int main(int argc, const char** argv) {
+  #if LUM_VM
+  Env env;
+
+  // The generated source builds and registers its function when the program
+  // starts, and code with the same bytecode runs it from the first call
+  // (fn (a b) (+ (* a a) (- b 1) 2))
+  Fn* fn = make_fn(env, list(sym("+", list(sym("*", sym("a", sym("a"))),
+    list(sym("-", sym("b", Cell::createInt(1))), Cell::createInt(2))))));
+  assert_true(fn->_code != 0);
+  assert_true(fn->_code->native == lum_aot_0);
+
+  // which is what is written for the function when it is in a namespace
+  env.define(const_cast<Sym*>(intern_sym("sq")), Cell::createFn(fn));
+  std::ostringstream out;
+  assert_eq(aot_emit(env.ns, out), 1);
+  uint64_t fingerprint = aot_fingerprint(fn->_code);
+  std::ostringstream entry;
+  entry << "{0x" << std::hex << fingerprint << "ULL, lum_aot_0}";
+  assert_true(out.str().find("// user/sq\n") != std::string::npos);
+  assert_true(out.str().find(entry.str()) != std::string::npos);
+  assert_true(out.str().find("vm_arith(Op::MUL, r[0], r[0], r[1])") !=
+              std::string::npos);
+
+  // The source it was compiled from is embedded as well, so that the program
+  // runs without it
+  std::vector<const char*> sources = aot_sources();
+  assert_eq(sources.size(), (size_t)1);
+  assert_true(strstr(sources[0], "(def tri (fn (a b)") != 0);
+  std::ostringstream embedded;
+  aot_emit(env.ns, embedded, "(def s \"a\\b?\")\n; \x01\n");
+  assert_true(embedded.str().find("const char kSource[] =\n"
+                                  "  \"(def s \\\"a\\\\b\\077\\\")\\n\"\n"
+                                  "  \"; \\001\\n\";\n") != std::string::npos);
+  assert_true(embedded.str().find("{kEntries, 1, kSource, 0}") !=
+              std::string::npos);
+
+  Cell* args[][2] = {
+    {Cell::createInt(7), Cell::createInt(3)},
+    {Cell::createFloat(1.5), Cell::createInt(3)},
+    {Cell::createInt(2), Cell::createBool(true)},
+  };
+  for (auto& a : args) {
+    env.locals.push(a[0]);
+    env.locals.push(a[1]);
+    Cell* expected = vm_run(&env, fn->_code);
+    Cell* actual = vm_exec(&env, fn->_code);
+    env.unwind_locals(0);
+    assert_same(actual, expected);
+    env.results.unwind(0);
+  }
+  Cell* call = list(Cell::createFn(fn,
+    Cell::createInt(7, Cell::createInt(3))));
+  Cell* r = eval(&env, call);
+  assert_eq(Cell::intValue(r), 7*7 + 3 - 1 + 2);
+  env.results.unwind(0);
+
+  // Conditionals and calls are compiled as well
+  // (fn (a b) (if (= a b) (sq a b) (- b a)))
+  Fn* tri = make_fn(env, list(sym("if", list(sym("=", sym("a", sym("b"))),
+    list(sym("sq", sym("a", sym("b"))), list(sym("-", sym("b", sym("a")))))))));
+  assert_true(tri->_code->native == lum_aot_1);
+  r = eval(&env, list(Cell::createFn(tri,
+    Cell::createInt(3, Cell::createInt(3)))));
+  assert_eq(Cell::intValue(r), 3*3 + 3 - 1 + 2);
+  env.results.unwind(0);
+  r = eval(&env, list(Cell::createFn(tri,
+    Cell::createInt(2, Cell::createInt(5)))));
+  assert_eq(Cell::intValue(r), 3);
+  env.results.unwind(0);
+
+  // but code which differs does not
+  Type ints[] = {Type::INT, Type::INT};
+  Code* special = Code::create(&env, fn, ints);
+  assert_null(special->native);
+  Code::free(special);
+  #endif
+
+  return 0;
+}
@@ -0,0 +1,47 @@
+#include <lum/atom.h>
+#include <lum/cell.h>
+#include <lum/gc.h>
+
+namespace lum {
+
+Atom* Atom::create(Cell* value) {
+  assert(value == 0 || Cell::isImm(value) || Cell::isShared(value));
+  Atom* atom = new (std::nothrow) Atom;
+  if (atom == 0) {
+    return 0;
+  }
+  atom->_value = value;
+  atom->_updates = 0;
+  atom->_retries = 0;
+  gc_register_atom(atom);
+  return atom;
+}
+
+
+void Atom::free(Atom* atom) {
+  if (atom == 0) {
+    return;
+  }
+  gc_unregister_atom(atom);
+  delete atom;
+}
+
+
+bool Atom::compare_and_set(Cell* expected, Cell* value) {
+  assert(value == 0 || Cell::isImm(value) || Cell::isShared(value));
+  if (!LumAtomicBoolCmpSwap(&_value, expected, value)) {
+    return false;
+  }
+  LumAtomicAddAndFetch(&_updates, 1);
+  return true;
+}
+
+
+Cell* Atom::reset(Cell* value) {
+  assert(value == 0 || Cell::isImm(value) || Cell::isShared(value));
+  Cell* prev = (Cell*)LumAtomicSwap(&_value, value);
+  LumAtomicAddAndFetch(&_updates, 1);
+  return prev;
+}
+
+} // namespace lum
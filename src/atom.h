@@ -0,0 +1,52 @@
+#ifndef _LUM_ATOM_H_
+#define _LUM_ATOM_H_
+
+#include <lum/common.h>
+
+namespace lum {
+
+struct Cell;
+
+// Atoms: shared, mutable references to immutable values.
+//
+// Any number of threads may read an atom and update it. An update replaces
+// the value with a compare-and-swap, so that read-modify-write (swap!) can
+// retry when another thread got there first, instead of taking a lock. The
+// values are shared cells (see Cell::share) which live in the heap, or
+// immediates. An atom is reached through ATOM cells, and is freed by the
+// garbage collector once it is not.
+//
+// Each atom counts its updates and how many times an update lost a race and
+// was retried, which shows how contended it is.
+struct Atom {
+  // Returns NULL if out of memory
+  static Atom* create(Cell* value);
+  static void free(Atom*);
+
+  Cell* get() const { return __atomic_load_n(&_value, __ATOMIC_ACQUIRE); }
+
+  // Set the value to `value` if it is still `expected`
+  bool compare_and_set(Cell* expected, Cell* value);
+
+  // Count an update which is tried again as it lost a race with another one,
+  // i.e. compare_and_set failed although the value was the expected one
+  // when read
+  void count_retry() { LumAtomicAddAndFetch(&_retries, 1); }
+
+  // Set the value unconditionally, returning the previous one
+  Cell* reset(Cell* value);
+
+  uint64_t updates() const { return _updates; }
+  uint64_t retries() const { return _retries; }
+
+  Cell* volatile    _value;
+  volatile uint64_t _updates;
+  volatile uint64_t _retries;
+
+  uint32_t _gc_color;
+  Atom*    _gc_next; // in the list of all atoms, see gc.cc
+  Atom*    _gc_prev;
+};
+
+} // namespace lum
+#endif // _LUM_ATOM_H_
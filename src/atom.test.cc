@@ -0,0 +1,187 @@
+#include <lum/atom.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <lum/gc.h>
+#include <lum/sched.h>
+#include "test.h"
+#include <thread>
+
+using namespace lum;
+
+static void define(Env& env, const char* name, const char* source) {
+  Cell* value = eval(&env, read(source));
+  assert_true(value != 0);
+  env.define(const_cast<Sym*>(intern_sym(name)), value);
+  env.results.unwind(0);
+}
+
+// Increments by threads racing with each other are neither lost nor counted
+// twice, and the races they lose are counted as retries
+static void test_contention() {
+  static constexpr int kThreads = 4;
+  static constexpr int64_t kIncrements = 20000;
+  Atom* atom = Atom::create(Cell::immInt(0));
+  assert_true(atom != 0);
+  std::vector<std::thread> threads;
+  std::vector<uint64_t> lost(kThreads, 0);
+  for (int i = 0; i != kThreads; ++i) {
+    threads.emplace_back([atom, &lost, i] {
+      for (int64_t n = 0; n != kIncrements; ++n) {
+        while (true) {
+          Cell* value = atom->get();
+          Cell* next = Cell::immInt(Cell::intValue(value) + 1);
+          if (atom->compare_and_set(value, next)) {
+            break;
+          }
+          atom->count_retry();
+          ++lost[i];
+        }
+      }
+    });
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  assert_eq(Cell::intValue(atom->get()), kThreads * kIncrements);
+  assert_eq(atom->updates(), (uint64_t)(kThreads * kIncrements));
+  uint64_t retries = 0;
+  for (uint64_t n : lost) {
+    retries += n;
+  }
+  assert_eq(atom->retries(), retries);
+
+  // Another value is not replaced, which is not a retry
+  assert_false(atom->compare_and_set(Cell::immInt(1), Cell::immInt(2)));
+  assert_eq(atom->retries(), retries);
+  assert_eq(Cell::intValue(atom->reset(Cell::immInt(7))),
+            kThreads * kIncrements);
+  assert_eq(Cell::intValue(atom->get()), 7);
+  Atom::free(atom);
+}
+
+static void test_bifs(Env& env) {
+  define(env, "a", "(atom 0)");
+  Cell* r = eval_source(env, "(swap! a + 2)");
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), 2);
+  r = eval_source(env, "(swap! a (fn (v x y) (* (+ v x) y)) 1 5)");
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), 15);
+  r = eval_source(env, "(deref a)");
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), 15);
+
+  r = eval_source(env, "(reset! a 10)");
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), 10);
+  r = eval_source(env, "(compare-and-set! a 9 11)");
+  assert_true(r != 0 && Cell::intValue(r) == 0);
+  r = eval_source(env, "(compare-and-set! a 10 11)");
+  assert_true(r != 0 && Cell::intValue(r) == 1);
+  r = eval_source(env, "(deref a)");
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), 11);
+
+  // A value which is not the same as the old one is not a lost race
+  r = eval(&env, read("(atom-stats a)"));
+  assert_true(r != 0 && Cell::typeOf(r) == Type::LIST);
+  assert_eq(Cell::intValue((Cell*)r->value.p), 4);
+  assert_eq(Cell::intValue(((Cell*)r->value.p)->rest()), 0);
+  env.results.unwind(0);
+
+  // Lists made while evaluating outlive the frame they were made in
+  r = eval_source(env, "(reset! a (cons 1 (cons 2)))");
+  assert_true(r != 0 && Cell::typeOf(r) == Type::LIST);
+  gc_collect();
+  r = eval(&env, read("(deref a)"));
+  assert_true(r != 0 && Cell::typeOf(r) == Type::LIST);
+  assert_eq(Cell::intValue((Cell*)r->value.p), 1);
+  assert_eq(Cell::intValue(((Cell*)r->value.p)->rest()), 2);
+  env.results.unwind(0);
+
+  assert_null(eval_source(env, "(atom)"));
+  assert_null(eval_source(env, "(swap! 1 +)"));
+  assert_null(eval_source(env, "(swap! a 1)"));
+  assert_null(eval_source(env, "(swap! a no-such-fn)"));
+  assert_null(eval_source(env, "(swap! a (fn (v) (+ v no-such-var)))"));
+  assert_null(eval_source(env, "(reset! a)"));
+  assert_null(eval_source(env, "(compare-and-set! a 1)"));
+  assert_null(eval_source(env, "(atom-stats 1)"));
+  assert_null(eval_source(env, "(deref 1)"));
+}
+
+// The atom, the function and the arguments evaluated so far live on while
+// the next argument is evaluated, here waiting for a collection to finish.
+// They are made by functions, whose results are only held by swap!.
+static void test_collect(Env& env) {
+  Cell* p = eval_source(env, "(promise)");
+  assert_true(p != 0);
+  env.define(const_cast<Sym*>(intern_sym("p")), p);
+  std::thread collector([p] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    gc_collect();
+    Task* task = (Task*)p->value.p;
+    task->_sched->deliver(task, Cell::immInt(2));
+  });
+  // The form is not reachable from any other root
+  Cell* form = read("(swap! ((fn () (atom (cons 1))))"
+                    "       ((fn () (fn (v x y) (cons x (cons y v)))))"
+                    "       ((fn () (cons 3))) (deref p))");
+  env.results.push(form);
+  Cell* r = eval(&env, form);
+  collector.join();
+  assert_true(r != 0 && Cell::typeOf(r) == Type::LIST);
+  Cell* first = (Cell*)r->value.p;
+  assert_true(Cell::typeOf(first) == Type::LIST);
+  assert_eq(Cell::intValue((Cell*)first->value.p), 3);
+  assert_eq(Cell::intValue(first->rest()), 2);
+  assert_eq(Cell::intValue(first->rest()->rest()), 1);
+  env.results.unwind(0);
+}
+
+// Processes updating one atom concurrently
+static void test_processes(Env& env) {
+  static constexpr int64_t kProcesses = 8;
+  static constexpr int64_t kSwaps = 300;
+  define(env, "counter", "(atom 0)");
+  env.define(const_cast<Sym*>(intern_sym("bump")), Cell::createNil());
+  define(env, "bump", "(fn (n) (if (= n 0) 0"
+                      "  ((fn (ignored) (bump (- n 1)))"
+                      "   (swap! counter + 1))))");
+  char source[64];
+  snprintf(source, sizeof(source), "(spawn bump %lld)", (long long)kSwaps);
+  for (int64_t i = 0; i != kProcesses; ++i) {
+    char name[16];
+    snprintf(name, sizeof(name), "t%lld", (long long)i);
+    define(env, name, source);
+  }
+  for (int64_t i = 0; i != kProcesses; ++i) {
+    snprintf(source, sizeof(source), "(join t%lld)", (long long)i);
+    assert_true(eval_source(env, source) != 0);
+  }
+  Cell* r = eval_source(env, "(deref counter)");
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), kProcesses * kSwaps);
+  r = eval(&env, read("(atom-stats counter)"));
+  assert_true(r != 0);
+  assert_eq(Cell::intValue((Cell*)r->value.p), kProcesses * kSwaps);
+  env.results.unwind(0);
+
+  // Atoms are freed once unreachable
+  env.define(const_cast<Sym*>(intern_sym("a")), Cell::createNil());
+  env.define(const_cast<Sym*>(intern_sym("counter")), Cell::createNil());
+  uint64_t atoms_freed = gc_stats().atoms_freed;
+  gc_collect();
+  assert_true(gc_stats().atoms_freed >= atoms_freed + 2);
+}
+
+int main(int argc, const char** argv) {
+  test_contention();
+
+  Env env;
+  setenv("LUM_WORKERS", "4", 1);
+  test_bifs(env);
+  test_collect(env);
+  test_processes(env);
+  return 0;
+}
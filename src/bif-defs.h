@@ -11,5 +11,24 @@ LUM_BIF_APPLY(in_ns, "in-ns")
 LUM_BIF_APPLY(def,   "def")
 LUM_BIF_APPLY(eq,    "=")
 LUM_BIF_APPLY(fn,    "fn")
+LUM_BIF_APPLY(if_,   "if")
+LUM_BIF_APPLY(loop,  "loop")
+LUM_BIF_APPLY(recur, "recur")
+LUM_BIF_APPLY(mem_stats, "mem-stats")
+LUM_BIF_APPLY(trace_dump, "trace-dump")
+LUM_BIF_APPLY(spawn, "spawn")
+LUM_BIF_APPLY(join,  "join")
+LUM_BIF_APPLY(future,  "future")
+LUM_BIF_APPLY(promise, "promise")
+LUM_BIF_APPLY(deliver, "deliver")
+LUM_BIF_APPLY(deref,   "deref")
+LUM_BIF_APPLY(atom,    "atom")
+LUM_BIF_APPLY(swap,    "swap!")
+LUM_BIF_APPLY(reset,   "reset!")
+LUM_BIF_APPLY(compare_and_set, "compare-and-set!")
+LUM_BIF_APPLY(atom_stats, "atom-stats")
+LUM_BIF_APPLY(pmap,    "pmap")
+LUM_BIF_APPLY(pfilter, "pfilter")
+LUM_BIF_APPLY(preduce, "preduce")
 
 #endif // LUM_BIF_APPLY
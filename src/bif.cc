@@ -5,6 +5,11 @@
 #include <lum/eval.h>
 #include <lum/print.h>
 #include <lum/sym.h>
+#include <lum/memstats.h>
+#include <lum/trace.h>
+#include <lum/sched.h>
+#include <lum/atom.h>
+#include <chrono>
 
 namespace lum {
 
@@ -32,19 +37,19 @@ Cell* _numop(Env* env, Cell* args) {
   Cell* arg = args;
 
   while (arg != 0) {
-    args = arg->rest; // to avoid linking into the result of eval_cons
+    args = arg->rest(); // to avoid linking into the result of eval_cons
     bool did_expand_arg = false;
     consider_arg:
-    switch (arg->type) {
+    switch (Cell::typeOf(arg)) {
       case Type::INT: {
         if (is_int) {
           if (is_inited) {
-            IOP(sum.i, arg->value.i);
+            IOP(sum.i, Cell::intValue(arg));
           } else {
-            sum.i = arg->value.i;
+            sum.i = Cell::intValue(arg);
           }
         } else {
-          int64_t v = arg->value.i;
+          int64_t v = Cell::intValue(arg);
           if (v > 9007199254740992 || v < -9007199254740992) {
             fprintf(stderr, "BIF/add: "
               "error precision loss in int-to-float conversion\n");
@@ -67,9 +72,9 @@ Cell* _numop(Env* env, Cell* args) {
           }
         }
         if (is_inited) {
-          FOP(sum.f, arg->value.f);
+          FOP(sum.f, Cell::floatValue(arg));
         } else {
-          sum.f = arg->value.f;
+          sum.f = Cell::floatValue(arg);
         }
         break;
       }
@@ -83,6 +88,9 @@ Cell* _numop(Env* env, Cell* args) {
         } else {
           did_expand_arg = true;
           arg = eval(env, arg);
+          if (arg == 0) {
+            return 0;
+          }
           goto consider_arg;
         }
       }
@@ -91,7 +99,9 @@ Cell* _numop(Env* env, Cell* args) {
     is_inited = true;
   } // while (arg != 0)
 
-  return is_int ? Cell::createInt(sum.i) : Cell::createFloat(sum.f);
+  // The result is an immediate whenever it fits, so plain arithmetic does
+  // not allocate.
+  return is_int ? Cell::immInt(sum.i) : Cell::immFloat(sum.f);
 
   bad_arg:
   std::cerr << "bad argument to built-in function: ";
@@ -99,6 +109,75 @@ Cell* _numop(Env* env, Cell* args) {
   return 0;
 }
 
+// Specializations of _numop for a known number of arguments. These do the
+// same as _numop, but without its loop and state, and with the common cases
+// of only ints and only floats first.
+
+// The number which `arg` is or evaluates to. Returns NULL after printing an
+// error if there is no such number.
+static inline Cell* _num_arg(Env* env, Cell* arg) {
+  Type t = Cell::typeOf(arg);
+  if (t == Type::INT || t == Type::FLOAT) {
+    return arg;
+  }
+  arg = eval(env, arg);
+  if (arg == 0) {
+    return 0;
+  }
+  t = Cell::typeOf(arg);
+  if (t != Type::INT && t != Type::FLOAT) {
+    std::cerr << "bad argument to built-in function: ";
+    print1(std::cerr, arg) << '\n';
+    return 0;
+  }
+  return arg;
+}
+
+static inline double _int_to_float(int64_t v) {
+  if (v > 9007199254740992 || v < -9007199254740992) {
+    fprintf(stderr, "BIF/add: "
+      "error precision loss in int-to-float conversion\n");
+  }
+  return (double)v;
+}
+
+template <NumOpI IOP, NumOpF FOP>
+Cell* _numop1(Env* env, Cell* args) {
+  Cell* a = _num_arg(env, args);
+  if (a == 0) {
+    return 0;
+  }
+  return (Cell::typeOf(a) == Type::INT) ? Cell::immInt(Cell::intValue(a))
+                                        : Cell::immFloat(Cell::floatValue(a));
+}
+
+template <NumOpI IOP, NumOpF FOP>
+Cell* _numop2(Env* env, Cell* args) {
+  Cell* b_arg = args->rest(); // the value of `a` might not have a `rest`
+  Cell* a = _num_arg(env, args);
+  if (a == 0) {
+    return 0;
+  }
+  // Take the value of `a` before evaluating `b`, like _numop does
+  bool a_is_int = Cell::typeOf(a) == Type::INT;
+  int64_t ai = a_is_int ? Cell::intValue(a) : 0;
+  double af = a_is_int ? 0.0 : Cell::floatValue(a);
+  Cell* b = _num_arg(env, b_arg);
+  if (b == 0) {
+    return 0;
+  }
+  bool b_is_int = Cell::typeOf(b) == Type::INT;
+  if (a_is_int && b_is_int) {
+    IOP(ai, Cell::intValue(b));
+    return Cell::immInt(ai);
+  }
+  if (a_is_int) {
+    af = _int_to_float(ai);
+  }
+  FOP(af, b_is_int ? _int_to_float(Cell::intValue(b)) : Cell::floatValue(b));
+  return Cell::immFloat(af);
+}
+
 inline void _sumI(int64_t& v, int64_t operand) { v += operand; }
 inline void _sumF(double& v, double operand)   { v += operand; }
 
@@ -120,11 +199,17 @@ inline void _remF(double& v, double operand)   { v = fmod(v, operand); }
 // template Cell* _numop<_divI, _divF>(Env*,Cell*);
 // template Cell* _numop<_remI, _remF>(Env*,Cell*);
 
-DECL_BIF(sum, LUM_MCAT(_numop<_sumI, _sumF>), 0, true)
-DECL_BIF(sub, LUM_MCAT(_numop<_subI, _subF>), 0, true)
-DECL_BIF(mul, LUM_MCAT(_numop<_mulI, _mulF>), 0, true)
-DECL_BIF(div, LUM_MCAT(_numop<_divI, _divF>), 0, true)
-DECL_BIF(rem, LUM_MCAT(_numop<_remI, _remF>), 0, true)
+#define DECL_NUMOP_BIF(Name, IOP, FOP) \
+  DECL_BIF(Name, LUM_MCAT(_numop<IOP, FOP>), 0, true, true, \
+           LUM_MCAT(_numop1<IOP, FOP>), LUM_MCAT(_numop2<IOP, FOP>))
+
+DECL_NUMOP_BIF(sum, _sumI, _sumF)
+DECL_NUMOP_BIF(sub, _subI, _subF)
+DECL_NUMOP_BIF(mul, _mulI, _mulF)
+DECL_NUMOP_BIF(div, _divI, _divF)
+DECL_NUMOP_BIF(rem, _remI, _remF)
+
+#undef DECL_NUMOP_BIF
 
 
 static Cell* _eq(Env* env, Cell* args) {
@@ -132,28 +217,36 @@ static Cell* _eq(Env* env, Cell* args) {
     std::cerr << "too few arguments given to built-in function '='\n";
     return 0;
   }
+  // Note: Arguments are walked through `args` since the result of `eval` might
+  // be an immediate, which has no `rest`.
   Cell* a = eval(env, args);
-  Cell* b;
-  while ((b = a->rest) != 0) {
-    b = eval(env, b);
-    if (a->type != b->type) {
+  Cell* arg = args;
+  while (a != 0 && (arg = arg->rest()) != 0) {
+    Cell* b = eval(env, arg);
+    if (b == 0) {
+      return 0;
+    }
+    Type type = Cell::typeOf(a);
+    if (type != Cell::typeOf(b)) {
       goto return_false;
     } else {
       // same type
-      switch (b->type) {
+      switch (type) {
         case Type::BOOL:
         case Type::INT: {
-          if (a->value.i != b->value.i) { goto return_false; }
+          if (Cell::intValue(a) != Cell::intValue(b)) { goto return_false; }
           break;
         }
         case Type::FLOAT: {
-          if (a->value.f != b->value.f) { goto return_false; }
+          if (Cell::floatValue(a) != Cell::floatValue(b)) {
+            goto return_false;
+          }
           break;
         }
         case Type::SYM: case Type::KEYWORD: {
-          if (a->value.p != b->value.p ||
-              !((Sym*)a->value.p)->equals((Sym*)b->value.p) )
-          {
+          Sym* sa = (Sym*)Cell::ptrValue(a);
+          Sym* sb = (Sym*)Cell::ptrValue(b);
+          if (sa != sb && !sa->equals(sb)) {
             goto return_false;
           }
           break;
@@ -166,11 +259,14 @@ static Cell* _eq(Env* env, Cell* args) {
     }
     a = b;
   }
-  return Cell::createSym(kSym_true);
+  if (a == 0) {
+    return 0;
+  }
+  return Cell::immBool(true);
   return_false:
-  return Cell::createSym(kSym_false);
+  return Cell::immBool(false);
 }
-DECL_BIF(eq, _eq, 1, true)
+DECL_BIF(eq, _eq, 1, true, true)
 
 
 static Cell* _cons(Env* env, Cell* args) {
@@ -179,56 +275,58 @@ static Cell* _cons(Env* env, Cell* args) {
     return 0;
   }
 
-  // Now, evaluate any arguments
-  Cell* rest = args->rest;
+  // Now, evaluate any arguments. The new list shares all of `rest`'s cells.
+  Cell* rest = args->rest();
+  Cell* tail = 0;
+  Cell* list = 0;
   if (rest != 0) {
-    if (rest->rest != 0) {
+    if (rest->rest() != 0) {
       std::cerr << "too many arguments given to built-in function 'cons'\n";
       return 0;
     }
     rest = eval(env, rest);
-    if (rest->type != Type::LIST) {
+    if (rest == 0 || Cell::typeOf(rest) != Type::LIST) {
       std::cerr <<
         "second argument to built-in function 'cons' is not a list\n";
       return 0;
-    } else if (env->results.top() == rest) {
-      // steal
-      std::cout << "cons: stealing newly created 'rest'\n";
+    }
+    tail = (Cell*)rest->value.p;
+    if (env->results.top() == rest && !Cell::isShared(rest)) {
+      // reuse the list cell, since it was just created by eval
+      LUM_TRACE(CONS, 1, "reusing newly created 'rest'");
       env->results.pop();
-    } else {
-      // copy
-      std::cout << "cons: copying existing 'rest'\n";
-      rest = Cell::copy(rest);
+      list = rest;
     }
-  } else {
-    rest = Cell::createList(0);
   }
 
   // First, evaluate `first`
   Cell* first = eval(env, args);
-  if (env->results.top() == first) {
-    std::cout << "cons: stealing newly created 'first'\n";
+  if (Cell::isImm(first)) {
+    // an immediate has no `rest` to link through, so give it a cell
+    first = Cell::box(first, tail);
+  } else if (env->results.top() == first && !Cell::isShared(first)) {
+    LUM_TRACE(CONS, 1, "stealing newly created 'first'");
     // steal, since first was just created by eval, so we know for sure
     // that no one is referencing this `first` cell.
     env->results.pop();
+    first->set_rest(tail);
   } else {
-    std::cout << "cons: copying existing 'first'\n";
-    // copy, as this is a value by reference and other's might reference it
-    first = Cell::copy(first);
+    // `first` is linked into some other chain, so it needs a cell of its
+    // own. This copy is shallow.
+    first = Cell::copy(first, tail);
   }
 
-  // 1. first->rest = first(cons)
-  // 2. set-first(cons, first)
-  first->rest = (Cell*)rest->value.p;
-  rest->value.p = (void*)first;
-
-  return rest;
+  if (list == 0) {
+    return Cell::createList(first);
+  }
+  list->value.p = (void*)first;
+  return list;
 }
 DECL_BIF(cons, _cons, 1, true)
 
 
 static Cell* _in_ns(Env* env, Cell* arg) {
-  if (arg == 0 || arg->rest != 0) {
+  if (arg == 0 || arg->rest() != 0) {
     std::cerr << "built-in function 'in-ns' takes exactly one argument\n";
     return 0;
   }
@@ -244,7 +342,7 @@ DECL_BIF(in_ns, _in_ns, 1, false)
 
 
 static Cell* _def(Env* env, Cell* arg) {
-  if (arg == 0 || arg->rest == 0 || arg->rest->rest != 0) {
+  if (arg == 0 || arg->rest() == 0 || arg->rest()->rest() != 0) {
     std::cerr << "built-in function 'def' takes exactly two arguments\n";
     return 0;
   }
@@ -258,15 +356,19 @@ static Cell* _def(Env* env, Cell* arg) {
                  "built-in function 'def'\n";
     return 0;
   }
-  Var* v = env->define(sym, arg->rest);
+  Var* v = env->define(sym, arg->rest());
   return Cell::createVar(v);
 }
 DECL_BIF(def, _def, 2, false)
 
 
 static Cell* _fn(Env* env, Cell* args) {
+  // (fn #<fn> capture0 ...captureN), as compiled from an inner function
+  if (args != 0 && Cell::typeOf(args) == Type::FN) {
+    return eval_closure(env, args);
+  }
   // (fn (arg0 ...argN) body0 ...bodyN)
-  if (args == 0 || args->rest == 0) {
+  if (args == 0 || args->rest() == 0) {
     std::cerr << "built-in function 'fn' requires at least two arguments\n";
     return 0;
   }
@@ -280,13 +382,934 @@ static Cell* _fn(Env* env, Cell* args) {
   if (fn == 0 || !fn->compile(env)) {
     // Error
     Fn::free(fn);
-    Cell::free(args);
+    return 0;
   }
   return Cell::createFn(fn);
 }
 DECL_BIF(fn, _fn, 2, true)
 
 
+Cell* if_branch(Env* env, Cell* args) {
+  // (if test then else?)
+  if (args == 0 || args->rest() == 0 ||
+      (args->rest()->rest() != 0 && args->rest()->rest()->rest() != 0))
+  {
+    std::cerr << "built-in function 'if' takes two or three arguments\n";
+    return 0;
+  }
+  Cell* test = eval(env, args);
+  if (test == 0) {
+    return 0;
+  }
+  bool is_false =
+    (Cell::typeOf(test) == Type::BOOL && Cell::intValue(test) == 0) ||
+    (Cell::typeOf(test) == Type::SYM && Cell::ptrValue(test) == kSym_nil);
+  if (!is_false) {
+    return args->rest();
+  }
+  Cell* otherwise = args->rest()->rest();
+  return (otherwise == 0) ? Cell::createNil() : otherwise;
+}
+
+
+static Cell* _if(Env* env, Cell* args) {
+  Cell* branch = if_branch(env, args);
+  return (branch == 0) ? 0 : eval(env, branch);
+}
+DECL_BIF(if_, _if, 2, true)
+
+
+static Cell* _loop(Env* env, Cell* args) {
+  // (loop (name0 init0 ...nameN initN) body)
+  //
+  // In a function body, the compiler has turned this into a call of &loop
+  // (see below). Anywhere else, it becomes a function of the names which is
+  // applied to the initial values, ('(fn (name0 ...nameN) body) init0
+  // ...initN), which `recur` in the body calls again.
+  if (args == 0 || args->type != Type::LIST || args->rest() == 0) {
+    std::cerr << "'loop' requires a list of bindings and a body\n";
+    return 0;
+  }
+  Cell* names = 0;
+  Cell* inits = 0;
+  Cell* last_name = 0;
+  Cell* last_init = 0;
+  for (Cell* b = (Cell*)args->value.p; b != 0; b = b->rest()->rest()) {
+    if (b->type != Type::SYM || ((Sym*)b->value.p)->ns != 0 ||
+        b->rest() == 0)
+    {
+      std::cerr << "loop bindings must be pairs of unqualified symbols "
+                   "and values\n";
+      return 0;
+    }
+    Cell* name = Cell::createSym((Sym*)b->value.p);
+    Cell* init = Cell::copy(b->rest(), 0);
+    if (last_name == 0) {
+      names = name;
+      inits = init;
+    } else {
+      last_name->set_rest(name);
+      last_init->set_rest(init);
+    }
+    last_name = name;
+    last_init = init;
+  }
+  Cell* fn = Cell::createList(
+    Cell::createSym(kSym_fn, Cell::createList(names, args->rest())), inits);
+  return eval(env, Cell::createList(fn));
+}
+DECL_BIF(loop, _loop, 2, true)
+
+
+static Cell* _compiled_loop(Env* env, Cell* args) {
+  // (&loop (name0 init0 ...nameN initN) body), a loop in a function body
+  // whose body has been compiled along with it (see compile_loop)
+  return eval_loop(env, args);
+}
+DECL_BIF(compiled_loop, _compiled_loop, 2, true)
+const Bif const* kBif_compiled_loop = &kConstBif_compiled_loop;
+
+
+static Cell* _recur(Env* env, Cell* args) {
+  // Calls in tail position are handled by the loop or function itself
+  std::cerr << "'recur' can only be used in tail position of a loop or "
+               "function body\n";
+  return 0;
+}
+DECL_BIF(recur, _recur, 0, true)
+
+
+static Cell* _mem_stats(Env* env, Cell* args) {
+  // (mem-stats) => ((:kind live total bytes peak) ...)
+  if (args != 0) {
+    std::cerr << "built-in function 'mem-stats' takes no arguments\n";
+    return 0;
+  }
+  MemStat stats[kMemKindCount];
+  mem_stats(stats);
+  Cell* entries = 0;
+  uint32_t kind = kMemKindCount;
+  while (kind--) {
+    const char* name = mem_kind_name(kind);
+    const MemStat& s = stats[kind];
+    if (name == 0 || s.total == 0) {
+      continue;
+    }
+    Cell* values =
+      Cell::createInt(s.live,
+      Cell::createInt((int64_t)s.total,
+      Cell::createInt(s.bytes,
+      Cell::createInt(s.peak))));
+    Cell* entry = Cell::createKeyword(intern_sym(name), values);
+    entries = Cell::createList(entry, entries);
+  }
+  return Cell::createList(entries);
+}
+DECL_BIF(mem_stats, _mem_stats, 0, false)
+
+
+static Cell* _trace_dump(Env* env, Cell* args) {
+  // (trace-dump) => number of trace entries written to stderr
+  if (args != 0) {
+    std::cerr << "built-in function 'trace-dump' takes no arguments\n";
+    return 0;
+  }
+  size_t count = trace_dump(std::cerr);
+  trace_clear();
+  return Cell::createInt((int64_t)count);
+}
+DECL_BIF(trace_dump, _trace_dump, 0, false)
+
+
+// A value which is passed to a process as an argument, for its form
+static Cell* spawn_arg(Env* env, Cell* value, Cell* rest) {
+  value = capture_value(env, value);
+  switch (Cell::typeOf(value)) {
+    case Type::BOOL:
+    case Type::INT:
+    case Type::FLOAT: { return Cell::copy(value, rest); }
+    default:          { return Cell::createQuote(value, rest); }
+  }
+}
+
+
+static Cell* _spawn(Env* env, Cell* args) {
+  // (spawn f arg0 ...argN) => task which applies f to the arguments
+  if (args == 0) {
+    std::cerr << "built-in function 'spawn' requires at least one argument\n";
+    return 0;
+  }
+  Scheduler* sched = Scheduler::of(env);
+  if (sched == 0) {
+    std::cerr << "out of memory while starting the scheduler\n";
+    return 0;
+  }
+  // The process runs in the Env of a worker, which can not see our locals,
+  // so the function and its arguments are evaluated here. They are kept on
+  // the results while evaluating the rest, which may collect.
+  size_t results_index = env->results.index();
+  std::vector<size_t> value_indices;
+  for (Cell* arg = args; arg != 0; arg = arg->rest()) {
+    Cell* value = eval(env, arg);
+    if (value == 0) {
+      env->results.unwind(results_index);
+      return 0;
+    }
+    value_indices.push_back(env->results.index());
+    env->results.push(value);
+  }
+  env->nursery.suspend();
+  Cell* form = 0;
+  for (size_t i = value_indices.size(); i != 0; --i) {
+    form = spawn_arg(env, env->results.at(value_indices[i - 1]), form);
+  }
+  form = Cell::createList(form);
+  Cell::share(form);
+  env->nursery.resume();
+  env->results.unwind(results_index);
+  Cell* task = sched->spawn_cell(form);
+  if (task == 0) {
+    std::cerr << "out of memory while spawning a process\n";
+  }
+  return task;
+}
+DECL_BIF(spawn, _spawn, 1, true)
+
+
+// The value of the only argument of BIF `name`, if it is a cell of `type`
+static Cell* eval_only_arg(Env* env, Cell* args, Type type, const char* name) {
+  if (args == 0 || args->rest() != 0) {
+    std::cerr << "built-in function '" << name
+              << "' takes exactly one argument\n";
+    return 0;
+  }
+  Cell* arg = eval(env, args);
+  if (arg == 0) {
+    return 0;
+  }
+  if (type != Type::UNKNOWN && Cell::typeOf(arg) != type) {
+    const char* type_name = Cell::type_name(type);
+    std::cerr << "argument to '" << name << "' must be "
+              << (strchr("aeiou", type_name[0]) ? "an " : "a ") << type_name
+              << "\n";
+    return 0;
+  }
+  return arg;
+}
+
+
+// Wait for the task of `arg`, a TASK or FUTURE cell, and return its value.
+// Collection may happen while we wait. Everything we use is on the stacks
+// of `env`.
+static Cell* join_cell(Env* env, Cell* arg) {
+  Task* task = (Task*)arg->value.p;
+  return task->_sched->join(env, task);
+}
+
+
+static Cell* _join(Env* env, Cell* args) {
+  // (join task) => the value of the process, once it has finished
+  Cell* arg = eval_only_arg(env, args, Type::TASK, "join");
+  if (arg == 0) {
+    return 0;
+  }
+  Cell* result = join_cell(env, arg);
+  if (result == 0) {
+    std::cerr << "joined process failed\n";
+  }
+  return result;
+}
+DECL_BIF(join, _join, 1, false)
+
+
+static Cell* _future(Env* env, Cell* args) {
+  // (future expr) => future for the value of expr, evaluated in a process
+  Scheduler* sched = Scheduler::of(env);
+  if (sched == 0) {
+    std::cerr << "out of memory while starting the scheduler\n";
+    return 0;
+  }
+  // The expression becomes a function of no arguments, which the process
+  // calls: ('(fn () expr)). In a function body, the compiler has made it one
+  // already, (future #<fn> capture0 ...captureN), so that it captures the
+  // locals it uses.
+  Cell* fn;
+  if (args != 0 && Cell::typeOf(args) == Type::FN) {
+    fn = (args->rest() == 0) ? args : eval_closure(env, args);
+  } else if (args == 0 || args->rest() != 0) {
+    std::cerr << "built-in function 'future' takes exactly one argument\n";
+    return 0;
+  } else {
+    fn = eval(env, Cell::createList(
+      Cell::createSym(kSym_fn, Cell::createList(0, args))));
+  }
+  if (fn == 0) {
+    return 0;
+  }
+  env->nursery.suspend();
+  Cell* form = Cell::createList(spawn_arg(env, fn, 0));
+  Cell::share(form);
+  env->nursery.resume();
+  Cell* future = sched->spawn_cell(form, Type::FUTURE);
+  if (future == 0) {
+    std::cerr << "out of memory while spawning a process\n";
+  }
+  return future;
+}
+DECL_BIF(future, _future, 1, true)
+
+
+static Cell* _promise(Env* env, Cell* args) {
+  // (promise) => future for the value which is delivered to it
+  if (args != 0) {
+    std::cerr << "built-in function 'promise' takes no arguments\n";
+    return 0;
+  }
+  Scheduler* sched = Scheduler::of(env);
+  Cell* promise = (sched == 0) ? 0 : sched->promise_cell();
+  if (promise == 0) {
+    std::cerr << "out of memory while creating a promise\n";
+  }
+  return promise;
+}
+DECL_BIF(promise, _promise, 0, false)
+
+
+static Cell* _deliver(Env* env, Cell* args) {
+  // (deliver promise value) => whether value became the value of promise,
+  // which it does not if another value was delivered first
+  if (args == 0 || args->rest() == 0 || args->rest()->rest() != 0) {
+    std::cerr << "built-in function 'deliver' takes exactly two arguments\n";
+    return 0;
+  }
+  Cell* promise = eval(env, args);
+  if (promise == 0) {
+    return 0;
+  }
+  if (Cell::typeOf(promise) != Type::FUTURE ||
+      ((Task*)promise->value.p)->form != 0)
+  {
+    std::cerr << "first argument to 'deliver' must be a promise\n";
+    return 0;
+  }
+  // The promise is kept on the results, as evaluating the value may collect
+  size_t results_index = env->results.index();
+  env->results.push(promise);
+  Cell* value = eval(env, args->rest());
+  if (value == 0) {
+    env->results.unwind(results_index);
+    return 0;
+  }
+  Task* task = (Task*)promise->value.p;
+  bool is_delivered = task->_sched->deliver(task, capture_value(env, value));
+  env->results.unwind(results_index);
+  return Cell::immBool(is_delivered);
+}
+DECL_BIF(deliver, _deliver, 2, false)
+
+
+static Cell* _deref(Env* env, Cell* args) {
+  // (deref future) => the value of the future or promise, once there is one.
+  // Whether there is one already is a single load, see Task::done.
+  // (deref atom) => the current value of the atom
+  Cell* arg = eval_only_arg(env, args, Type::UNKNOWN, "deref");
+  if (arg == 0) {
+    return 0;
+  }
+  if (Cell::typeOf(arg) == Type::ATOM) {
+    return ((Atom*)arg->value.p)->get();
+  }
+  if (Cell::typeOf(arg) != Type::FUTURE) {
+    std::cerr << "argument to 'deref' must be a future or an atom\n";
+    return 0;
+  }
+  Cell* result = join_cell(env, arg);
+  if (result == 0) {
+    std::cerr << "dereferenced future failed\n";
+  }
+  return result;
+}
+DECL_BIF(deref, _deref, 1, false)
+
+
+// ---- Atoms ----
+
+// `value` as the value of an atom: in the heap and shared
+static Cell* atom_value(Env* env, Cell* value) {
+  value = capture_value(env, value);
+  if (!Cell::isImm(value)) {
+    Cell::share(value);
+  }
+  return value;
+}
+
+
+// Whether `a` and `b` are the same value for compare-and-set!: the same cell,
+// or equal numbers, booleans or symbols, which may or may not be immediates
+static bool is_same_value(Cell* a, Cell* b) {
+  if (a == b) {
+    return true;
+  }
+  Type type = Cell::typeOf(a);
+  if (type != Cell::typeOf(b)) {
+    return false;
+  }
+  switch (type) {
+    case Type::INT:
+    case Type::BOOL:    { return Cell::intValue(a) == Cell::intValue(b); }
+    case Type::FLOAT:   { return Cell::floatValue(a) == Cell::floatValue(b); }
+    case Type::SYM:
+    case Type::KEYWORD: { return Cell::ptrValue(a) == Cell::ptrValue(b); }
+    default:            { return false; }
+  }
+}
+
+
+// The atom of the first of `args`, or NULL. Its cell is pushed onto
+// env->results, which keeps the atom alive while the rest is evaluated.
+static Atom* eval_atom(Env* env, Cell* args, const char* name) {
+  Cell* arg = eval(env, args);
+  if (arg == 0) {
+    return 0;
+  }
+  if (Cell::typeOf(arg) != Type::ATOM) {
+    std::cerr << "first argument to '" << name << "' must be an atom\n";
+    return 0;
+  }
+  env->results.push(arg);
+  return (Atom*)arg->value.p;
+}
+
+
+static Cell* _atom(Env* env, Cell* args) {
+  // (atom value) => atom holding value
+  Cell* value = eval_only_arg(env, args, Type::UNKNOWN, "atom");
+  if (value == 0) {
+    return 0;
+  }
+  Atom* atom = Atom::create(atom_value(env, value));
+  if (atom == 0) {
+    std::cerr << "out of memory while creating an atom\n";
+    return 0;
+  }
+  return Cell::createPtr(Type::ATOM, (void*)atom, 0);
+}
+DECL_BIF(atom, _atom, 1, false)
+
+
+static Cell* _swap(Env* env, Cell* args) {
+  // (swap! atom f arg0 ...argN) => new value of atom, (f value arg0 ...argN)
+  //
+  // f is applied to the current value until the atom still holds that value
+  // when it is set to the result, so f may be applied more than once.
+  if (args == 0 || args->rest() == 0) {
+    std::cerr << "built-in function 'swap!' requires at least two arguments\n";
+    return 0;
+  }
+  // The atom, f and the arguments are kept on the results, as evaluating
+  // the rest may collect
+  size_t results_index = env->results.index();
+  Atom* atom = eval_atom(env, args, "swap!");
+  if (atom == 0) {
+    env->results.unwind(results_index);
+    return 0;
+  }
+  args = args->rest();
+  Cell* f = eval(env, args);
+  if (f == 0) {
+    env->results.unwind(results_index);
+    return 0;
+  }
+  if (Cell::typeOf(f) != Type::FN && Cell::typeOf(f) != Type::BIF) {
+    std::cerr << "second argument to 'swap!' must be a function\n";
+    env->results.unwind(results_index);
+    return 0;
+  }
+  env->results.push(f);
+  // (f 'value 'arg0 ...'argN), with the value set for each attempt
+  Cell* call_args = 0;
+  std::vector<size_t> value_indices;
+  for (Cell* arg = args->rest(); arg != 0; arg = arg->rest()) {
+    Cell* value = eval(env, arg);
+    if (value == 0) {
+      env->results.unwind(results_index);
+      return 0;
+    }
+    value_indices.push_back(env->results.index());
+    env->results.push(value);
+  }
+  for (size_t i = value_indices.size(); i-- != 0; ) {
+    call_args = Cell::createQuote(env->results.at(value_indices[i]),
+                                  call_args);
+  }
+  Cell* value_arg = Cell::createQuote(0, call_args);
+  Cell* call = Cell::createList(Cell::createQuote(f, value_arg));
+  env->results.push(call);
+  size_t call_index = env->results.index();
+  while (true) {
+    Cell* value = atom->get();
+    value_arg->value.p = (void*)value;
+    Cell* result = eval(env, call);
+    if (result == 0) {
+      env->results.unwind(results_index);
+      return 0;
+    }
+    result = atom_value(env, result);
+    if (atom->compare_and_set(value, result)) {
+      env->results.unwind(results_index);
+      return result;
+    }
+    atom->count_retry();
+    env->results.unwind(call_index);
+  }
+}
+DECL_BIF(swap, _swap, 2, true)
+
+
+static Cell* _reset(Env* env, Cell* args) {
+  // (reset! atom value) => value, which the atom is set to
+  if (args == 0 || args->rest() == 0 || args->rest()->rest() != 0) {
+    std::cerr << "built-in function 'reset!' takes exactly two arguments\n";
+    return 0;
+  }
+  size_t results_index = env->results.index();
+  Atom* atom = eval_atom(env, args, "reset!");
+  if (atom == 0) {
+    env->results.unwind(results_index);
+    return 0;
+  }
+  Cell* value = eval(env, args->rest());
+  if (value != 0) {
+    value = atom_value(env, value);
+    atom->reset(value);
+  }
+  env->results.unwind(results_index);
+  return value;
+}
+DECL_BIF(reset, _reset, 2, false)
+
+
+static Cell* _compare_and_set(Env* env, Cell* args) {
+  // (compare-and-set! atom old new) => whether the atom was set to new,
+  // which it is if its value is the same as old
+  if (args == 0 || args->rest() == 0 || args->rest()->rest() == 0 ||
+      args->rest()->rest()->rest() != 0)
+  {
+    std::cerr << "built-in function 'compare-and-set!' takes exactly three "
+                 "arguments\n";
+    return 0;
+  }
+  size_t results_index = env->results.index();
+  Atom* atom = eval_atom(env, args, "compare-and-set!");
+  if (atom == 0) {
+    env->results.unwind(results_index);
+    return 0;
+  }
+  Cell* expected = eval(env, args->rest());
+  if (expected == 0) {
+    env->results.unwind(results_index);
+    return 0;
+  }
+  env->results.push(expected);
+  Cell* value = eval(env, args->rest()->rest());
+  if (value == 0) {
+    env->results.unwind(results_index);
+    return 0;
+  }
+  value = atom_value(env, value);
+  // The atom may hold an equal number in another cell, which is the one to
+  // swap out
+  bool is_set;
+  while (true) {
+    Cell* current = atom->get();
+    if (!is_same_value(current, expected)) {
+      is_set = false;
+      break;
+    }
+    if (atom->compare_and_set(current, value)) {
+      is_set = true;
+      break;
+    }
+    atom->count_retry();
+  }
+  env->results.unwind(results_index);
+  return Cell::immBool(is_set);
+}
+DECL_BIF(compare_and_set, _compare_and_set, 3, false)
+
+
+static Cell* _atom_stats(Env* env, Cell* args) {
+  // (atom-stats atom) => (updates retries), where retries counts the times
+  // swap! and compare-and-set! lost a race with another update and tried
+  // again. A compare-and-set! with another old value is not a lost race.
+  Cell* arg = eval_only_arg(env, args, Type::ATOM, "atom-stats");
+  if (arg == 0) {
+    return 0;
+  }
+  const Atom* atom = (const Atom*)arg->value.p;
+  return Cell::createList(
+    Cell::createInt((int64_t)atom->updates(),
+    Cell::createInt((int64_t)atom->retries())));
+}
+DECL_BIF(atom_stats, _atom_stats, 1, false)
+
+
+// ---- Parallel sequence functions ----
+//
+// (pmap f list), (pfilter f list) and (preduce f init list) split `list` into
+// chunks which are processed as processes (see sched.h), each by a worker in
+// an Env of its own, and put the results back together in order. The result
+// is the same as that of doing the same one element after another, as long as
+// `f` has no side effects, and for preduce also that `f` is associative:
+// chunks are reduced on their own, starting from their first element, and
+// their reductions are then reduced, starting from that of `init` and the
+// first few elements.
+//
+// The first few elements are processed right away, which measures how long
+// `f` takes per element. Chunks are then made large enough to take about
+// kChunkNs each, which keeps the cost of spawning and joining small, but
+// small enough for each worker to get several. A list which would be done
+// within a couple of chunks is processed without any parallelism at all.
+
+enum class SeqOp : int64_t { MAP, FILTER, REDUCE };
+
+static constexpr size_t  kSeqSampleSize = 16;
+static constexpr int64_t kSeqChunkNs = 100000;
+static constexpr size_t  kSeqChunksPerWorker = 4;
+
+static inline bool is_truthy(Cell* c) {
+  Type t = Cell::typeOf(c);
+  return !((t == Type::BOOL && Cell::intValue(c) == 0) ||
+           (t == Type::SYM && Cell::ptrValue(c) == kSym_nil));
+}
+
+// Make `out` a shallow copy of `value`, keeping its `rest` and flags. Lists
+// in the nursery of `env` are copied to the heap, as `out` outlives them.
+static void set_cell(Env* env, Cell* out, Cell* value) {
+  Type type = Cell::typeOf(value);
+  if (type == Type::LIST || type == Type::QUOTE) {
+    value = capture_value(env, value);
+  }
+  out->set_type(type);
+  if (!Cell::isImm(value)) {
+    out->value = value->value;
+  } else if (type == Type::FLOAT) {
+    out->value.f = Cell::floatValue(value);
+  } else if (type == Type::INT || type == Type::BOOL) {
+    out->value.i = Cell::intValue(value);
+  } else {
+    out->value.p = Cell::ptrValue(value);
+  }
+}
+
+// Apply `f` to the `count` elements starting at `in`. MAP and FILTER set the
+// cells starting at `out` to the value of, or whether to keep, each element.
+// REDUCE sets `out` to the reduction of the elements, starting from `acc`,
+// or from the first element if `acc` is NULL. Returns false on error.
+static bool seq_chunk(Env* env, SeqOp op, Cell* f, Cell* in, size_t count,
+                      Cell* out, Cell* acc)
+{
+  size_t results_index = env->results.index();
+  // (f 'element) or (f 'acc 'element), with the arguments set as we go
+  Cell* arg = Cell::createQuote(0);
+  Cell* acc_arg = (op == SeqOp::REDUCE) ? Cell::createQuote(0, arg) : arg;
+  Cell* call = Cell::createList(Cell::createQuote(f, acc_arg));
+  env->results.push(call);
+  size_t call_index = env->results.index();
+  for (size_t i = 0; i != count; ++i, in = in->rest()) {
+    if (op == SeqOp::REDUCE && acc == 0) {
+      acc = in;
+      env->results.push(acc);
+      continue;
+    }
+    arg->value.p = (void*)in;
+    acc_arg->value.p = (op == SeqOp::REDUCE) ? (void*)acc : (void*)in;
+    Cell* r = eval(env, call);
+    if (r == 0) {
+      env->results.unwind(results_index);
+      return false;
+    }
+    env->results.unwind(call_index);
+    switch (op) {
+      case SeqOp::MAP:    { set_cell(env, out, r); out = out->rest(); break; }
+      case SeqOp::FILTER: {
+        set_cell(env, out, Cell::immBool(is_truthy(r)));
+        out = out->rest();
+        break;
+      }
+      case SeqOp::REDUCE: { acc = r; env->results.push(acc); break; }
+    }
+  }
+  if (op == SeqOp::REDUCE) {
+    set_cell(env, out, acc);
+  }
+  env->results.unwind(results_index);
+  return true;
+}
+
+
+// (&pseq-chunk op 'f 'in count 'out), the form of a process running
+// seq_chunk. Arguments are not evaluated.
+static Cell* _pseq_chunk(Env* env, Cell* args) {
+  SeqOp op = (SeqOp)args->value.i;
+  args = args->rest();
+  Cell* f = (Cell*)args->value.p;
+  args = args->rest();
+  Cell* in = (Cell*)args->value.p;
+  args = args->rest();
+  size_t count = (size_t)args->value.i;
+  Cell* out = (Cell*)args->rest()->value.p;
+  if (!seq_chunk(env, op, f, in, count, out, 0)) {
+    return 0;
+  }
+  return Cell::immBool(true);
+}
+DECL_BIF(pseq_chunk, _pseq_chunk, 5, false)
+
+
+// A chain of `count` heap cells, which are nil until set_cell is applied
+static Cell* heap_chain(size_t count) {
+  Cell* chain = 0;
+  while (count--) {
+    chain = Cell::createSym(kSym_nil, chain);
+  }
+  return chain;
+}
+
+
+// Process the `count` elements of `in` in chunks of `chunk_size` on the
+// scheduler, setting the cells of `out` as seq_chunk does, one for each
+// element or, for REDUCE, one for each chunk. Returns false on error.
+static bool seq_parallel(Env* env, SeqOp op, Cell* f, Cell* in, size_t count,
+                         Cell* out, size_t chunk_size)
+{
+  Scheduler* sched = Scheduler::of(env);
+  if (sched == 0) {
+    return seq_chunk(env, op, f, in, count, out, 0);
+  }
+  std::vector<Task*> tasks;
+  // The caller does the first chunk itself
+  Cell* first_in = in;
+  Cell* first_out = out;
+  size_t first_count = LUM_MIN(chunk_size, count);
+  for (size_t i = 0; i != first_count; ++i) {
+    in = in->rest();
+    if (op != SeqOp::REDUCE) {
+      out = out->rest();
+    }
+  }
+  if (op == SeqOp::REDUCE) {
+    out = out->rest();
+  }
+  bool ok = true;
+  for (size_t start = first_count; start < count; start += chunk_size) {
+    size_t n = LUM_MIN(chunk_size, count - start);
+    env->nursery.suspend();
+    Cell* form = Cell::createList(Cell::createPtr(Type::BIF,
+      (void*)&kConstBif_pseq_chunk,
+      Cell::createInt((int64_t)op,
+      Cell::createQuote(f,
+      Cell::createQuote(in,
+      Cell::createInt((int64_t)n,
+      Cell::createQuote(out)))))));
+    env->nursery.resume();
+    Task* task = sched->spawn(form);
+    if (task == 0) {
+      ok = ok && seq_chunk(env, op, f, in, n, out, 0);
+    } else {
+      tasks.push_back(task);
+    }
+    for (size_t i = 0; i != n; ++i) {
+      in = in->rest();
+      if (op != SeqOp::REDUCE) {
+        out = out->rest();
+      }
+    }
+    if (op == SeqOp::REDUCE) {
+      out = out->rest();
+    }
+  }
+  ok = seq_chunk(env, op, f, first_in, first_count, first_out, 0) && ok;
+  size_t results_index = env->results.index();
+  for (Task* task : tasks) {
+    ok = (sched->join(env, task) != 0) && ok;
+  }
+  env->results.unwind(results_index);
+  return ok;
+}
+
+
+static Cell* _pseq(Env* env, Cell* args, SeqOp op, const char* name) {
+  size_t arg_count = (op == SeqOp::REDUCE) ? 3 : 2;
+  size_t n = 0;
+  for (Cell* arg = args; arg != 0; arg = arg->rest()) {
+    ++n;
+  }
+  if (n != arg_count) {
+    std::cerr << "built-in function '" << name << "' takes exactly "
+              << arg_count << " arguments\n";
+    return 0;
+  }
+  size_t results_index = env->results.index();
+  Cell* f = eval(env, args);
+  if (f == 0) {
+    return 0;
+  }
+  Type f_type = Cell::typeOf(f);
+  if (f_type != Type::FN && f_type != Type::BIF) {
+    std::cerr << "first argument to '" << name << "' must be a function\n";
+    return 0;
+  }
+  // Everything which processes see is kept in the heap
+  f = capture_value(env, f);
+  env->results.push(f);
+  Cell* acc = 0;
+  if (op == SeqOp::REDUCE) {
+    args = args->rest();
+    if ((acc = eval(env, args)) == 0) {
+      return 0;
+    }
+    acc = capture_value(env, acc);
+    env->results.push(acc);
+  }
+  Cell* list = eval(env, args->rest());
+  if (list == 0) {
+    return 0;
+  }
+  if (Cell::typeOf(list) != Type::LIST) {
+    std::cerr << "last argument to '" << name << "' must be a list\n";
+    return 0;
+  }
+  list = capture_value(env, list);
+  env->results.push(list);
+  Cell* in = (Cell*)list->value.p;
+  size_t count = 0;
+  for (Cell* c = in; c != 0; c = c->rest()) {
+    ++count;
+  }
+
+  // Values (or whether to keep them) for all elements. For REDUCE, the
+  // reduction of the sample followed by those of the chunks.
+  env->nursery.suspend();
+  Cell* out = Cell::createList(heap_chain(op == SeqOp::REDUCE ? 1 : count));
+  env->nursery.resume();
+  env->results.push(out);
+  Cell* out_first = (Cell*)out->value.p;
+
+  // Sample
+  size_t sample = LUM_MIN(count, kSeqSampleSize);
+  auto start = std::chrono::steady_clock::now();
+  bool ok = seq_chunk(env, op, f, in, sample, out_first, acc);
+  auto end = std::chrono::steady_clock::now();
+  int64_t ns_per_element = LUM_MAX((int64_t)1, (int64_t)
+    std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() /
+    (int64_t)LUM_MAX(sample, (size_t)1));
+
+  // The rest
+  Cell* rest_in = in;
+  Cell* rest_out = out_first;
+  for (size_t i = 0; i != sample; ++i) {
+    rest_in = rest_in->rest();
+    if (op != SeqOp::REDUCE) {
+      rest_out = rest_out->rest();
+    }
+  }
+  size_t rest_count = count - sample;
+  if (ok && rest_count != 0) {
+    uint32_t workers = Scheduler::of(env) ? Scheduler::of(env)->worker_count()
+                                          : 1;
+    size_t chunk_size = (size_t)LUM_MAX((int64_t)1,
+                                        kSeqChunkNs / ns_per_element);
+    size_t min_chunks = workers * kSeqChunksPerWorker;
+    chunk_size = LUM_MIN(chunk_size, (rest_count + min_chunks - 1) /
+                                     min_chunks);
+    chunk_size = LUM_MAX(chunk_size, (size_t)1);
+    bool is_small = workers < 2 ||
+      (int64_t)rest_count * ns_per_element < 2 * kSeqChunkNs;
+    if (op == SeqOp::REDUCE) {
+      env->nursery.suspend();
+      Cell* result = Cell::createSym(kSym_nil);
+      env->nursery.resume();
+      env->results.push(result);
+      if (is_small) {
+        // Go on from the reduction of the sample, one element after another
+        ok = seq_chunk(env, op, f, rest_in, rest_count, result, out_first);
+      } else {
+        // Reduce the chunks, then the reductions of the sample and of the
+        // chunks, which only gives the same result for an associative `f`
+        size_t chunks = (rest_count + chunk_size - 1) / chunk_size;
+        env->nursery.suspend();
+        rest_out = heap_chain(chunks);
+        out_first->set_rest(rest_out);
+        env->nursery.resume();
+        ok = seq_parallel(env, op, f, rest_in, rest_count, rest_out,
+                          chunk_size) &&
+             seq_chunk(env, op, f, rest_out, chunks, result, out_first);
+      }
+      out_first = result;
+    } else {
+      ok = is_small
+        ? seq_chunk(env, op, f, rest_in, rest_count, rest_out, 0)
+        : seq_parallel(env, op, f, rest_in, rest_count, rest_out, chunk_size);
+    }
+  }
+  if (!ok) {
+    env->results.unwind(results_index);
+    return 0;
+  }
+
+  Cell* result;
+  switch (op) {
+    case SeqOp::MAP: { result = out; break; }
+    case SeqOp::REDUCE: { result = out_first; break; }
+    case SeqOp::FILTER: {
+      Cell* head = 0;
+      Cell* tail = 0;
+      for (Cell* c = out_first; c != 0; c = c->rest(), in = in->rest()) {
+        if (Cell::intValue(c)) {
+          Cell* kept = Cell::copy(in, 0);
+          if (tail == 0) {
+            head = kept;
+          } else {
+            tail->set_rest(kept);
+          }
+          tail = kept;
+        }
+      }
+      result = Cell::createList(head);
+      break;
+    }
+  }
+  env->results.unwind(results_index);
+  return result;
+}
+
+
+static Cell* _pmap(Env* env, Cell* args) {
+  // (pmap f list) => ((f e0) ...(f eN))
+  return _pseq(env, args, SeqOp::MAP, "pmap");
+}
+DECL_BIF(pmap, _pmap, 2, false)
+
+
+static Cell* _pfilter(Env* env, Cell* args) {
+  // (pfilter f list) => the elements e of list for which (f e) is true
+  return _pseq(env, args, SeqOp::FILTER, "pfilter");
+}
+DECL_BIF(pfilter, _pfilter, 2, false)
+
+
+static Cell* _preduce(Env* env, Cell* args) {
+  // (preduce f init list) => (f (...(f (f init e0) e1)...) eN)
+  //
+  // f must be associative, (f (f a b) c) being the same as (f a (f b c)), as
+  // a list which is long enough is reduced in chunks in parallel. A list
+  // which is not is reduced one element after another, for any f.
+  return _pseq(env, args, SeqOp::REDUCE, "preduce");
+}
+DECL_BIF(preduce, _preduce, 3, false)
+
+
 // Initialize exported pointers to internal constants.
 // Also sets the names of the structs to point to built-in constant strings.
 static volatile const struct _BifInitializer {
@@ -296,6 +1319,8 @@ static volatile const struct _BifInitializer {
       const_cast<Bif*>(kBif_##Name)->name = kStr_##Name;
     #include "bif-defs.h"
     #undef LUM_BIF_APPLY
+    const_cast<Bif*>(&kConstBif_pseq_chunk)->name = kStr_pseq_chunk;
+    const_cast<Bif*>(&kConstBif_compiled_loop)->name = kStr_compiled_loop;
   }
 } _bif_initializer;
 
@@ -12,26 +12,51 @@ struct Str;
 
 struct Bif {
   typedef Cell* (*Impl)(Env*,Cell*);
-  constexpr Bif(Impl i, size_t pc, bool av)
+  constexpr Bif(Impl i, size_t pc, bool av, bool pure=false,
+                Impl i1=0, Impl i2=0)
       : apply(i)
+      , apply1(i1)
+      , apply2(i2)
       , _param_count(pc)
       , accepts_varargs(av)
+      , is_pure(pure)
       , name(0) {}
 
   size_t param_count() const { return _param_count; }
 
+  // The implementation to apply to exactly `count` arguments
+  Impl apply_fixed(size_t count) const {
+    Impl i = (count == 1) ? apply1 : (count == 2) ? apply2 : 0;
+    return (i == 0) ? apply : i;
+  }
+
   Impl apply; // Cell* apply(Env* env, Cell* args) const
+  // Optional specializations of `apply` for one and two arguments, which
+  // calls whose arity is known when compiling use instead
+  Impl apply1;
+  Impl apply2;
   size_t _param_count;
   bool accepts_varargs;
+  // A pure function has no side effects and returns a value which does not
+  // reference any of its arguments, so arguments never escape through it.
+  bool is_pure;
   const Str* name;
 };
 
 std::ostream& operator<< (std::ostream& os, const Bif const*);
 
+// The branch of (if test then else) which is taken for `args`, after
+// evaluating the test. Returns nil if there is no such branch, and NULL on
+// error.
+Cell* if_branch(Env* env, Cell* args);
+
 #define LUM_BIF_APPLY(Name, ...) \
   extern const Bif const* kBif_##Name;
 #include <lum/bif-defs.h>
 #undef LUM_BIF_APPLY
 
+// Applied instead of `loop` to loops in function bodies, see fn.cc
+extern const Bif const* kBif_compiled_loop;
+
 } // namespace lum
 #endif // _LUM_BIF_H_
@@ -0,0 +1,84 @@
+#include <lum/bif.h>
+#include <lum/cell.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include "test.h"
+
+using namespace lum;
+
+// Apply `bif` to `args` both in general and through its specialization for
+// their number, and check that the results are the same
+static Cell* apply_both(Env& env, const Bif* bif, Cell* args) {
+  size_t count = 0;
+  for (Cell* a = args; a != 0; a = a->rest()) {
+    ++count;
+  }
+  Bif::Impl fixed = bif->apply_fixed(count);
+  assert_true(fixed != bif->apply);
+  Cell* expected = bif->apply(&env, args);
+  Cell* actual = fixed(&env, args);
+  if (actual == 0 || expected == 0) {
+    assert_eq(actual, expected);
+  } else if (Cell::typeOf(actual) != Cell::typeOf(expected)) {
+    assert_true(Cell::typeOf(actual) == Cell::typeOf(expected));
+  } else if (Cell::typeOf(actual) == Type::FLOAT) {
+    assert_true(Cell::floatValue(actual) == Cell::floatValue(expected));
+  } else {
+    assert_eq(Cell::intValue(actual), Cell::intValue(expected));
+  }
+  env.results.unwind(0);
+  return actual;
+}
+
+int main(int argc, const char** argv) {
+  Env env;
+  const Bif* ops[] = {kBif_sum, kBif_sub, kBif_mul, kBif_div, kBif_rem};
+
+  // Specializations give the same results for all kinds of numbers, and for
+  // arguments which need to be evaluated
+  for (const Bif* op : ops) {
+    assert_eq(op->apply_fixed(3), op->apply);
+    apply_both(env, op, Cell::createInt(7, Cell::createInt(3)));
+    apply_both(env, op, Cell::createInt(-3000000000, Cell::createInt(7)));
+    apply_both(env, op, Cell::createInt(7, Cell::createFloat(2.5)));
+    apply_both(env, op, Cell::createFloat(7.5, Cell::createInt(2)));
+    apply_both(env, op, Cell::createFloat(7.5, Cell::createFloat(-2.5)));
+    apply_both(env, op, Cell::createInt(9));
+    apply_both(env, op, Cell::createFloat(9.5));
+    apply_both(env, op,
+      list(sym("+", Cell::createInt(1, Cell::createInt(2))),
+      list(sym("*", Cell::createInt(3, Cell::createFloat(0.5))))));
+    assert_null(apply_both(env, op, Cell::createInt(1, sym("nope"))));
+    assert_null(apply_both(env, op,
+      Cell::createBool(true, Cell::createInt(1))));
+    assert_null(apply_both(env, op, list(sym("="), Cell::createInt(1))));
+  }
+  Cell* r = apply_both(env, kBif_sub, Cell::createInt(7, Cell::createInt(3)));
+  assert_eq(Cell::intValue(r), 4);
+  r = apply_both(env, kBif_div, Cell::createInt(7, Cell::createFloat(2.0)));
+  assert_true(Cell::floatValue(r) == 3.5);
+
+  // Calls in function bodies with one or two arguments are marked, and
+  // evaluate to the same as they would otherwise
+  // (fn (a) (+ (- a) (* a 2) (rem a 3 2)))
+  Cell* params = list(sym("a"), list(sym("+",
+    list(sym("-", sym("a")),
+    list(sym("*", sym("a", Cell::createInt(2))),
+    list(sym("rem", sym("a", Cell::createInt(3, Cell::createInt(2))))))))));
+  Cell* fn = eval(&env, list(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  Cell* body = ((Fn*)fn->value.p)->body();
+  Cell* arg = ((Cell*)body->value.p)->rest();
+  assert_eq(body->flags & (Cell::kFlagArity1 | Cell::kFlagArity2), 0);
+  assert_not_eq(arg->flags & Cell::kFlagArity1, 0);
+  assert_not_eq(arg->rest()->flags & Cell::kFlagArity2, 0);
+  assert_eq(arg->rest()->rest()->flags &
+            (Cell::kFlagArity1 | Cell::kFlagArity2), 0);
+  fn = Cell::copy(fn);
+  env.results.unwind(0);
+  r = eval(&env, list(Cell::copy(fn, Cell::createInt(10))));
+  assert_eq(Cell::intValue(r), 10 + 20 + 1);
+  env.results.unwind(0);
+
+  return 0;
+}
@@ -1,7 +1,39 @@
 #include <lum/cell.h>
+#include <lum/heap.h>
+#include <lum/gc.h>
+#include <lum/nursery.h>
 
 namespace lum {
 
+Cell Cell::kNil;
+Cell Cell::kTrue;
+Cell Cell::kFalse;
+Cell Cell::kSmallInts[Cell::kSmallIntMax - Cell::kSmallIntMin + 1];
+
+static void init_immortal(Cell* c, Type type) {
+  c->type = type;
+  c->flags = Cell::kFlagImmortal | Cell::kFlagShared;
+  c->_rest = 0;
+}
+
+static volatile const struct _CellInitializer {
+  _CellInitializer() {
+    // Depends on kSym_nil having been set up (see sym.cc)
+    init_immortal(&Cell::kNil, Type::SYM);
+    Cell::kNil.value.p = (void*)kSym_nil;
+    init_immortal(&Cell::kTrue, Type::BOOL);
+    Cell::kTrue.value.i = 1;
+    init_immortal(&Cell::kFalse, Type::BOOL);
+    Cell::kFalse.value.i = 0;
+    for (int64_t v = Cell::kSmallIntMin; v <= Cell::kSmallIntMax; ++v) {
+      Cell* c = &Cell::kSmallInts[v - Cell::kSmallIntMin];
+      init_immortal(c, Type::INT);
+      c->value.i = v;
+    }
+  }
+} _cell_initializer;
+
+
 const char* Cell::type_name(Type type) {
   switch (type) {
     case Type::UNKNOWN: { return "unknown"; }
@@ -17,28 +49,156 @@ const char* Cell::type_name(Type type) {
     case Type::QUOTE:   { return "quote"; }
     case Type::LIST:    { return "list"; }
     case Type::NS:      { return "ns"; }
+    case Type::TASK:    { return "task"; }
+    case Type::FUTURE:  { return "future"; }
+    case Type::ATOM:    { return "atom"; }
   }
 }
 
+// Define to log every cell allocation, poison cell memory on allocation and
+// on free, and crash on double frees.
 // #define LUM_DEBUG_CELL_MEMORY 1
 
+// Every new cell starts out with a clean header. In particular, this clears
+// the heap's free-slot tag from the first word.
+static inline void init_header(Cell* c) {
+  c->type = Type::UNKNOWN;
+  c->flags = gc_alloc_flags();
+  c->set_rest(0);
+}
+
 Cell* Cell::alloc() {
+  Nursery* n = Nursery::current();
+  if (n != 0) {
+    Cell* c = n->alloc();
+    if (c == 0) {
+      LUM_FATAL("out of memory - unable to allocate cell");
+    }
+    init_header(c);
+    c->flags |= kFlagNursery;
+    return c;
+  }
+  return alloc_heap();
+}
+
+Cell* Cell::alloc_heap() {
+  Cell* c = (Cell*)heap_alloc(sizeof(Cell));
+  gc_note_alloc();
 #if LUM_DEBUG_CELL_MEMORY
-  Cell* c = (Cell*)std::malloc(sizeof(Cell));
+  memset((void*)c, 0xcd, sizeof(Cell));
   std::cout << "Cell::alloc " << (void*)c << " [" << sizeof(Cell) << "B]\n";
+#endif // LUM_DEBUG_CELL_MEMORY
+  init_header(c);
   return c;
-#else
-  return (Cell*)std::malloc(sizeof(Cell));
+}
+
+Cell* Cell::alloc_run(size_t* count) {
+  Nursery* n = Nursery::current();
+  if (n == 0) {
+    return alloc_heap_run(count);
+  }
+  Cell* run = n->alloc_run(count);
+  if (run == 0) {
+    LUM_FATAL("out of memory - unable to allocate cell");
+  }
+  for (size_t i = 0; i != *count; ++i) {
+    init_header(run + i);
+    run[i].flags |= kFlagNursery;
+  }
+  return run;
+}
+
+Cell* Cell::alloc_heap_run(size_t* count) {
+  Cell* run = (Cell*)heap_alloc_run(sizeof(Cell), count);
+  if (run == 0) {
+    LUM_FATAL("out of memory - unable to allocate cell");
+  }
+  for (size_t i = 0; i != *count; ++i) {
+    gc_note_alloc();
+#if LUM_DEBUG_CELL_MEMORY
+    memset((void*)(run + i), 0xcd, sizeof(Cell));
 #endif // LUM_DEBUG_CELL_MEMORY
+    init_header(run + i);
+  }
+  return run;
+}
+
+Cell* Cell::copyChain(Cell* first) {
+  Cell* head = 0;
+  Cell* prev = 0;
+  Cell* c = first;
+  while (c != 0) {
+    size_t count = 0;
+    for (Cell* p = c; p != 0; p = p->rest()) {
+      ++count;
+    }
+    Cell* run = alloc_run(&count);
+    for (size_t i = 0; i != count; ++i) {
+      Cell* nc = run + i;
+      uint32_t flags = nc->flags;
+      memcpy((void*)nc, (const void*)c, sizeof(Cell));
+      nc->flags = flags;
+      note_alloc(nc);
+      if (prev == 0) {
+        head = nc;
+      } else {
+        prev->set_rest(nc);
+      }
+      prev = nc;
+      c = c->rest();
+    }
+  }
+  if (prev != 0) {
+    prev->set_rest(0);
+  }
+  return head;
+}
+
+Cell* Cell::copyTree(Cell* first) {
+  Cell* head = copyChain(first);
+  for (Cell* c = head; c != 0; c = c->rest()) {
+    if (c->type == Type::LIST || c->type == Type::QUOTE) {
+      c->value.p = (void*)copyTree((Cell*)c->value.p);
+    }
+  }
+  return head;
+}
+
+void Cell::share(Cell* c) {
+  std::vector<Cell*> lists;
+  while (1) {
+    // Follow the rest chain, descending into nested lists afterwards
+    while (c != 0 && !isImm(c) && !isShared(c)) {
+      c->flags |= kFlagShared;
+      if (c->type == Type::LIST || c->type == Type::QUOTE) {
+        lists.push_back((Cell*)c->value.p);
+      }
+      c = c->rest();
+    }
+    if (lists.empty()) {
+      break;
+    }
+    c = lists.back();
+    lists.pop_back();
+  }
 }
 
 void Cell::free(Cell* c) {
-  // TODO some serious work... Yikes
+  if (c == 0 || isImmortal(c)) {
+    return;
+  }
+  if (c->type != Type::UNKNOWN) {
+    mem_note_free((uint32_t)c->type, sizeof(Cell));
+  }
 #if LUM_DEBUG_CELL_MEMORY
+  if (heap_is_free(c)) {
+    LUM_CRASH("Cell::free: double free of cell %p", (void*)c);
+  }
   std::cout << "Cell::free " << (void*)c << " '";
   print1(std::cout,c) << "'\n";
+  memset((void*)c, 0xdb, sizeof(Cell));
 #endif // LUM_DEBUG_CELL_MEMORY
-  std::free(c);
+  heap_free(c);
 }
 
 } // namespace lum
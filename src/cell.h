@@ -2,12 +2,13 @@
 #define _LUM_CELL_H_
 
 #include <lum/common.h>
+#include <lum/memstats.h>
 #include <lum/print.h> // for operator<<Cell*
 #include <lum/sym.h>
 
 namespace lum {
 
-enum class Type : size_t {
+enum class Type : uint8_t {
   UNKNOWN,
   BOOL,
   INT,
@@ -21,7 +22,31 @@ enum class Type : size_t {
   QUOTE,
   LIST,  // (x ...)
   NS,
+  TASK,  // see sched.h
+  FUTURE, // a Task, see sched.h
+  ATOM,  // see atom.h
 };
+static constexpr uint32_t kTypeCount = (uint32_t)Type::ATOM + 1;
+static_assert(kTypeCount <= kMemKindCellTypes, "too many types for memstats");
+
+// On 64-bit targets, some values are represented by a Cell* which does not
+// point to a cell at all, but encodes the value itself ("NaN-boxing"):
+//
+//   0x0000 PPPP PPPP PPPP  pointer to a cell (low three bits clear), or 0
+//   0x0000 0000 0000 0002  nil
+//   0x0000 0000 0000 0006  false
+//   0x0000 0000 0000 0007  true
+//   0x0002 ... 0xfffd ...  float, stored as its bits plus 2^49
+//   0xfffe 0000 IIII IIII  int which fits in 32 bits
+//
+// Such immediates are only ever produced by evaluation, so that e.g. the
+// result of (+ 1 2) needs no allocation. Cells linked into a chain through
+// `rest` are always real cells, which Cell::box creates from an immediate.
+// Code inspecting the result of `eval` must use Cell::typeOf and friends
+// rather than accessing the fields of the cell directly.
+#ifndef LUM_CELL_IMMEDIATES
+  #define LUM_CELL_IMMEDIATES (LUM_TARGET_ARCH_SIZE == 64)
+#endif
 
 struct Namespace;
 struct Var;
@@ -31,44 +56,140 @@ struct Sym;
 struct Fn;
 struct Bif;
 
+// A cell is 16 bytes: one header word holding the type, flags and the `rest`
+// pointer, followed by the value. The pointer is stored in the low 48 bits of
+// the header, which is enough for user-space addresses on all the 64-bit
+// targets we support.
+//
+// Chains of cells are laid out as contiguous runs when they are created in
+// one go (see copyChain), which turns walking `rest` into a sequential scan.
 struct Cell {
-  Type type;
+  enum : uint32_t {
+    kFlagGCColor   = 1 << 0, // see gc.h
+    kFlagForwarded = 1 << 1, // moved out of the nursery; see nursery.h
+    kFlagImmortal  = 1 << 2, // shared and never freed; see kNil
+    kFlagShared    = 1 << 3, // immutable; see share()
+    kFlagNursery   = 1 << 4, // allocated in a nursery; see nursery.h
+    kFlagNoEscape  = 1 << 5, // value never outlives its caller; see fn.cc
+    kFlagArity1    = 1 << 6, // call with exactly one argument; see fn.cc
+    kFlagArity2    = 1 << 7, // call with exactly two arguments; see fn.cc
+  };
+
+  Type     type  : 8;
+  uint32_t flags : 8;
+  uint64_t _rest : 48;
   union { void* p; int64_t i; double f; } value;
-  Cell* rest;
 
-  constexpr Cell(const Sym const* p, Cell* rest=0)
-    : type(Type::SYM), value{.p=(void*)(p)}, rest(rest) {}
-  constexpr Cell(bool p, Cell* rest=0)
-    : type(Type::BOOL), value{.i=int64_t(p)}, rest(rest) {}
+  Cell(const Sym const* p, Cell* rest=0)
+    : type(Type::SYM), flags(0), _rest((uint64_t)(uintptr_t)rest)
+    , value{.p=(void*)(p)} {}
+  Cell(bool p, Cell* rest=0)
+    : type(Type::BOOL), flags(0), _rest((uint64_t)(uintptr_t)rest)
+    , value{.i=int64_t(p)} {}
+
+  Cell() = default;
+
+  Cell* rest() const { return (Cell*)(uintptr_t)_rest; }
+  void set_rest(Cell* c) {
+    assert((flags & kFlagShared) == 0 || c == rest());
+    _rest = (uint64_t)(uintptr_t)c;
+  }
+
+  // Statically allocated, immutable cells which are shared by everyone who
+  // asks for nil, a bool or a small int without a `rest`. These have
+  // kFlagImmortal set, are never freed and must never be modified.
+  static Cell kNil;
+  static Cell kTrue;
+  static Cell kFalse;
+  static constexpr int64_t kSmallIntMin = -128;
+  static constexpr int64_t kSmallIntMax = 1023;
+  static Cell kSmallInts[kSmallIntMax - kSmallIntMin + 1];
 
+  static bool isImmortal(const Cell* c) {
+    return (c->flags & kFlagImmortal) != 0;
+  }
+
+  // Marks `c` and every cell reachable from it as shared. Shared cells are
+  // immutable, which lets any number of lists, Vars and function bodies
+  // reference them instead of each holding a copy. A cell that needs a
+  // different `rest` is copied instead, which is shallow and leaves the
+  // structure below it shared. Immortal cells are always shared.
+  static void share(Cell* c);
+  static bool isShared(const Cell* c) {
+    return (c->flags & kFlagShared) != 0;
+  }
+
+  // Allocate a cell in the current nursery, or in the heap if there is none
   static Cell* alloc();
+
+  // Allocate a cell in the heap
+  static Cell* alloc_heap();
+
+  // Allocate up to `*count` cells which are adjacent in memory, in the
+  // current nursery or in the heap. At least one cell is always allocated,
+  // and `*count` is updated to the number of cells in the run.
+  static Cell* alloc_run(size_t* count);
+
+  // Like alloc_run, but always allocates in the heap
+  static Cell* alloc_heap_run(size_t* count);
+
+  // Immediately return `c` to the heap. Only safe for cells which are known
+  // to be unreferenced; reclaiming everything else is the job of the garbage
+  // collector.
   static void free(Cell* c);
 
   static Cell* create(Type t) {
-    Cell* c = alloc(); c->type = t; return c;
+    Cell* c = alloc(); c->type = t;
+    note_alloc(c);
+    return c;
+  }
+
+  // Changes the type of an existing cell
+  void set_type(Type t) {
+    if ((flags & kFlagNursery) == 0) {
+      mem_note_free((uint32_t)type, sizeof(Cell));
+      mem_note_alloc((uint32_t)t, sizeof(Cell));
+    }
+    type = t;
+  }
+
+  // Counts the new cell `c` under its type. Cells in a nursery are counted
+  // by the nursery instead, and under their type once promoted to the heap.
+  static void note_alloc(const Cell* c) {
+    if ((c->flags & kFlagNursery) == 0) {
+      mem_note_alloc((uint32_t)c->type, sizeof(Cell));
+    }
   }
   static Cell* createBool(bool v, Cell* rest=0) {
+    if (rest == 0) {
+      return v ? &kTrue : &kFalse;
+    }
     Cell* c = create(Type::BOOL);
     c->value.i = (int64_t)v;
-    c->rest = rest;
+    c->set_rest(rest);
     return c;
   }
   static Cell* createInt(int64_t v, Cell* rest=0, Type t=Type::INT) {
+    if (rest == 0 && t == Type::INT &&
+        v >= kSmallIntMin && v <= kSmallIntMax)
+    {
+      return &kSmallInts[v - kSmallIntMin];
+    }
     Cell* c = create(t);
     c->value.i = v;
-    c->rest = rest;
+    c->set_rest(rest);
     return c;
   }
   static Cell* createFloat(double v, Cell* rest=0) {
     Cell* c = create(Type::FLOAT);
     c->value.f = v;
-    c->rest = rest;
+    c->set_rest(rest);
     return c;
   }
   static Cell* createPtr(Type t, void* v, Cell* rest) {
     Cell* c = create(t);
     c->value.p = v;
-    c->rest = rest;
+    c->set_rest(rest);
     return c;
   }
 
@@ -105,25 +226,157 @@ struct Cell {
     return createPtr(Type::FN, (void*)v, rest);
   }
   static Cell* createNil(Cell* rest=0) {
+    if (rest == 0) {
+      return &kNil;
+    }
     return createSym(kSym_nil, rest);
   }
   static Cell* copy(Cell* other) {
-    // creates an exact but shallow copy of `other`
+    // creates an exact but shallow copy of `other`. The copy is never
+    // immortal.
+    if (isImm(other)) {
+      return box(other);
+    }
     Cell* c = alloc();
+    uint32_t flags = c->flags;
     memcpy((void*)c, (const void*)other, sizeof(Cell));
+    c->flags = flags;
+    note_alloc(c);
     return c;
   }
   static Cell* copy(Cell* other, Cell* rest) {
     // creates a shallow copy of `other` with a different `rest`
-    Cell* c = alloc();
-    memcpy((void*)c, (const void*)other, sizeof(Cell));
-    c->rest = rest;
+    Cell* c = copy(other);
+    c->set_rest(rest);
     return c;
   }
 
+  // Creates shallow copies of all cells in the chain starting at `first`,
+  // laid out as contiguous runs. Returns the first cell of the new chain.
+  static Cell* copyChain(Cell* first);
+
+  // Like copyChain, but also copies all nested lists. None of the new cells
+  // are shared.
+  static Cell* copyTree(Cell* first);
+
+  // ---- Immediates ----
+
+  static constexpr uintptr_t kImmMask    = 0xffff000000000007ull;
+  static constexpr uintptr_t kImmNil     = 0x2;
+  static constexpr uintptr_t kImmFalse   = 0x6;
+  static constexpr uintptr_t kImmTrue    = 0x7;
+  static constexpr uintptr_t kImmIntTag  = 0xfffe;  // top 16 bits
+  static constexpr uintptr_t kImmFloatOffset = 1ull << 49;
+
+  static bool isImm(const Cell* c) {
+    #if LUM_CELL_IMMEDIATES
+    return ((uintptr_t)c & kImmMask) != 0;
+    #else
+    return false;
+    #endif
+  }
+
+  static Type typeOf(const Cell* c) {
+    if (!isImm(c)) {
+      return c->type;
+    }
+    uintptr_t v = (uintptr_t)c;
+    if ((v >> 48) == kImmIntTag) { return Type::INT; }
+    if ((v >> 48) != 0)          { return Type::FLOAT; }
+    return (v == kImmNil) ? Type::SYM : Type::BOOL;
+  }
+
+  // Value of an INT or BOOL
+  static int64_t intValue(const Cell* c) {
+    if (!isImm(c)) {
+      return c->value.i;
+    }
+    uintptr_t v = (uintptr_t)c;
+    if ((v >> 48) == kImmIntTag) {
+      return (int64_t)(int32_t)(uint32_t)v;
+    }
+    return (int64_t)(v == kImmTrue);
+  }
+
+  // Value of a FLOAT
+  static double floatValue(const Cell* c) {
+    if (!isImm(c)) {
+      return c->value.f;
+    }
+    uint64_t bits = (uint64_t)(uintptr_t)c - kImmFloatOffset;
+    double f;
+    memcpy((void*)&f, (const void*)&bits, sizeof(f));
+    return f;
+  }
+
+  // Value of a pointer-valued cell, like SYM
+  static void* ptrValue(const Cell* c) {
+    if (!isImm(c)) {
+      return c->value.p;
+    }
+    assert((uintptr_t)c == kImmNil);
+    return (void*)kSym_nil;
+  }
+
+  static Cell* immInt(int64_t v) {
+    #if LUM_CELL_IMMEDIATES
+    if (v == (int64_t)(int32_t)v) {
+      return (Cell*)((kImmIntTag << 48) | (uintptr_t)(uint32_t)(int32_t)v);
+    }
+    #endif
+    return createInt(v);
+  }
+  static Cell* immFloat(double v) {
+    #if LUM_CELL_IMMEDIATES
+    uint64_t bits;
+    if (v != v) {
+      bits = 0x7ff8000000000000ull; // canonical NaN
+    } else {
+      memcpy((void*)&bits, (const void*)&v, sizeof(bits));
+    }
+    return (Cell*)(uintptr_t)(bits + kImmFloatOffset);
+    #else
+    return createFloat(v);
+    #endif
+  }
+  static Cell* immBool(bool v) {
+    #if LUM_CELL_IMMEDIATES
+    return (Cell*)(v ? kImmTrue : kImmFalse);
+    #else
+    return createBool(v);
+    #endif
+  }
+  static Cell* immNil() {
+    #if LUM_CELL_IMMEDIATES
+    return (Cell*)kImmNil;
+    #else
+    return createNil();
+    #endif
+  }
+
+  // Returns a real cell for `c`, allocating one if `c` is an immediate. The
+  // new cell is never one of the shared immortal cells, so its `rest` may be
+  // set.
+  static Cell* box(Cell* c, Cell* rest=0) {
+    if (!isImm(c)) {
+      return c;
+    }
+    Cell* b = create(typeOf(c));
+    switch (b->type) {
+      case Type::INT:
+      case Type::BOOL:  { b->value.i = intValue(c); break; }
+      case Type::FLOAT: { b->value.f = floatValue(c); break; }
+      default:          { b->value.p = ptrValue(c); break; }
+    }
+    b->set_rest(rest);
+    return b;
+  }
+
   static const char* type_name(Type type);
   const char* type_name() const { return type_name(type); }
 };
 
+static_assert(sizeof(Cell) == 16, "Cell must be 16 bytes");
+
 } // namespace lum
 #endif // _LUM_CELL_H_
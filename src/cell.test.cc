@@ -0,0 +1,114 @@
+#include <lum/cell.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include "test.h"
+
+using namespace lum;
+
+int main(int argc, const char** argv) {
+  // Constants and small ints without a rest are shared immortal cells
+  assert_eq(Cell::createNil(), &Cell::kNil);
+  assert_eq(Cell::createBool(true), Cell::createBool(true));
+  assert_eq(Cell::createInt(-128), Cell::createInt(-128));
+  assert_eq(Cell::createInt(1023)->value.i, 1023);
+  assert_true(Cell::isImmortal(Cell::createInt(7)));
+  assert_not_eq(Cell::createInt(1024), Cell::createInt(1024));
+  assert_not_eq(Cell::createInt(7, &Cell::kNil), Cell::createInt(7));
+  Cell::free(Cell::createInt(7));
+  assert_eq(Cell::createInt(7)->value.i, 7);
+  assert_false(Cell::isImmortal(Cell::copy(Cell::createInt(7))));
+
+  // Chains are copied into contiguous runs
+  Cell* chain = Cell::createInt(1, Cell::createInt(2, Cell::createInt(3)));
+  Cell* run = Cell::copyChain(chain);
+  assert_eq(run->value.i, 1);
+  assert_eq(run->rest(), run + 1);
+  assert_eq(run->rest()->rest(), run + 2);
+  assert_eq(run[2].value.i, 3);
+  assert_null(run[2].rest());
+
+  // Sharing marks everything reachable, and copies are never shared
+  Cell* nested = Cell::createList(Cell::createInt(5000));
+  Cell* tree = Cell::createInt(4000, nested);
+  Cell::share(tree);
+  assert_true(Cell::isShared(tree));
+  assert_true(Cell::isShared(nested));
+  assert_true(Cell::isShared((Cell*)nested->value.p));
+  assert_false(Cell::isShared(Cell::copy(tree)));
+  Cell* tree2 = Cell::copyTree(tree);
+  assert_not_eq(tree2->rest(), nested);
+  assert_not_eq(tree2->rest()->value.p, nested->value.p);
+  assert_false(Cell::isShared((Cell*)tree2->rest()->value.p));
+  assert_eq(((Cell*)tree2->rest()->value.p)->value.i, 5000);
+
+  #if LUM_CELL_IMMEDIATES
+  // Ints which fit in 32 bits are immediates, others are boxed
+  Cell* c = Cell::immInt(-5);
+  assert_true(Cell::isImm(c));
+  assert_true(Cell::typeOf(c) == Type::INT);
+  assert_eq(Cell::intValue(c), -5);
+  c = Cell::immInt(INT32_MAX);
+  assert_true(Cell::isImm(c));
+  assert_eq(Cell::intValue(c), INT32_MAX);
+  c = Cell::immInt((int64_t)INT32_MAX + 1);
+  assert_false(Cell::isImm(c));
+  assert_eq(Cell::intValue(c), (int64_t)INT32_MAX + 1);
+
+  // Floats, including the extremes
+  double fs[] = {0.0, -0.0, 1.5, -1e300, INFINITY, -INFINITY};
+  for (double f : fs) {
+    c = Cell::immFloat(f);
+    assert_true(Cell::isImm(c));
+    assert_true(Cell::typeOf(c) == Type::FLOAT);
+    assert_true(Cell::floatValue(c) == f);
+  }
+  c = Cell::immFloat(NAN);
+  assert_true(Cell::typeOf(c) == Type::FLOAT);
+  assert_true(Cell::floatValue(c) != Cell::floatValue(c));
+
+  // Bools and nil
+  assert_true(Cell::typeOf(Cell::immBool(true)) == Type::BOOL);
+  assert_eq(Cell::intValue(Cell::immBool(true)), 1);
+  assert_eq(Cell::intValue(Cell::immBool(false)), 0);
+  assert_true(Cell::typeOf(Cell::immNil()) == Type::SYM);
+  assert_eq(Cell::ptrValue(Cell::immNil()), (void*)kSym_nil);
+
+  // Real cells are never taken for immediates
+  c = Cell::createInt(1);
+  assert_false(Cell::isImm(c));
+  assert_false(Cell::isImm(0));
+
+  // Boxing
+  Cell* rest = Cell::createInt(2);
+  c = Cell::box(Cell::immFloat(2.5), rest);
+  assert_false(Cell::isImm(c));
+  assert_true(c->type == Type::FLOAT);
+  assert_true(c->value.f == 2.5);
+  assert_eq(c->rest(), rest);
+
+  // Arithmetic produces immediates
+  Env env;
+  Cell* expr = Cell::createList(
+    Cell::createSym(kSym_sum, Cell::createInt(1, Cell::createInt(2))));
+  c = eval(&env, expr);
+  assert_true(Cell::isImm(c));
+  assert_eq(Cell::intValue(c), 3);
+  env.results.unwind(0);
+
+  // cons shares the tail of the list it extends
+  Cell* tail = Cell::createInt(2000, Cell::createInt(3000));
+  Cell* list = Cell::createList(tail);
+  Cell::share(list);
+  expr = Cell::createList(Cell::createSym(kSym_cons,
+    Cell::createInt(1000, Cell::createQuote(list))));
+  c = eval(&env, expr);
+  assert_true(c->type == Type::LIST);
+  assert_not_eq(c, list);
+  assert_eq(((Cell*)c->value.p)->value.i, 1000);
+  assert_eq(((Cell*)c->value.p)->rest(), tail);
+  assert_eq((Cell*)list->value.p, tail);
+  env.results.unwind(0);
+  #endif
+
+  return 0;
+}
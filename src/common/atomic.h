@@ -17,6 +17,9 @@ T LumAtomicCmpSwap(T* ptr, T oldval, T newval)
 void LumAtomicAdd32(int32_t* operand, int32_t delta)
   Increment a 32-bit integer `operand` by `delta`. There's no return value.
 
+T LumAtomicAddAndFetch(T* operand, T delta)
+  Add `delta` to `operand` and return the resulting value of `operand`
+
 T LumAtomicSubAndFetch(T* operand, T delta)
   Subtract `delta` from `operand` and return the resulting value of `operand`
 
@@ -91,6 +94,16 @@ T LumAtomicSubAndFetch(T* operand, T delta)
 #endif
 
 
+// T LumAtomicAddAndFetch(T* operand, T delta)
+#if LUM_WITHOUT_SMP
+  #define LumAtomicAddAndFetch(operand, delta) (*(operand) += (delta))
+#elif defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 4))
+  #define LumAtomicAddAndFetch __sync_add_and_fetch
+#else
+  #error "Unsupported compiler: Missing support for atomic operations"
+#endif
+
+
 // T LumAtomicSubAndFetch(T* operand, T delta)
 #if LUM_WITHOUT_SMP
   #define LumAtomicSubAndFetch(operand, delta) (*(operand) -= (delta))
@@ -4,24 +4,83 @@
 #include <lum/common.h>
 #include <lum/cell.h>
 #include <lum/namespace.h>
+#include <lum/gc.h>
+#include <lum/nursery.h>
+#include <lum/sched.h>
+#include <lum/trace.h>
 #include <unordered_map>
 
 namespace lum {
 
-#define LUM_DEBUG_RESULT_STACK 1
-
-template <typename T, size_t Size>
+// Stack which grows on demand in segments of SegmentSize entries. Segments
+// never move, so growing does not copy anything, and segments which are no
+// longer needed after the stack has been deep are freed again as it shrinks.
+// An empty stack does not allocate any memory at all.
+//
+// push fails, returning false, when the stack already holds `limit` entries
+// or when no memory is left for another segment.
+template <typename T, size_t SegmentSize = 256>
 struct Stack {
-  T at(size_t i) const { assert(i < depth); return items[i]; }
+  static_assert((SegmentSize & (SegmentSize - 1)) == 0,
+                "SegmentSize must be a power of two");
+
+  Stack() {}
+  ~Stack() { for (T* seg : _segments) { std::free(seg); } }
+  LUM_CXX_DISALLOW_COPY(Stack);
+
+  T& item(size_t i) const {
+    return _segments[i / SegmentSize][i & (SegmentSize - 1)];
+  }
+  T at(size_t i) const { assert(i < depth); return item(i); }
   T at_top(size_t offset) const {
     assert(offset < depth);
     return at((depth-1) - offset);
   }
-  T top() const { return depth ? items[depth-1] : 0; }
-  void push(T v) { assert(depth+1 != Size); items[depth++] = v; }
-  T pop() { return items[--depth]; }
+  T top() const { return depth ? item(depth-1) : 0; }
+  void set_top(T v) { assert(depth != 0); item(depth-1) = v; }
+  size_t capacity() const { return _segments.size() * SegmentSize; }
+  bool push(T v) {
+    if (depth >= limit || (depth == capacity() && !grow())) {
+      return false;
+    }
+    item(depth++) = v;
+    return true;
+  }
+  T pop() {
+    assert(depth != 0);
+    T v = item(--depth);
+    if ((depth & (SegmentSize - 1)) == 0 &&
+        _segments.size() > (depth / SegmentSize) + 2)
+    {
+      shrink();
+    }
+    return v;
+  }
+
   size_t depth = 0;
-  T items[Size];
+  size_t limit = SIZE_MAX;
+
+private:
+  bool grow() {
+    T* seg = (T*)malloc(sizeof(T) * SegmentSize);
+    if (seg == 0) {
+      return false;
+    }
+    _segments.push_back(seg);
+    return true;
+  }
+
+  // Free all segments but one above the one `depth` is in. Keeping a spare
+  // segment avoids freeing and allocating over and over again when the
+  // stack hovers around a segment boundary.
+  void shrink() {
+    while (_segments.size() > (depth / SegmentSize) + 2) {
+      std::free(_segments.back());
+      _segments.pop_back();
+    }
+  }
+
+  std::vector<T*> _segments;
 };
 
 template <typename T, size_t N>
@@ -42,35 +101,56 @@ inline std::ostream& operator<< (std::ostream& s, const Stack<T,N>& p) {
   #endif
 }
 
+// All namespaces of a program, by name. Shared by the Envs of its threads.
+struct Namespaces {
+  typedef
+    std::unordered_map<const Str*,Namespace,Str::Hasher,Str::Comparator>
+    Map;
+  Namespace  core;
+  Spinlock   lock = LUM_SPINLOCK_INIT;
+  Map        map;
+  Scheduler* scheduler = 0; // see Scheduler::of
+
+  Namespaces() : core(kStr_core) {}
+};
+
 struct Env {
   struct Results {
-    void push(Cell* c) {
-      #if LUM_DEBUG_RESULT_STACK
-      std::cout << "results" << cell_stack << " ← " << c << '\n';
-      #endif
-      cell_stack.push(c);
+    bool push(Cell* c) {
+      LUM_TRACE(RESULTS, 1, "← " << c);
+      LUM_TRACE(RESULTS, 2, "results" << cell_stack);
+      return cell_stack.push(c);
     }
     size_t index() { return cell_stack.depth; }
+    Cell* at(size_t index) { return cell_stack.at(index); }
     Cell* top() { return cell_stack.top(); }
     Cell* pop() { return cell_stack.pop(); }
+    // Drop results down to `end_depth`. The cells are left for the garbage
+    // collector as they might still be referenced, e.g. by a Var.
     void unwind(size_t end_depth) {
       while (cell_stack.depth != end_depth) {
         Cell* c = cell_stack.pop();
-        #if LUM_DEBUG_RESULT_STACK
-        std::cout << "results" << cell_stack << " → " << c << '\n';
-        #endif
-        Cell::free(c);
+        LUM_TRACE(RESULTS, 1, "→ " << c);
+        (void)c;
       }
     }
-    Stack<Cell*,128> cell_stack;
+    Stack<Cell*,64> cell_stack;
   } results;
 
-  Namespace core_ns;
+  Namespaces* namespaces; // shared with other Envs, see Env(Env*)
   Namespace* ns; // current
 
-  Stack<Cell*,1024> locals;
-  Stack<Fn*,128> compile_stack;
-  Stack<Cell*,1024> apply_stack;
+  Stack<Cell*> locals;
+  Stack<Fn*,16> compile_stack;
+  Stack<Cell*> apply_stack;
+  Nursery nursery;
+  std::vector<Cell*> tail_call_args; // see eval_body in fn.cc
+
+  // Maximum depth of function application. Evaluation is recursive, so this
+  // also guards the native stack. Can be changed at any time.
+  static constexpr size_t kDefaultMaxDepth = 10000;
+  void set_max_depth(size_t depth) { apply_stack.limit = depth; }
+  size_t max_depth() const { return apply_stack.limit; }
 
   // Get the local which is at position `offset_from_top` from the top of the
   // locals stack.
@@ -82,36 +162,66 @@ struct Env {
     while (locals.depth != end_depth) {
       locals.pop(); }}
 
-  typedef
-    std::unordered_map<const Str*,Namespace,Str::Hasher,Str::Comparator>
-    NSMap;
-  Spinlock _ns_map_lock = LUM_SPINLOCK_INIT;
-  NSMap _ns_map;
-
-  Env() : core_ns(kStr_core), ns(0) {
+  Env() : namespaces(new Namespaces), ns(0), _owns_namespaces(true) {
+    set_max_depth(kDefaultMaxDepth);
     ns = ns_get(intern_str("user"));
+    gc_register_env(this);
+  }
+
+  // An Env for another thread, which shares the namespaces, and so the Vars,
+  // of `shared`. Starts out in the same current namespace. Must be destroyed
+  // before `shared`.
+  explicit Env(Env* shared)
+    : namespaces(shared->namespaces), ns(shared->ns), _owns_namespaces(false)
+  {
+    set_max_depth(kDefaultMaxDepth);
+    gc_register_env(this);
+  }
+
+  ~Env() {
+    if (_owns_namespaces && namespaces->scheduler != 0) {
+      Scheduler::free(namespaces->scheduler);
+    }
+    gc_unregister_env(this);
+    if (_owns_namespaces) {
+      delete namespaces;
+    }
+    std::free(_sym_cache);
+  }
+
+  LUM_CXX_DISALLOW_COPY(Env);
+
+  // Collects garbage if needed. Must only be called when every cell that
+  // is in use is reachable from the roots of a live Env (see gc.h).
+  void safepoint() {
+    gc_collect_if_needed();
   }
 
   Namespace* ns_get(const Str* name) {
     if (name == kStr_core) {
-      return &core_ns;
+      return &namespaces->core;
     }
-    spinlock_lock(_ns_map_lock);
-    NSMap::iterator I = _ns_map.find(name);
-    if (I == _ns_map.end()) {
-      // Newfound
-      std::pair<NSMap::iterator,bool> P = _ns_map.emplace(name, name);
-      spinlock_unlock(_ns_map_lock);
+    spinlock_lock(namespaces->lock);
+    Namespaces::Map::iterator I = namespaces->map.find(name);
+    if (I == namespaces->map.end()) {
+      // Newfound. The cells which the namespace is prepopulated with must
+      // outlive any nursery frame we might be in.
+      nursery.suspend();
+      std::pair<Namespaces::Map::iterator,bool> P =
+        namespaces->map.emplace(name, name);
+      nursery.resume();
+      spinlock_unlock(namespaces->lock);
       Namespace* new_ns = &P.first->second;
       return new_ns;
     } else {
       // Existing
-      spinlock_unlock(_ns_map_lock);
+      spinlock_unlock(namespaces->lock);
       return &I->second;
     }
   }
 
   Namespace* ns_set_current(const Str* name) {
+    ++_ns_version;
     return ns = ns_get(name);
   }
 
@@ -119,13 +229,19 @@ struct Env {
   // needed.
   Var* define(Sym* sym, Cell* value) {
     assert(sym->ns == 0); // must be an unqualified symbol
+    assert(!nursery.contains(value)); // would not outlive its frame
+    // The value becomes visible to everyone through the Var, so it must not
+    // be modified from now on.
+    Cell::share(value);
     Var* v;
-    if (!ns->mappings.get_or_put(v, ns->name(), sym->name, value)) {
+    if (ns->mappings.get_or_put(v, ns->name(), sym->name, value)) {
+      ++_ns_version;
+    } else {
       // rebind var
       Cell* pc = v->set(value);
-      std::cout << "[ns def] rebinding var " << sym << " from "
-                << pc << " to "
-                << value << "\n";
+      LUM_TRACE(EVAL, 1, "rebinding var " << sym << " from " << pc
+                         << " to " << value);
+      (void)pc;
     }
     return v;
   }
@@ -133,7 +249,22 @@ struct Env {
   // Finds a mapping from `sym` to a Var. Returns NULL if not found.
   Var* resolve_symbol(Sym* sym) {
     assert(sym->ns == 0); // TODO support two-level qualified symbol lookups
-    return ns->mappings.get(sym->name);
+    if (_sym_cache == 0) {
+      _sym_cache =
+        (SymCacheEntry*)calloc(kSymCacheSize, sizeof(SymCacheEntry));
+      if (_sym_cache == 0) {
+        return ns->mappings.get(sym->name);
+      }
+    }
+    SymCacheEntry& e = _sym_cache[((uintptr_t)sym >> 4) % kSymCacheSize];
+    if (e.sym == sym && e.version == _ns_version) {
+      return e.var;
+    }
+    Var* v = ns->mappings.get(sym->name);
+    if (v != 0) {
+      e = {sym, v, _ns_version};
+    }
+    return v;
   }
 
   // Like resolve_symbol, but if there's no existing mapping from the symbol
@@ -142,9 +273,29 @@ struct Env {
   Var* map_symbol(Sym* sym) {
     assert(sym->ns == 0); // TODO support two-level qualified symbol lookups
     Var* v;
-    ns->mappings.get_or_put(v, ns->name(), sym->name, 0);
+    if (ns->mappings.get_or_put(v, ns->name(), sym->name, 0)) {
+      ++_ns_version;
+    }
     return v;
   }
+
+  // Cache of resolve_symbol, so that looking up e.g. `+` over and over does
+  // not take a lock and hash its name each time. Vars are never removed from
+  // a namespace and redefining one changes the value of the same Var, so a
+  // Var which was found once stays valid until the mappings change, which
+  // bumps _ns_version. Mappings are only ever added, so an Env sharing its
+  // namespaces need not see the changes made through other Envs. Allocated
+  // when first used, as many Envs, e.g. those of idle workers, never resolve
+  // a symbol.
+  struct SymCacheEntry {
+    Sym*     sym;
+    Var*     var;
+    uint64_t version;
+  };
+  static constexpr size_t kSymCacheSize = 256;
+  SymCacheEntry* _sym_cache = 0;
+  uint64_t _ns_version = 1;
+  bool _owns_namespaces;
 };
 
 } // namespace lum
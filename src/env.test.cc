@@ -0,0 +1,88 @@
+#include <lum/env.h>
+#include <lum/eval.h>
+#include "test.h"
+
+using namespace lum;
+
+int main(int argc, const char** argv) {
+  // Stacks allocate segments as they grow and free them as they shrink
+  Stack<Cell*,4> stack;
+  assert_eq(stack.capacity(), 0);
+  assert_null(stack.top());
+  for (int64_t i = 0; i != 100; ++i) {
+    assert_true(stack.push((Cell*)(i + 1)));
+  }
+  assert_eq(stack.depth, 100);
+  assert_eq(stack.capacity(), 100);
+  assert_eq(stack.at(0), (Cell*)1);
+  assert_eq(stack.at(42), (Cell*)43);
+  assert_eq(stack.at_top(0), (Cell*)100);
+  while (stack.depth != 4) {
+    stack.pop();
+  }
+  assert_eq(stack.top(), (Cell*)4);
+  assert_eq(stack.capacity(), 12);
+  stack.limit = 10;
+  while (stack.depth != 10) {
+    assert_true(stack.push(0));
+  }
+  assert_false(stack.push(0));
+  assert_eq(stack.depth, 10);
+
+  // (def g 0)
+  Env env;
+  assert_eq(env.max_depth(), Env::kDefaultMaxDepth);
+  env.set_max_depth(300);
+  Sym* g = const_cast<Sym*>(intern_sym("g"));
+  eval(&env, Cell::createList(
+    Cell::createSym(kSym_def, Cell::createSym(g, Cell::createInt(0)))));
+  env.results.unwind(0);
+
+  // (def g (fn (x) (+ 1 (g x)))), which is not a tail call
+  Cell* body = Cell::createList(Cell::createSym(kSym_sum,
+    Cell::createInt(1, Cell::createList(Cell::createSym(g,
+    Cell::createSym(intern_sym("x")))))));
+  Cell* params = Cell::createList(Cell::createSym(intern_sym("x")), body);
+  Cell* fn = eval(&env, Cell::createList(Cell::createSym(kSym_fn, params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  env.define(g, Cell::copy(fn));
+  env.results.unwind(0);
+
+  // (g 1) recurses until it runs out of stack, and fails cleanly
+  Cell* call = Cell::createList(Cell::createSym(g, Cell::createInt(1)));
+  assert_null(eval(&env, call));
+  assert_eq(env.apply_stack.depth, 0);
+  assert_eq(env.locals.depth, 0);
+  assert_eq(env.results.index(), 0);
+  assert_eq(env.nursery.depth(), 0);
+
+  // The stacks have shrunk back, and evaluation carries on as usual
+  assert_true(env.apply_stack.capacity() <= 512);
+  Cell* sum = eval(&env, Cell::createList(
+    Cell::createSym(kSym_sum, Cell::createInt(1, Cell::createInt(2)))));
+  assert_eq(Cell::intValue(sum), 3);
+  env.results.unwind(0);
+
+  // Symbols resolve to the same Var from the cache as they did the first
+  // time, until the current namespace changes
+  Var* var = env.resolve_symbol(g);
+  assert_true(var != 0);
+  assert_eq(env.resolve_symbol(g), var);
+  assert_eq(env.resolve_symbol(g), var);
+  Sym* other = const_cast<Sym*>(intern_sym("other"));
+  assert_null(env.resolve_symbol(other));
+  env.ns_set_current(intern_str("elsewhere"));
+  assert_null(env.resolve_symbol(g));
+  assert_true(env.resolve_symbol(const_cast<Sym*>(kSym_sum)) != 0);
+  env.define(g, Cell::createInt(1));
+  Var* var2 = env.resolve_symbol(g);
+  assert_true(var2 != 0);
+  assert_not_eq(var2, var);
+  env.define(other, Cell::createInt(2));
+  assert_eq(Cell::intValue(env.resolve_symbol(other)->get()), 2);
+  env.ns_set_current(intern_str("user"));
+  assert_eq(env.resolve_symbol(g), var);
+  assert_null(env.resolve_symbol(other));
+
+  return 0;
+}
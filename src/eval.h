@@ -46,49 +46,100 @@ inline Cell* eval_local(Env* env, Cell* c) {
 
 
 inline Cell* eval_list(Env* env, Cell* c) {
-  //std::cout << "eval("; print_1(std::cout, c) << ")\n";
   assert(c->type == Type::LIST);
 
+  // A top-level form is evaluated in a nursery frame of its own. Cells
+  // allocated while evaluating it are promoted to the heap when we return.
+  bool is_toplevel =
+    env->apply_stack.depth == 0 && env->nursery.depth() == 0;
+  Nursery::Frame frame = {0, 0};
   size_t result_entry_index = env->results.index();
+  if (is_toplevel) {
+    // The form itself is the only cell not yet reachable from the roots, so
+    // this is a safepoint as long as we keep it on the results stack. It
+    // stays there until we return, as functions applied while evaluating
+    // it reach safepoints too.
+    env->results.push(c);
+    env->safepoint();
+    frame = env->nursery.enter();
+  }
+
   Cell* target = (Cell*)c->value.p;
-  Cell* args = target->rest;
-  std::cout << "apply(" << target << ", ";
-    printchain(std::cout, args) << ")\n";
+  Cell* args = target->rest();
+  LUM_TRACE(EVAL, 1, "apply " << c);
   target = eval(env, target);
   Cell* result = 0;
+  if (target == 0) {
+    env->results.unwind(result_entry_index);
+    if (is_toplevel) {
+      env->nursery.leave(frame, 0);
+    }
+    return 0;
+  }
 
   // Add to apply stack
-  env->apply_stack.push(target);
-  std::cout << "env->apply_stack: " << env->apply_stack << "\n";
+  if (!env->apply_stack.push(target)) {
+    std::cerr << "stack overflow: maximum call depth ("
+              << env->max_depth() << ") exceeded\n";
+    env->results.unwind(result_entry_index);
+    if (is_toplevel) {
+      env->nursery.leave(frame, 0);
+    }
+    return 0;
+  }
+  LUM_TRACE(EVAL, 2, "apply_stack" << env->apply_stack);
 
-  if (target->type == Type::BIF) {
-    // Apply built-in function
+  Type target_type = Cell::typeOf(target);
+  if (target_type == Type::BIF) {
+    // Apply built-in function. A call whose value the compiler found not to
+    // escape (see fn.cc) gets a scratch frame which is dropped right away.
     const Bif* bif = Cell::getBif(target);
-    result = bif->apply(env, args);
+    bool is_scratch = !is_toplevel && bif->is_pure &&
+                      (c->flags & Cell::kFlagNoEscape);
+    if (is_scratch) {
+      frame = env->nursery.enter();
+    }
+    Bif::Impl apply = bif->apply;
+    if (c->flags & (Cell::kFlagArity1 | Cell::kFlagArity2)) {
+      apply = bif->apply_fixed((c->flags & Cell::kFlagArity1) ? 1 : 2);
+    }
+    result = apply(env, args);
 
     // Free results from previous evals
     env->results.unwind(result_entry_index);
+    if (is_toplevel || is_scratch) {
+      result = env->nursery.leave(frame, result);
+    }
 
     // Add our result to the result stack
     env->results.push(result);
 
-  } else if (target->type == Type::FN) {
-    // Apply user function
+  } else if (target_type == Type::FN) {
+    // Apply user function in a nursery frame of its own. Temporaries created
+    // by the function body are dropped when it returns.
     Fn* fn = (Fn*)target->value.p;
+    if (!is_toplevel) {
+      frame = env->nursery.enter();
+    }
     result = fn->apply(env, args);
+    env->results.unwind(result_entry_index);
+    result = env->nursery.leave(frame, result);
+
+    // The result is no longer reachable from the function's locals, so it
+    // goes on the result stack as well
+    if (result != 0) {
+      env->results.push(result);
+    }
 
   } else {
     std::cerr << "first item in list is not a function\n";
+    env->results.unwind(result_entry_index);
+    if (is_toplevel) {
+      env->nursery.leave(frame, 0);
+    }
   }
 
-  // // Free results from previous evals
-  // env->results.unwind(result_entry_index);
-
-  // // Add our result to the result stack
-  // env->results.push(result);
-
   // Remove from apply stack
-  std::cout << "env->apply_stack: " << env->apply_stack << "\n";
   assert(env->apply_stack.top() == target);
   env->apply_stack.pop();
 
@@ -97,6 +148,9 @@ inline Cell* eval_list(Env* env, Cell* c) {
 
 
 inline Cell* eval(Env* env, Cell* c) {
+  if (Cell::isImm(c)) {
+    return c;
+  }
   switch (c->type) {
     case Type::SYM:     { return eval_symbol(env, c); }
     case Type::VAR:     { return eval_var(env, c); }
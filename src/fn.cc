@@ -4,21 +4,22 @@
 #include <lum/eval.h>
 #include <lum/print.h>
 #include <lum/bif.h>
+#include <lum/gc.h>
+#include <lum/vm.h>
+#include <lum/jit.h>
+#include <lum/trace.h>
 
 namespace lum {
 
-static std::ostream& _dpr(Env* env) {
-  std::ostream& s = std::cout;
-  size_t depth = env->compile_stack.depth;
-  std::fill_n(std::ostream_iterator<char>(s, ""), depth * 2, ' ');
-  return s << "";
-}
+// Trace compilation, indented by the depth of the compile stack
+#define TRACE_COMPILE(env, ...) LUM_TRACE(COMPILE, 1, \
+  std::string((env)->compile_stack.depth * 2, ' ') << __VA_ARGS__)
 
 Fn* Fn::create(Env* env, Cell* params) {
   assert(params != 0);
   assert(params->type == Type::LIST);
 
-  Cell* body = params->rest;
+  Cell* body = params->rest();
   assert(body != 0);
   //params->rest = 0; // separate params from body
 
@@ -37,14 +38,25 @@ Fn* Fn::create(Env* env, Cell* params) {
       return 0;
     }
     ++param_count;
-    param = param->rest;
+    param = param->rest();
   }
 
   // Allocate struct
-  Fn* fn = (Fn*)malloc(sizeof(Fn) + (sizeof(Param) * param_count));
+  size_t size = sizeof(Fn) + (sizeof(Param) * param_count);
+  Fn* fn = (Fn*)malloc(size);
+  mem_note_alloc(kMemKindFn, size);
   fn->_body = body;
+  fn->_code = 0;
+  fn->_special = 0;
+  fn->_proto = 0;
+  fn->_captured = 0;
   fn->_has_outside_locals = false;
+  fn->_is_loop = false;
+  fn->_is_polymorphic = false;
+  fn->_apply_count = 0;
   fn->_param_count = 0;
+  fn->_capture_count = 0;
+  gc_register_fn(fn);
 
   // Initialize Params
   param = (Cell*)params->value.p;
@@ -56,7 +68,7 @@ Fn* Fn::create(Env* env, Cell* params) {
     p.is_variable = p.name->ends_with("...");
 
     //Cell* prev_param = param;
-    param = param->rest;
+    param = param->rest();
     // we only needed to inspect the param and copy the pointer to the interned
     // string, so now we need to free the cell since we own it.
 
@@ -82,6 +94,7 @@ Fn* Fn::create(Env* env, Cell* params) {
   // function call.
   //
   // BTW, we should probably have a separate Env in each scheduler (OS thread).
+  // (Now there is, see sched.h.)
   // That would greatly simplify things, and as we already pass around env when
   // evaluating, env could be used to carry a mutable stack of locals. This is
   // also how we can implement thread-local vars in an efficient way.
@@ -107,7 +120,46 @@ Fn* Fn::create(Env* env, Cell* params) {
 }
 
 
+Fn* Fn::create_closure(Fn* proto) {
+  assert(proto->_proto == 0);
+  size_t size = sizeof(Fn) + (sizeof(Cell*) * proto->_capture_count);
+  Fn* fn = (Fn*)malloc(size);
+  if (fn == 0) {
+    return 0;
+  }
+  mem_note_alloc(kMemKindFn, size);
+  fn->_body = proto->_body;
+  fn->_code = proto->_code;
+  fn->_special = 0;
+  fn->_proto = proto;
+  fn->_captured = 0;
+  fn->_has_outside_locals = true;
+  fn->_is_loop = false;
+  fn->_is_polymorphic = false;
+  fn->_apply_count = 0;
+  fn->_param_count = proto->_param_count;
+  fn->_capture_count = proto->_capture_count;
+  memset((void*)fn->_params, 0, sizeof(Cell*) * fn->_capture_count);
+  gc_register_fn(fn);
+  return fn;
+}
+
+
 void Fn::free(Fn* fn) {
+  if (fn == 0) {
+    return;
+  }
+  gc_unregister_fn(fn);
+  size_t size = sizeof(Fn);
+  if (fn->_proto != 0) {
+    // The code belongs to the prototype
+    size += sizeof(Cell*) * fn->capture_count();
+  } else {
+    Code::free(fn->_code);
+    Code::free(fn->_special);
+    size += sizeof(Param) * fn->param_count();
+  }
+  mem_note_free(kMemKindFn, size);
   std::free(fn);
 }
 
@@ -115,6 +167,76 @@ void Fn::free(Fn* fn) {
 static Cell* _compile(Fn* fn, Env* env, Cell* c);
 
 
+// True if `c` is a Var bound to `bif`
+static bool is_bif_var(Cell* c, const Bif* bif) {
+  if (c->type != Type::VAR) {
+    return false;
+  }
+  Cell* vc = ((Var*)c->value.p)->get();
+  return vc != 0 && Cell::typeOf(vc) == Type::BIF && Cell::getBif(vc) == bif;
+}
+
+
+// Compile (core/loop (name0 init0 ...nameN initN) body) starting at `first`.
+//
+// The initial values are compiled in the enclosing scope. The body is
+// compiled as if it was the body of a function taking the names as its
+// parameters, which at runtime are bound on top of the locals of the
+// enclosing function (see eval_loop). The loop is then applied with &loop
+// rather than `loop`, which would take it for a loop outside of any function.
+static bool compile_loop(Fn* fn, Env* env, Cell* first) {
+  Cell* bindings = first->rest();
+  if (bindings == 0 || bindings->type != Type::LIST ||
+      bindings->rest() == 0)
+  {
+    std::cerr << "'loop' requires a list of bindings and a body\n";
+    return false;
+  }
+
+  Cell* names = 0;
+  Cell* last_name = 0;
+  for (Cell* b = (Cell*)bindings->value.p; b != 0; b = b->rest()->rest()) {
+    if (b->type != Type::SYM || ((Sym*)b->value.p)->ns != 0 ||
+        b->rest() == 0)
+    {
+      std::cerr << "loop bindings must be pairs of unqualified symbols "
+                   "and values\n";
+      return false;
+    }
+    Cell* init = _compile(fn, env, b->rest());
+    if (init == 0) {
+      return false;
+    }
+    if (init != b->rest()) {
+      init->set_rest(b->rest()->rest());
+      b->set_rest(init);
+    }
+    Cell* name = Cell::createSym((Sym*)b->value.p);
+    if (last_name == 0) {
+      names = name;
+    } else {
+      last_name->set_rest(name);
+    }
+    last_name = name;
+  }
+
+  Fn* loop_fn = Fn::create(env, Cell::createList(names, bindings->rest()));
+  if (loop_fn == 0) {
+    return false;
+  }
+  loop_fn->_is_loop = true;
+  bool ok = loop_fn->compile(env);
+  if (ok) {
+    bindings->set_rest(loop_fn->body());
+    first->set_type(Type::BIF);
+    first->value.p = (void*)kBif_compiled_loop;
+  }
+  loop_fn->_body = Cell::createNil();
+  Fn::free(loop_fn);
+  return ok;
+}
+
+
 static Cell* compile_chain(Fn* fn, Env* env, Cell* first) {
   Cell* c = first;
   Cell* prev = 0;
@@ -122,61 +244,268 @@ static Cell* compile_chain(Fn* fn, Env* env, Cell* first) {
 
   while (c) {
     Cell* nc = _compile(fn, env, c);
+    if (nc == 0) {
+      return 0;
+    }
 
-    // Special case: (core/fn ...)
-    if (c == first && nc->type == Type::VAR) {
-      Cell* vc = ((Var*)nc->value.p)->get();
-      if (vc->type == Type::BIF && Cell::getBif(vc) == kBif_fn) {
-        // Inner function
-        _dpr(env) << "compile_chain() inner function\n";
-
-        // Create a new Fn
-        Fn* inner_fn = Fn::create(env, c->rest);
-        if (inner_fn == 0) {
-          return 0;
-        }
-
-        // Compile the body (chain) of the inner function
-        if (inner_fn->compile(env)) {
-          // Steal body cell chain
-          head = inner_fn->body();
-          inner_fn->_body = Cell::createNil();
-          if (c->rest->rest != head) {
-            _dpr(env) << "TODO CASE " << __FILE__ << ":" << __LINE__ << "\n";
-            c->rest->rest = head;
-          }
-        } else {
-          head = 0;
-        }
-
-        // Throw away the temporary inner Fn, and check for errors
-        Fn::free(inner_fn);
-        return (head == 0) ? 0 : first;
-      }
+    // Special case: (core/loop ...)
+    if (c == first && is_bif_var(nc, kBif_loop)) {
+      return compile_loop(fn, env, first) ? first : 0;
     }
 
     if (head == 0) {
       head = nc;
     } else {
-      prev->rest = nc;
+      prev->set_rest(nc);
     }
     prev = nc;
 
-    c = c->rest;
+    c = c->rest();
   }
 
   return head;
 }
 
 
+// Escape analysis
+//
+// A call to a pure BIF (see Bif::is_pure) whose arguments are all atoms,
+// locals, vars or themselves such calls can not have any effect other than
+// producing its value. When that value is in turn passed to a pure BIF, it
+// can not escape the enclosing call either, and neither can anything
+// allocated while computing it. We mark such argument lists with
+// kFlagNoEscape, and eval_list evaluates them in a scratch nursery frame of
+// their own which is thrown away as soon as the value has been computed.
+//
+// E.g. in the body (+ (* a (- b c)) d) both (* a (- b c)) and (- b c) are
+// marked, while the outer call is not as its value is the function's result.
+//
+// The BIFs are looked up when compiling, but as a Var might be redefined,
+// eval_list checks that the function applied is still pure.
+
+static const Bif* pure_bif(Cell* c) {
+  if (c->type == Type::VAR) {
+    c = ((Var*)c->value.p)->get();
+  }
+  if (c != 0 && Cell::typeOf(c) == Type::BIF) {
+    const Bif* bif = Cell::getBif(c);
+    if (bif->is_pure) {
+      return bif;
+    }
+  }
+  return 0;
+}
+
+static bool is_pure_call(Cell* head) {
+  if (pure_bif(head) == 0) {
+    return false;
+  }
+  for (Cell* arg = head->rest(); arg != 0; arg = arg->rest()) {
+    if ((arg->type == Type::LIST && (arg->flags & Cell::kFlagNoEscape) == 0)
+        || arg->type == Type::SYM || arg->type == Type::QUOTE)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void mark_non_escaping_args(Cell* head) {
+  if (pure_bif(head) == 0) {
+    return;
+  }
+  for (Cell* arg = head->rest(); arg != 0; arg = arg->rest()) {
+    if (arg->type == Type::LIST && is_pure_call((Cell*)arg->value.p)) {
+      arg->flags |= Cell::kFlagNoEscape;
+    }
+  }
+}
+
+
+// Calls with one or two arguments are marked as such, so that eval_list can
+// apply a BIF's specialization for that number of arguments, if it has one
+// (see Bif::apply_fixed). As copying a cell does not copy its flags, the
+// lists in a chain are marked again after the chain has been copied.
+static void mark_arity(Cell* c) {
+  if (c->type != Type::LIST || c->value.p == 0) {
+    return;
+  }
+  size_t count = 0;
+  Cell* arg = ((Cell*)c->value.p)->rest();
+  for (; arg != 0 && count != 3; arg = arg->rest()) {
+    ++count;
+  }
+  c->flags &= ~(Cell::kFlagArity1 | Cell::kFlagArity2);
+  if (count == 1) {
+    c->flags |= Cell::kFlagArity1;
+  } else if (count == 2) {
+    c->flags |= Cell::kFlagArity2;
+  }
+}
+
+
+// Constant folding
+//
+// A call to one of the pure BIFs + - * / rem and =, or to cons, whose
+// arguments are all constants is evaluated while compiling, and the call is
+// replaced by its value. Folding happens bottom-up as lists are compiled, so
+// (+ 1 (* 60 60)) becomes 3601. Likewise a symbol which resolves to a Var of
+// the core namespace which has never been rebound, like `true`, is replaced
+// by the Var's value unless that is a function.
+//
+// Like direct linking, this binds the function to the values core Vars had
+// when it was compiled, should any of them be rebound afterwards.
+//
+// The number of calls and constants folded is traced to the "fold"
+// subsystem for each function compiled at the top level.
+
+static thread_local struct {
+  uint64_t calls;
+  uint64_t constants;
+} fold_counts;
+
+static bool is_constant(Cell* c) {
+  switch (Cell::typeOf(c)) {
+    case Type::BOOL:
+    case Type::INT:
+    case Type::FLOAT:
+    case Type::KEYWORD:
+    case Type::QUOTE: { return true; }
+    default: { return false; }
+  }
+}
+
+// The value of `var` if it is a constant of the core namespace, else NULL
+static Cell* core_constant(Var* var) {
+  if (var->is_rebound() || var->symbol()->ns != kStr_core) {
+    return 0;
+  }
+  Cell* value = var->get();
+  if (value == 0 || Cell::typeOf(value) == Type::BIF ||
+      Cell::typeOf(value) == Type::FN)
+  {
+    return 0;
+  }
+  return value;
+}
+
+// Turn `c` into a constant which evaluates to `value`, keeping its `rest`
+static void set_constant(Cell* c, Cell* value) {
+  Type type = Cell::typeOf(value);
+  c->flags &= ~(Cell::kFlagNoEscape | Cell::kFlagArity1 | Cell::kFlagArity2);
+  if (type == Type::BOOL || type == Type::INT) {
+    c->set_type(type);
+    c->value.i = Cell::intValue(value);
+  } else if (type == Type::FLOAT) {
+    c->set_type(type);
+    c->value.f = Cell::floatValue(value);
+  } else {
+    c->set_type(Type::QUOTE);
+    c->value.p = (void*)value;
+  }
+}
+
+// The BIF which the call starting at `head` can be folded into a constant
+// by applying, or NULL. Such calls can not fail or have any effects.
+static const Bif* foldable_bif(Cell* head) {
+  if (head->type != Type::VAR || ((Var*)head->value.p)->is_rebound() ||
+      ((Var*)head->value.p)->symbol()->ns != kStr_core)
+  {
+    return 0;
+  }
+  Cell* vc = ((Var*)head->value.p)->get();
+  if (vc == 0 || Cell::typeOf(vc) != Type::BIF) {
+    return 0;
+  }
+  const Bif* bif = Cell::getBif(vc);
+  bool is_numop = bif == kBif_sum || bif == kBif_sub || bif == kBif_mul ||
+                  bif == kBif_div || bif == kBif_rem;
+  if (!is_numop && bif != kBif_eq && bif != kBif_cons) {
+    return 0;
+  }
+  size_t count = 0;
+  for (Cell* arg = head->rest(); arg != 0; arg = arg->rest()) {
+    if (!is_constant(arg)) {
+      return 0;
+    }
+    Type type = Cell::typeOf(arg);
+    if (is_numop && type != Type::INT && type != Type::FLOAT) {
+      return 0;
+    }
+    // Leave integer division by zero to fail at runtime, if ever reached
+    if ((bif == kBif_div || bif == kBif_rem) && count != 0 &&
+        type == Type::INT && Cell::intValue(arg) == 0)
+    {
+      return 0;
+    }
+    if (bif == kBif_cons && count == 1 && (type != Type::QUOTE ||
+        Cell::typeOf((Cell*)arg->value.p) != Type::LIST))
+    {
+      return 0;
+    }
+    ++count;
+  }
+  if (count == 0 || (bif == kBif_cons && count > 2)) {
+    return 0;
+  }
+  return bif;
+}
+
+// Fold the compiled call `cons` into a constant if possible
+static void fold_call(Env* env, Cell* cons) {
+  Cell* head = (Cell*)cons->value.p;
+  const Bif* bif = foldable_bif(head);
+  if (bif == 0) {
+    return;
+  }
+  size_t results_index = env->results.index();
+  Cell* value = bif->apply(env, head->rest());
+  env->results.unwind(results_index);
+  if (value != 0) {
+    LUM_TRACE(FOLD, 2, cons << " => " << value);
+    set_constant(cons, value);
+    ++fold_counts.calls;
+  }
+}
+
+
+static Cell* compile_symbol(Fn* fn, Env* env, Cell* symcell);
+static Cell* compile_inner_fn(Fn* fn, Env* env, Cell* cons);
+static Cell* compile_future(Fn* fn, Env* env, Cell* cons);
+
+
 static Cell* compile_list(Fn* fn, Env* env, Cell* cons) {
-  _dpr(env) << "compile_list(" << cons << ")...\n";
-  Cell* head = compile_chain(fn, env, (Cell*)cons->value.p);
+  TRACE_COMPILE(env, "compile_list(" << cons << ")...");
+
+  // Special case: (core/fn ...)
+  Cell* first = (Cell*)cons->value.p;
+  if (first != 0 && first->type == Type::SYM &&
+      compile_symbol(fn, env, first) == 0)
+  {
+    return 0;
+  }
+  if (first != 0 && is_bif_var(first, kBif_fn)) {
+    return compile_inner_fn(fn, env, cons);
+  }
+  if (first != 0 && is_bif_var(first, kBif_future)) {
+    return compile_future(fn, env, cons);
+  }
+
+  Cell* head = compile_chain(fn, env, first);
   if (head == 0) {
     return 0;
   }
+  // The compiled list is walked every time the function is applied, so lay
+  // it out as a contiguous run of cells
+  head = Cell::copyChain(head);
+  mark_non_escaping_args(head);
+  for (Cell* c = head; c != 0; c = c->rest()) {
+    mark_arity(c);
+  }
   cons->value.p = (void*)head;
-  _dpr(env) << "compile_list(...) => " << cons << "\n";
+  mark_arity(cons);
+  fold_call(env, cons);
+  TRACE_COMPILE(env, "compile_list(...) => " << cons);
   return cons;
 }
 
@@ -195,96 +524,97 @@ static inline bool find_param_index_by_name(
 }
 
 
-// Traverse the function compile_stack starting at `cst_start_index`,
-// summarizing param_count for each function, and ending either at the bottom
-// of the stack (if `end_fn` is NULL) or when reaching `end_fn` (not included
-// in the param_count sum).
-static inline uint32_t outer_param_count_sum(
-    Env* env, size_t cst_start_index, Fn* end_fn)
+static inline bool find_capture_index_by_name(
+    uint32_t& index, Fn* fn, const Str* name)
 {
-  uint32_t sum = 0;
-  do {
-    Fn* f = env->compile_stack.at(cst_start_index);
-    if (f == end_fn) {
-      break;
+  uint32_t i = 0;
+  for (Cell* c = fn->_captured; c != 0; c = c->rest(), ++i) {
+    if (((Sym*)c->value.p)->name == name) {
+      index = i;
+      return true;
     }
-    sum += f->param_count();
-    // _dpr(env) << " pcount " << f->param_count() << " of " << f << "\n";
-  } while (cst_start_index--);
-  return sum;
+  }
+  return false;
 }
 
 
-static size_t lookup_local_symbol(
-    Env* env, Cell* symcell, const Str* name)
-{
-  // For each function in compile_stack, starting at top:
-  size_t cst_index_top = env->compile_stack.depth - 1;
-  size_t cst_index = cst_index_top;
-  do {
-    Fn* fn = env->compile_stack.at(cst_index);
-    _dpr(env) << " br 2.1 -- visit " << fn << "\n";
-
-    // Lookup name in fn's parameters
-    uint32_t param_index;
-    if (find_param_index_by_name(param_index, fn, name)) {
-      (_dpr(env) << " br 2.1.1  -- found "
-                 << (cst_index < cst_index_top ? "outer" : "inner")
-                 << " local param #" << param_index << "\n");
-
-      // Offset param_index by the sum of outer functions' parameter count.
-      //
-      // E.g. Say we are compiling #<fn(c0)> of the following expression:
-      //   (fn (a0 a1) (fn (b0) (fn (c0) (+ a0 a1 b0 c0))))
-      // And we are looking up the symbol "b0" which we just found in the
-      // parameters of the outer function #<fn(b0)> at index 0.
-      // The compile_stack would look like this:
-      //   #2 => #<fn(c0)>
-      //   #1 => #<fn(b0)>     <-- fn, cst_index
-      //   #0 => #<fn(a0 a1)>
-      // And so we start at cst_index-1 which would be #<fn(a0 a1)> in the
-      // compile_stack.
-      // The result in this case would be 2, offsetting b0 from #0 to #2.
-      if (env->compile_stack.depth > cst_index-1) {
-        param_index += outer_param_count_sum(env, cst_index-1, fn);
-      }
-
-      _dpr(env) << "symbol(" << name << ") => in "
-                << fn << " at index " << param_index <<  "\n";
-      // Convert sym to local
-      symcell->type = Type::LOCAL;
-      symcell->value.i = (int64_t)param_index;
-      return cst_index;
+// Add `sym` to the captures of `fn`, returning its index
+static uint32_t add_capture(Env* env, Fn* fn, Sym* sym) {
+  Cell* c = Cell::createSym(sym);
+  if (fn->_captured == 0) {
+    fn->_captured = c;
+  } else {
+    Cell* last = fn->_captured;
+    while (last->rest() != 0) {
+      last = last->rest();
     }
+    last->set_rest(c);
+  }
+  fn->_has_outside_locals = true;
+  TRACE_COMPILE(env, "capture(" << sym << ") => in " << fn
+                << " at index " << fn->_capture_count);
+  return fn->_capture_count++;
+}
 
-  } while (cst_index--);
 
+// Look up `sym` among the locals seen from the compile_stack entry at
+// `cst_index`, returning its offset from the top of the locals stack, or
+// SIZE_MAX if it is not a local.
+//
+// At runtime a function's captures are pushed on the locals stack, then its
+// arguments, and then the bindings of any loops it is in. So we search the
+// parameters of the loops and then the parameters and captures of the
+// function they are in. A local of an enclosing function becomes a capture,
+// of the function we are in and of any functions in between.
+//
+// E.g. when compiling #<fn(c0)> of the following expression:
+//   (fn (a0 a1) (fn (b0) (fn (c0) (+ a0 a1 b0 c0))))
+// Looking up "a1" visits #<fn(c0)>, in which it is not found, then
+// #<fn(b0)> and finally #<fn(a0 a1)>, which has it as parameter #0. It is
+// then added to the captures of #<fn(b0)> and of #<fn(c0)>, and is local #2
+// of #<fn(c0)> as it is capture #1 after one parameter.
+static size_t lookup_local(Env* env, size_t cst_index, Sym* sym) {
+  size_t offset = 0;
+  for (size_t i = cst_index + 1; i-- != 0; ) {
+    Fn* fn = env->compile_stack.at(i);
+    TRACE_COMPILE(env, " br 2.1 -- visit " << fn);
+    uint32_t index;
+    if (find_param_index_by_name(index, fn, sym->name)) {
+      return offset + index;
+    }
+    offset += fn->param_count();
+    if (fn->_is_loop) {
+      continue;
+    }
+    if (!find_capture_index_by_name(index, fn, sym->name)) {
+      if (i == 0 || lookup_local(env, i - 1, sym) == SIZE_MAX) {
+        return SIZE_MAX;
+      }
+      index = add_capture(env, fn, sym);
+    }
+    return offset + index;
+  }
   return SIZE_MAX;
 }
 
 
 static Cell* compile_symbol(Fn* fn, Env* env, Cell* symcell) {
   Sym* sym = (Sym*)symcell->value.p;
-  _dpr(env) << "compile_symbol(" << sym << ")\n";
+  TRACE_COMPILE(env, "compile_symbol(" << sym << ")");
   //
   // Looks up a symbol in the following way:
   //
-  //   1. If the symbol is namespace-qualified, goto 4.
+  //   1. If the symbol is namespace-qualified, goto 3.
   //
-  //   2. Search the function's parameters for a match, if found, substitute
-  //      the cell with a new LOCAL cell, referencing the parameter by its
-  //      offset plus the sum of outer functions' parameter count.
+  //   2. Search the locals of the function, and of enclosing functions (see
+  //      lookup_local). If found, substitute the cell with a new LOCAL cell,
+  //      referencing the local by its offset from the top of the locals
+  //      stack.
   //
-  //   3. Search each outer function's parameters for a match, starting with
-  //      the one closest to the current function, moving outwards. If a
-  //      match is found in function X, substitute the cell with a new LOCAL
-  //      cell, referencing the parameter by its offset in function X plus the
-  //      sum of outer functions' parameter count.
-  //
-  //   4. Look up in env and substitute the cell with whatever cell the
+  //   3. Look up in env and substitute the cell with whatever cell the
   //      symbol references in env.
   //
-  //   5. Error: "Unable to resolve symbol"
+  //   4. Error: "Unable to resolve symbol"
   //
   // Example:
   //    (fn (a0 a1)
@@ -293,100 +623,128 @@ static Cell* compile_symbol(Fn* fn, Env* env, Cell* symcell) {
   //          (+ a0 a1 b0 c0))))
   //
   // Evaluating the above should produce:
-  //    #<fn (a0 a1)
-  //      (&core/fn (b0)
-  //        (&core/fn (c0)
-  //          (&core/+ #<local 1> #<local 0> #<local 2> #<local 3>)))>
-  //
-  // Evaluating the above as (#<fn> 10 20) should produce:
-  //    #<fn (b0)
-  //      (&core/fn (c0)
-  //        (&core/+ 10 20 #<local 0> #<local 1>)))>
-  //
-  // Evaluating the above as (#<fn> 30) should produce:
-  //    #<fn (c0)
-  //        (&core/+ 10 20 30 #<local 0>)))>
+  //    #<fn(a0 a1)
+  //      (&core/fn #<fn(b0)
+  //        (&core/fn #<fn(c0)
+  //          (&core/+ #<local 1> #<local 2> #<local 3> #<local 0>)>
+  //          #<local 1> #<local 2> #<local 0>)>
+  //        #<local 1> #<local 0>)>
   //
-  // Evaluating the above as (#<fn> 40) should produce:
-  //    100
+  // Evaluating the above as (#<fn> 10 20) makes a closure of #<fn(b0)>
+  // capturing 10 and 20, and applying that to 30 makes a closure of
+  // #<fn(c0)> capturing 10, 20 and 30. Applying that to 40 produces 100.
   //
 
-  // 1-3. Does this symbol exist in any functions' parameters?
+  // 1-2. Is this symbol a local?
   if (sym->ns == 0) {
-    const Str* name = sym->name;
-    size_t cst_index = lookup_local_symbol(env, symcell, name);
-    if (cst_index != SIZE_MAX) {
-      if (!fn->_has_outside_locals && cst_index < env->compile_stack.depth-1) {
-        // Mark the function as needing a closure, since it references
-        // locals in an outer function.
-        fn->_has_outside_locals = true;
-      }
+    size_t offset = lookup_local(env, env->compile_stack.depth - 1, sym);
+    if (offset != SIZE_MAX) {
+      TRACE_COMPILE(env, "symbol(" << sym << ") => local " << offset);
+      symcell->set_type(Type::LOCAL);
+      symcell->value.i = (int64_t)offset;
       return symcell;
     } // else: not found, so continue...
   }
 
-  // 4. Lookup symbol in env
-  _dpr(env) << " br 3 -- in env?\n";
+  // 3. Lookup symbol in env
+  TRACE_COMPILE(env, " br 3 -- in env?");
   Var* var = env->resolve_symbol(sym);
   if (var == 0) {
     std::cerr << "Unable to resolve symbol '" << sym << "' in this context\n";
     return 0;
   }
-  _dpr(env) << "resolve_symbol(" << sym << ") => " << var << "\n";
+  TRACE_COMPILE(env, "resolve_symbol(" << sym << ") => " << var);
+
+  Cell* value = core_constant(var);
+  if (value != 0) {
+    set_constant(symcell, value);
+    ++fold_counts.constants;
+    return symcell;
+  }
 
   // Since we own symcell, it's safe to convert it to a VAR cell
-  symcell->type = Type::VAR;
+  symcell->set_type(Type::VAR);
   symcell->value.p = (void*)var;
   return symcell;
 }
 
 
-static Cell* compile_local(Fn* fn, Env* env, Cell* cell) {
-  // _dpr(env) << "compile_local(" << cell << ") ...\n";
-  size_t offset_from_top = (size_t)cell->value.i;
+// Compile (core/fn (params) body) in the body of `fn` to a prototype (see
+// fn.h). Returns what replaces the form: the prototype itself if it has no
+// captures, and otherwise a form making a closure of it.
+static Cell* compile_inner_fn(Fn* fn, Env* env, Cell* cons) {
+  TRACE_COMPILE(env, "compile_inner_fn(" << cons << ")...");
+  Cell* first = (Cell*)cons->value.p;
+  Cell* params = first->rest();
+  if (params != 0 && params->type == Type::FN) {
+    return cons; // compiled already, in a body which is being copied
+  }
+  if (params == 0 || params->rest() == 0) {
+    std::cerr << "built-in function 'fn' requires at least two arguments\n";
+    return 0;
+  }
+  if (params->type != Type::LIST) {
+    std::cerr << "first argument to 'fn' must be a list\n";
+    return 0;
+  }
 
-  if (offset_from_top < env->locals.depth) {
-    // This local refers to an active local, so we expand to the value
-    Cell* value_cell = env->get_local(offset_from_top);
-    _dpr(env) << "compile_local(" << cell << ") => " << value_cell << "\n";
-    return Cell::copy(value_cell);
+  Fn* proto = Fn::create(env, params);
+  if (proto == 0 || !proto->compile(env)) {
+    Fn::free(proto);
+    return 0;
+  }
+  Cell* captures = proto->_captured;
+  proto->_captured = 0;
+  if (!proto->_has_outside_locals) {
+    return Cell::createFn(proto);
   }
 
-  // If we get here, the local references an outside local which means that
-  // this function needs a closure.
-  fn->_has_outside_locals = true;
+  // The captures are locals of `fn`, or are captured by `fn` in turn
+  for (Cell* c = captures; c != 0; c = c->rest()) {
+    if (compile_symbol(fn, env, c) == 0) {
+      return 0;
+    }
+  }
+  first->set_rest(Cell::createFn(proto, captures));
+  cons->value.p = (void*)Cell::copyChain(first);
+  TRACE_COMPILE(env, "compile_inner_fn(...) => " << cons);
+  return cons;
+}
 
-  // offset by the currently executing function's param_count
-  //
-  // L = 5            ; local offset (from locals' stack top)
-  // PC = 2           ; executing function's param_count
-  // O = L - PC       ; new local offset
-
-  // In this situation the apply_stack top should be the core/fn BIF since we
-  // are compiling a function.
-  assert(env->apply_stack.top()->type == Type::BIF);
-  assert(Cell::getBif(env->apply_stack.top()) == kBif_fn);
-
-  // Now we pick the function that is applying core/fn. So we make sure that
-  // the apply_stack is at least 2 cells deep and then we grab the second from
-  // the top.
-  assert(env->apply_stack.depth > 1);
-  Cell* curr_func = env->apply_stack.at_top(1);
-  assert(curr_func->type == Type::FN); // TODO: Support BIFs
-  size_t param_count = ((Fn*)curr_func->value.p)->param_count();
-  assert(param_count <= offset_from_top);
-  size_t outer_offset_from_top = offset_from_top - param_count;
-
-  cell = Cell::copy(cell);
-  cell->value.i = (int64_t)outer_offset_from_top;
-  _dpr(env) << "compile_local(" << cell << ") => "
-            << "outer_scope " << cell << "\n";
-  return cell;
+
+// Compile (core/future expr) in the body of `fn` to
+// (core/future #<fn> capture0 ...captureN), like (core/fn () expr), since
+// the expression is evaluated by another Env which can not see our locals
+static Cell* compile_future(Fn* fn, Env* env, Cell* cons) {
+  TRACE_COMPILE(env, "compile_future(" << cons << ")...");
+  Cell* first = (Cell*)cons->value.p;
+  Cell* body = first->rest();
+  if (body != 0 && body->type == Type::FN) {
+    return cons; // compiled already, in a body which is being copied
+  }
+  if (body == 0 || body->rest() != 0) {
+    std::cerr << "built-in function 'future' takes exactly one argument\n";
+    return 0;
+  }
+  Cell* inner = Cell::createList(
+    Cell::createSym(kSym_fn, Cell::createList(0, body)));
+  Cell* compiled = compile_inner_fn(fn, env, inner);
+  if (compiled == 0) {
+    return 0;
+  }
+  if (compiled == inner) {
+    // (core/fn #<fn> capture0 ...captureN)
+    compiled = ((Cell*)inner->value.p)->rest();
+  }
+  first->set_rest(compiled);
+  cons->value.p = (void*)Cell::copyChain(first);
+  TRACE_COMPILE(env, "compile_future(...) => " << cons);
+  return cons;
 }
 
 
 static Cell* compile_fn(Fn* fn, Env* env, Cell* cell) {
-  _dpr(env) << "compile_fn(" << cell << ") => " << cell << "\n";
+  TRACE_COMPILE(env, "compile_fn(" << cell << ") => " << cell);
   return cell;
 }
 
@@ -394,7 +752,6 @@ static Cell* compile_fn(Fn* fn, Env* env, Cell* cell) {
 static Cell* _compile(Fn* fn, Env* env, Cell* c) {
   switch (c->type) {
     case Type::SYM:     { return compile_symbol(fn, env, c); }
-    case Type::LOCAL:   { return compile_local(fn, env, c); }
     case Type::LIST:    { return compile_list(fn, env, c); }
     case Type::FN:      { return compile_fn(fn, env, c); }
     default: { return c; }
@@ -405,60 +762,394 @@ static Cell* _compile(Fn* fn, Env* env, Cell* c) {
 bool Fn::compile(Env* env) {
   assert(_body != 0);
 
-  // Add to the compile stack
-  env->compile_stack.push(this);
-  
-  // DEBUG print compile stack
-  _dpr(env) << "compile_stack:\n";
-  size_t i = env->compile_stack.depth;
-  while (i--) {
-    _dpr(env) << " #" << i << " => " << env->compile_stack.at(i) << "\n";
+  // Add to the compile stack. Compilation rewrites existing cells to
+  // reference new ones, which therefore must not live in the nursery.
+  if (!env->compile_stack.push(this)) {
+    std::cerr << "out of memory while compiling " << this << "\n";
+    return false;
   }
+  env->nursery.suspend();
+  uint64_t folded_calls = fold_counts.calls;
+  uint64_t folded_constants = fold_counts.constants;
 
-  // Compile all bodies
-  Cell* body = compile_chain(this, env, _body);
+  // DEBUG print compile stack
+  TRACE_COMPILE(env, "compile_stack:" << env->compile_stack);
+
+  // Compile all bodies. Compilation rewrites the body in place, so a shared
+  // body, like that of a (fn ...) form which is evaluated more than once, is
+  // copied first.
+  Cell* body = _body;
+  if (Cell::isShared(body)) {
+    body = Cell::copyTree(body);
+  }
+  body = compile_chain(this, env, body);
 
   // Remove from the compile stack
+  env->nursery.resume();
   assert(env->compile_stack.top() == this);
   env->compile_stack.pop();
 
-  if (body != _body) {
-    if (body == 0) {
+  if (body == 0) {
+    return false;
+  }
+  if (env->compile_stack.depth == 0 &&
+      (fold_counts.calls != folded_calls ||
+       fold_counts.constants != folded_constants))
+  {
+    LUM_TRACE(FOLD, 1, "folded " << (fold_counts.calls - folded_calls)
+              << " calls and " << (fold_counts.constants - folded_constants)
+              << " constants in " << body);
+  }
+  // The compiled body is never modified again, so it and any values it
+  // captured can be shared with other functions and lists.
+  Cell::share(body);
+  _body = body;
+  #if LUM_VM
+  Code::free(_code);
+  _code = Code::create(env, this);
+  #endif
+  return true;
+}
+
+
+// Evaluate `args`, leaving their values on top of the results stack.
+// Returns the number of values, or SIZE_MAX on error.
+static size_t eval_args(Env* env, Cell* args) {
+  size_t count = 0;
+  for (Cell* arg = args; arg != 0; arg = arg->rest()) {
+    // Evaluating a call leaves its result on the results stack as well
+    size_t index = env->results.index();
+    Cell* value = eval(env, arg);
+    if (value == 0) {
+      return SIZE_MAX;
+    }
+    env->results.unwind(index);
+    if (!env->results.push(value)) {
+      std::cerr << "stack overflow: out of memory for results\n";
+      return SIZE_MAX;
+    }
+    ++count;
+  }
+  return count;
+}
+
+
+static bool check_arg_count(Fn* fn, size_t count) {
+  if (count == fn->param_count()) {
+    return true;
+  }
+  if (count < fn->param_count()) {
+    std::cerr << "too few arguments to function " << fn << "\n";
+  } else {
+    std::cerr << "too many arguments to function " << fn << "\n";
+  }
+  return false;
+}
+
+
+// Move `count` values from the top of the results stack to the locals stack
+static bool bind_locals(Env* env, size_t count) {
+  size_t base = env->results.index() - count;
+  for (size_t i = 0; i != count; ++i) {
+    if (!env->locals.push(env->results.at(base + i))) {
+      std::cerr << "stack overflow: out of memory for locals\n";
+      env->results.unwind(base);
       return false;
     }
-    Cell::free(_body);
-    _body = body;
   }
+  env->results.unwind(base);
   return true;
 }
 
 
-Cell* Fn::apply(Env* env, Cell* args) {
-  _dpr(env) << "Fn::apply("; printchain(std::cout, args) << ")\n";
+// Push the values captured by closure `fn` on the locals stack, below its
+// arguments. The last capture goes first, so that capture #k ends up at
+// offset param_count+k, and captures can be added while compiling.
+static bool bind_captures(Env* env, Fn* fn) {
+  Cell* const* captures = fn->captures();
+  for (uint32_t k = fn->capture_count(); k-- != 0; ) {
+    if (!env->locals.push(captures[k])) {
+      std::cerr << "stack overflow: out of memory for locals\n";
+      return false;
+    }
+  }
+  return true;
+}
 
-  // push args to the locals stack
-  Cell* arg = args;
-  size_t locals_entry_index = env->locals.depth;
-  while (arg != 0) {
-    // TODO: variable "..." args
-    env->locals.push(arg);
-    arg = arg->rest;
+
+// Tail calls and loops
+//
+// A call to a function in tail position of a function body is made without
+// nesting: the arguments replace those of the current call on the locals
+// stack, and the callee's body is evaluated in place of the caller's. The
+// branches of `if` are tail positions as well. Likewise, (recur ...) in tail
+// position of a loop or function body rebinds the loop's or function's
+// locals and starts over.
+//
+// Each round runs in a nursery frame which is emptied, except for the new
+// arguments, when the next one starts. Iteration thus runs in constant space
+// on both the native and the locals stack.
+
+// Follow `expr` into the branch of each `if` which is taken, until reaching
+// the expression in tail position, and store the function it calls, if any,
+// in `target`. Returns NULL on error.
+static Cell* tail_expr(Env* env, Cell* expr, Cell** target) {
+  while (true) {
+    *target = 0;
+    if (Cell::isImm(expr) || expr->type != Type::LIST) {
+      return expr;
+    }
+    Cell* head = (Cell*)expr->value.p;
+    if (head->type != Type::VAR && head->type != Type::FN &&
+        head->type != Type::BIF)
+    {
+      // Evaluating anything else might have effects
+      return expr;
+    }
+    *target = eval(env, head);
+    if (*target == 0 || Cell::typeOf(*target) != Type::BIF ||
+        Cell::getBif(*target) != kBif_if_)
+    {
+      return expr;
+    }
+    expr = if_branch(env, head->rest());
+    if (expr == 0) {
+      return 0;
+    }
+  }
+}
+
+
+// Type feedback
+//
+// The first kSpecializeAfter times a function is applied, including tail
+// calls, the types of its arguments are recorded in its Params. If by then
+// each parameter has only been given one type, and some of them are
+// numbers, the body is translated again to bytecode specialized for those
+// types (see vm.h). The specialized code is run whenever the arguments have
+// those types, and the generic code or body otherwise. Closures share the
+// feedback and code of their prototype. After kJitAfter applications, the
+// bytecode is translated to machine code (see jit.h).
+
+static void specialize(Env* env, Fn* fn) {
+  #if LUM_VM
+  std::vector<Type> types(fn->param_count());
+  bool has_number = false;
+  for (uint32_t i = 0; i != fn->param_count(); ++i) {
+    types[i] = fn->param(i).type;
+    if (types[i] != Type::INT && types[i] != Type::FLOAT) {
+      types[i] = Type::UNKNOWN;
+    } else {
+      has_number = true;
+    }
   }
+  Code* special = has_number ? Code::create(env, fn, types.data()) : 0;
+  // Other threads may be applying the function, and run the code as soon as
+  // they see it
+  __atomic_store_n(&fn->_special, special, __ATOMIC_RELEASE);
+  TRACE_COMPILE(env, "specialize(" << fn << ") => "
+                << (special != 0 ? "specialized" : "generic"));
+  #endif
+}
+
+// Count an application of `fn`, with the arguments on top of the locals
+// stack, recording their types and specializing or translating its code to
+// machine code when it is time to
+//
+// Threads which apply the function at the same time record types without
+// synchronizing, and may overwrite each other's. This only makes the
+// feedback less accurate, as specialized code is only run for arguments
+// which match the types it was specialized for (see Code::matches_args).
+static void count_apply(Env* env, Fn* fn) {
+  uint32_t applied = __atomic_load_n(&fn->_apply_count, __ATOMIC_RELAXED);
+  if (applied < Fn::kSpecializeAfter && !fn->_is_polymorphic) {
+    uint32_t count = fn->param_count();
+    for (uint32_t i = 0; i != count; ++i) {
+      Type type = Cell::typeOf(env->get_local(count - i - 1));
+      Fn::Param& p = fn->_params[i];
+      if (p.type == Type::UNKNOWN) {
+        p.type = type;
+      } else if (p.type != type) {
+        fn->_is_polymorphic = true;
+      }
+    }
+  }
+  // Atomically, so that each step is taken once when running on several
+  // threads (see sched.h)
+  uint32_t count = LumAtomicAddAndFetch(&fn->_apply_count, 1u);
+  if (count == Fn::kSpecializeAfter && !fn->_is_polymorphic) {
+    specialize(env, fn);
+  } else if (count == Fn::kJitAfter && jit_enabled()) {
+    if (fn->_code != 0) {
+      jit_compile(fn->_code);
+    }
+    Code* special = __atomic_load_n(&fn->_special, __ATOMIC_ACQUIRE);
+    if (special != 0) {
+      jit_compile(special);
+    }
+    TRACE_COMPILE(env, "jit(" << fn << ")");
+  }
+}
+
+// The bytecode to run `fn` with, given the arguments on top of the locals
+// stack, or NULL if its body is to be tree-walked
+static const Code* select_code(Env* env, Fn* fn) {
+  Fn* owner = (fn->_proto != 0) ? fn->_proto : fn;
+  if (__atomic_load_n(&owner->_apply_count, __ATOMIC_RELAXED) < Fn::kJitAfter) {
+    count_apply(env, owner);
+  }
+  const Code* special = __atomic_load_n(&owner->_special, __ATOMIC_ACQUIRE);
+  if (special != 0 && special->matches_args(env) && special->is_valid()) {
+    return special;
+  }
+  const Code* code = fn->_code;
+  return (code != 0 && code->is_valid()) ? code : 0;
+}
+
+
+// Evaluate `body` with `local_count` locals bound on top of the locals
+// stack, from `locals_base`. `fn` is the function being applied, or NULL if
+// evaluating a loop.
+static Cell* eval_body(Env* env, Fn* fn, Cell* body, size_t local_count,
+                       size_t locals_base)
+{
+  size_t results_base = env->results.index();
+  Cell* apply_top = env->apply_stack.top();
+  Nursery::Frame frame = {0, 0};
+  bool in_frame = false;
+  Cell* result = 0;
+
+  while (true) {
+    // Code hands calls in tail position back to us, leaving the callee and
+    // the arguments in env->tail_call_args (see vm.h)
+    const Code* code = (fn != 0) ? select_code(env, fn) : 0;
+    Cell* target;
+    Cell* expr = 0;
+    if (code != 0) {
+      result = vm_exec(env, code);
+      if (result != kTailCall) {
+        break;
+      }
+      result = 0;
+      target = env->tail_call_args[0];
+    } else {
+      expr = tail_expr(env, body, &target);
+      if (expr == 0) {
+        break;
+      }
+    }
 
-  // Did we satisfy the param count?
-  size_t arg_count = env->locals.depth - locals_entry_index;
-  if (arg_count != param_count()) {
-    if (arg_count < param_count()) {
-      std::cerr << "too few arguments to function " << this << "\n";
+    Fn* callee = 0;
+    bool is_recur = target != 0 && Cell::typeOf(target) == Type::BIF &&
+                    Cell::getBif(target) == kBif_recur;
+    if (!is_recur && fn != 0 && target != 0 &&
+        Cell::typeOf(target) == Type::FN)
+    {
+      callee = (Fn*)target->value.p;
+    } else if (!is_recur) {
+      result = eval(env, expr);
+      break;
+    }
+
+    // Make the call in place
+    if (!in_frame) {
+      frame = env->nursery.enter();
+      in_frame = true;
+    }
+    size_t count;
+    if (expr != 0) {
+      count = eval_args(env, ((Cell*)expr->value.p)->rest());
     } else {
-      std::cerr << "too many arguments to function " << this << "\n";
+      count = env->tail_call_args.size() - 1;
+      for (size_t i = 0; i != count; ++i) {
+        if (!env->results.push(env->tail_call_args[i + 1])) {
+          std::cerr << "stack overflow: out of memory for results\n";
+          count = SIZE_MAX;
+          break;
+        }
+      }
+    }
+    if (count == SIZE_MAX) {
+      break;
+    }
+    if (is_recur && count != local_count) {
+      std::cerr << "'recur' expects " << local_count << " arguments but got "
+                << count << "\n";
+      break;
+    } else if (callee != 0 && !check_arg_count(callee, count)) {
+      break;
+    }
+    auto& values = env->tail_call_args;
+    values.clear();
+    for (size_t i = 0; i != count; ++i) {
+      values.push_back(env->results.at(env->results.index() - count + i));
+    }
+    env->results.unwind(results_base);
+    env->nursery.keep(frame, values.data(), count);
+    env->unwind_locals(locals_base);
+    for (Cell* value : values) {
+      env->results.push(value);
+    }
+    Fn* next = (callee != 0) ? callee : fn;
+    if ((next != 0 && next->_proto != 0 && !bind_captures(env, next)) ||
+        !bind_locals(env, count))
+    {
+      break;
     }
+    if (callee != 0) {
+      fn = callee;
+      body = fn->_body;
+      local_count = count;
+      env->apply_stack.set_top(target);
+    }
+    // Everything in use is on the stacks or in the frame again, making the
+    // start of each round a safepoint
+    env->safepoint();
+  }
+
+  env->results.unwind(results_base);
+  if (in_frame) {
+    result = env->nursery.leave(frame, result);
+  }
+  if (apply_top != 0) {
+    env->apply_stack.set_top(apply_top);
+  }
+  return result;
+}
+
+
+Cell* Fn::apply(Env* env, Cell* args) {
+  LUM_TRACE(EVAL, 1, "Fn::apply " << this);
+
+  // Arguments are evaluated before any of them are bound, as they might
+  // refer to the caller's locals.
+  size_t results_entry_index = env->results.index();
+  size_t count = eval_args(env, args);
+  if (count == SIZE_MAX) {
+    env->results.unwind(results_entry_index);
+    return 0;
+  }
+  return apply_values(env, count);
+}
+
+
+Cell* Fn::apply_values(Env* env, size_t count) {
+  assert(_proto != 0 || !_has_outside_locals);
+  size_t locals_entry_index = env->locals.depth;
+  size_t results_entry_index = env->results.index() - count;
+  if (!check_arg_count(this, count) ||
+      (_proto != 0 && !bind_captures(env, this)) ||
+      !bind_locals(env, count))
+  {
+    env->results.unwind(results_entry_index);
     env->unwind_locals(locals_entry_index);
     return 0;
   }
 
-  _dpr(env) << "locals" << env->locals << "\n";
-  Cell* result = eval(env, _body);
+  // The arguments are locals now, and so reachable from the roots
+  env->safepoint();
+  LUM_TRACE(EVAL, 2, "locals" << env->locals);
+  Cell* result = eval_body(env, this, _body, count, locals_entry_index);
 
   // pop args from the local stack
   env->unwind_locals(locals_entry_index);
@@ -467,6 +1158,91 @@ Cell* Fn::apply(Env* env, Cell* args) {
 }
 
 
+Cell* eval_loop(Env* env, Cell* args) {
+  if (args == 0 || args->type != Type::LIST || args->rest() == 0) {
+    std::cerr << "'loop' requires a list of bindings and a body\n";
+    return 0;
+  }
+
+  // Evaluate the initial values
+  size_t locals_entry_index = env->locals.depth;
+  size_t results_entry_index = env->results.index();
+  size_t count = 0;
+  for (Cell* b = (Cell*)args->value.p; b != 0; b = b->rest()->rest()) {
+    if (b->rest() == 0) {
+      std::cerr << "loop bindings must be pairs of names and values\n";
+      count = SIZE_MAX;
+      break;
+    }
+    size_t index = env->results.index();
+    Cell* value = eval(env, b->rest());
+    if (value != 0) {
+      env->results.unwind(index);
+    }
+    if (value == 0 || !env->results.push(value)) {
+      count = SIZE_MAX;
+      break;
+    }
+    ++count;
+  }
+  if (count == SIZE_MAX || !bind_locals(env, count)) {
+    env->results.unwind(results_entry_index);
+    env->unwind_locals(locals_entry_index);
+    return 0;
+  }
+
+  Cell* result = eval_body(env, 0, args->rest(), count, locals_entry_index);
+  env->unwind_locals(locals_entry_index);
+  return result;
+}
+
+
+// A captured value is referenced by the closure rather than by a cell, so if
+// it lives in the nursery it is copied to the heap.
+Cell* capture_value(Env* env, Cell* value) {
+  if (Cell::isImm(value) || !env->nursery.contains(value)) {
+    return value;
+  }
+  env->nursery.suspend();
+  Cell* c = Cell::copy(value, 0);
+  if (c->type == Type::LIST || c->type == Type::QUOTE) {
+    c->value.p = (void*)Cell::copyTree((Cell*)c->value.p);
+  }
+  env->nursery.resume();
+  return c;
+}
+
+
+Cell* eval_closure(Env* env, Cell* args) {
+  Fn* proto = (Fn*)args->value.p;
+  uint32_t count = 0;
+  for (Cell* c = args->rest(); c != 0; c = c->rest()) {
+    ++count;
+  }
+  if (count != proto->capture_count()) {
+    std::cerr << "function " << proto << " captures "
+              << proto->capture_count() << " locals but got " << count << "\n";
+    return 0;
+  }
+  Fn* fn = Fn::create_closure(proto);
+  if (fn == 0) {
+    std::cerr << "out of memory while creating closure of " << proto << "\n";
+    return 0;
+  }
+
+  // The captures are locals, so evaluating them has no effects
+  Cell** captures = fn->captures();
+  for (Cell* c = args->rest(); c != 0; c = c->rest()) {
+    Cell* value = eval(env, c);
+    if (value == 0) {
+      return 0;
+    }
+    *captures++ = capture_value(env, value);
+  }
+  return Cell::createFn(fn);
+}
+
+
 std::ostream& operator<< (std::ostream& os, const Fn const* fn) {
   os << "#<fn(";
   uint32_t i = 0;
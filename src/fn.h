@@ -6,26 +6,74 @@
 
 namespace lum {
 
+struct Code;
+
+// Closures
+//
+// An inner (fn ...) is compiled once, along with the function it is in, to a
+// prototype function. Locals of enclosing functions which its body refers to
+// become its captures, addressed like locals below its parameters. Where the
+// inner function is created the form is replaced by
+//
+//   (core/fn #<fn proto> capture0 ...captureN)
+//
+// which makes a closure: a function sharing the prototype's parameters, body
+// and code, with the current values of the captures. Creating a closure is
+// thus O(captures), and a prototype with no captures is used as is.
 struct Fn {
   struct Param {
     const Str* name;
-    Type type;
+    Type type; // of all arguments seen so far, see Fn::apply
     bool is_variable; // if ... args should be consumed rather than just one
   };
 
+  // Number of applications after which a function whose parameters have
+  // each only been given arguments of one type is specialized for them
+  static constexpr uint32_t kSpecializeAfter = 1000;
+
+  // Number of applications after which a function's bytecode is translated
+  // to machine code (see jit.h)
+  static constexpr uint32_t kJitAfter = 10000;
+
   static Fn* create(Env* env, Cell* params_and_bodies);
   static void free(Fn*);
 
+  // Create a closure of `proto`. Its captures are NULL until set through
+  // captures(). Returns NULL if out of memory.
+  static Fn* create_closure(Fn* proto);
+
   bool compile(Env*);
   Cell* apply(Env* env, Cell* args);
+  // Apply to the `count` values on top of the results stack, which are
+  // removed from it
+  Cell* apply_values(Env* env, size_t count);
 
   uint32_t param_count() const { return _param_count; }
-  const Param& param(uint32_t i) const { return _params[i]; }
+  const Param& param(uint32_t i) const {
+    return (_proto != 0 ? _proto : this)->_params[i];
+  }
   Cell* body() const { return _body; }
 
+  // Values captured by a closure. A closure stores them where other
+  // functions store their parameters, which it shares with its prototype.
+  uint32_t capture_count() const { return _capture_count; }
+  Cell* const* captures() const { return (Cell* const*)_params; }
+  Cell** captures() { return (Cell**)_params; }
+
   Cell* _body;
+  Code* _code; // bytecode, or NULL if the body is to be tree-walked
+  Code* _special; // bytecode specialized for the types of the params, or NULL
+  Fn* _proto;  // the prototype of a closure, or NULL
+  Cell* _captured; // while compiling: names of the captures, as SYM cells
+  Fn* _gc_next;
+  Fn* _gc_prev;
+  uint32_t _gc_color;
   bool _has_outside_locals;
+  bool _is_loop; // the bindings and body of a (loop ...) being compiled
+  bool _is_polymorphic; // some param has been given arguments of two types
+  uint32_t _apply_count; // up to kJitAfter
   uint32_t _param_count;
+  uint32_t _capture_count;
   Param _params[];
 };
 
@@ -36,6 +84,17 @@ struct Fn {
 
 std::ostream& operator<< (std::ostream& os, const Fn const*);
 
+// Evaluate (loop (name0 init0 ...nameN initN) body), given its arguments
+Cell* eval_loop(Env* env, Cell* args);
+
+// Evaluate (fn #<fn proto> capture0 ...captureN), given its arguments,
+// making a closure of `proto`
+Cell* eval_closure(Env* env, Cell* args);
+
+// `value`, or a copy of it in the heap if it lives in the nursery of `env`,
+// for referencing it from something which outlives the current frame
+Cell* capture_value(Env* env, Cell* value);
+
 } // namespace lum
 
 #endif // _LUM_FN_H_
@@ -0,0 +1,294 @@
+#include <lum/fn.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <lum/memstats.h>
+#include <lum/vm.h>
+#include <lum/gc.h>
+#include "test.h"
+
+using namespace lum;
+
+static Cell* num(int64_t v, Cell* rest=0) {
+  return Cell::createInt(v, rest);
+}
+
+// (+ (+ ... (+ a 1) ... 1) 1) nested `depth` levels deep
+static Cell* make_sums(int depth, Cell* rest) {
+  Cell* first = (depth == 1) ? sym("a") : make_sums(depth - 1, 0);
+  first->set_rest(Cell::createInt(1));
+  return Cell::createList(sym("+", first), rest);
+}
+
+static MemStat stat(uint32_t kind) {
+  MemStat stats[kMemKindCount];
+  mem_stats(stats);
+  return stats[kind];
+}
+
+int main(int argc, const char** argv) {
+  Env env;
+
+  // (fn (a) (+ (+ (+ (+ (+ a 1) 1) 1) 1) 1))
+  Cell* params = Cell::createList(sym("a"), make_sums(5, 0));
+  Cell* fn = eval(&env, Cell::createList(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  fn = Cell::copy(fn);
+  env.results.unwind(0);
+
+  // Arguments to a pure BIF which are pure calls themselves are marked as
+  // not escaping, but the function's result is not
+  Cell* outer = ((Fn*)fn->value.p)->body();
+  assert_eq(outer->flags & Cell::kFlagNoEscape, 0);
+  Cell* arg = ((Cell*)outer->value.p)->rest();
+  for (int depth = 4; depth != 0; --depth) {
+    assert_true(arg->type == Type::LIST);
+    assert_not_eq(arg->flags & Cell::kFlagNoEscape, 0);
+    arg = ((Cell*)arg->value.p)->rest();
+  }
+  assert_true(arg->type == Type::LOCAL);
+
+  // (#<fn> 3000000000) => 3000000005
+  //
+  // Every sum is too large for an immediate. The tree-walker boxes each, but
+  // as each is thrown away together with its scratch frame, no more than two
+  // are live at a time. Bytecode keeps them in registers and only boxes the
+  // result. Only the result is promoted to the heap, and counted as an int
+  // there.
+  Cell* call = Cell::createList(Cell::copy(fn, Cell::createInt(3000000000)));
+  MemStat before = stat(kMemKindNursery);
+  uint64_t ints_before = stat((uint32_t)Type::INT).total;
+  Cell* result = eval(&env, call);
+  assert_eq(Cell::intValue(result), 3000000005);
+  MemStat after = stat(kMemKindNursery);
+  #if LUM_VM
+  assert_true(((Fn*)fn->value.p)->_code != 0);
+  assert_true(after.total - before.total < 5);
+  #else
+  assert_true(after.total - before.total >= 5);
+  #endif
+  assert_true(after.peak <= std::max(before.peak, before.live + 3));
+  assert_eq(stat((uint32_t)Type::INT).total - ints_before, 1);
+  assert_eq(env.nursery.depth(), 0);
+  env.results.unwind(0);
+
+  // A call whose value is the function's result is not marked
+  // (fn (a) (= a (+ a 1)))
+  params = Cell::createList(sym("a"), Cell::createList(sym("=",
+    sym("a", Cell::createList(sym("+", sym("a", Cell::createInt(1))))))));
+  fn = eval(&env, Cell::createList(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  outer = ((Fn*)fn->value.p)->body();
+  assert_eq(outer->flags & Cell::kFlagNoEscape, 0);
+  arg = ((Cell*)outer->value.p)->rest()->rest();
+  assert_not_eq(arg->flags & Cell::kFlagNoEscape, 0);
+  env.results.unwind(0);
+
+  // Calls in tail position do not nest, so this runs far deeper than the
+  // maximum call depth
+  env.set_max_depth(100);
+  // (def countdown (fn (n) (if (= n 0) n (countdown (- n 1)))))
+  eval(&env, list(sym("def", sym("countdown", num(0)))));
+  params = list(sym("n"), list(sym("if",
+    list(sym("=", sym("n", num(0))), sym("n",
+    list(sym("countdown", list(sym("-", sym("n", num(1)))))))))));
+  fn = eval(&env, list(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  env.define(const_cast<Sym*>(intern_sym("countdown")), Cell::copy(fn));
+  env.results.unwind(0);
+  result = eval(&env, list(sym("countdown", num(1000))));
+  assert_true(result != 0);
+  assert_eq(Cell::intValue(result), 0);
+  assert_eq(env.apply_stack.depth, 0);
+  assert_eq(env.locals.depth, 0);
+  env.results.unwind(0);
+
+  // A loop runs in constant space, including the boxed ints it produces
+  // (fn (n k) (loop (i n acc 0) (if (= i 0) acc (recur (- i 1) (+ acc k)))))
+  Cell* recur = list(sym("recur", list(sym("-", sym("i", num(1))),
+    list(sym("+", sym("acc", sym("k")))))));
+  Cell* test = list(sym("if",
+    list(sym("=", sym("i", num(0))), sym("acc", recur))));
+  params = list(sym("n", sym("k")), list(sym("loop",
+    list(sym("i", sym("n", sym("acc", num(0)))), test))));
+  fn = eval(&env, list(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  fn = Cell::copy(fn);
+  env.results.unwind(0);
+  call = list(Cell::copy(fn, num(1000, num(3000000000))));
+  before = stat(kMemKindNursery);
+  result = eval(&env, call);
+  assert_true(result != 0);
+  assert_eq(Cell::intValue(result), 1000 * 3000000000LL);
+  after = stat(kMemKindNursery);
+  assert_true(after.peak <= std::max(before.peak, before.live + 10));
+  assert_eq(env.locals.depth, 0);
+  assert_eq(env.nursery.depth(), 0);
+  env.results.unwind(0);
+
+  // So does a loop outside of any function
+  // (loop (i 1000 acc 0) (if (= i 0) acc (recur (- i 1) (+ acc i))))
+  recur = list(sym("recur", list(sym("-", sym("i", num(1))),
+    list(sym("+", sym("acc", sym("i")))))));
+  test = list(sym("if",
+    list(sym("=", sym("i", num(0))), sym("acc", recur))));
+  result = eval(&env, list(sym("loop",
+    list(sym("i", num(1000, sym("acc", num(0)))), test))));
+  assert_true(result != 0);
+  assert_eq(Cell::intValue(result), 500500);
+  assert_eq(env.locals.depth, 0);
+  assert_eq(env.nursery.depth(), 0);
+  env.results.unwind(0);
+  // (loop (i) i), (loop (1 2) 3) and (loop (i 0))
+  assert_null(eval(&env, list(sym("loop", list(sym("i"), sym("i"))))));
+  assert_null(eval(&env, list(sym("loop", list(num(1, num(2)), num(3))))));
+  assert_null(eval(&env, list(sym("loop", list(sym("i", num(0)))))));
+  env.results.unwind(0);
+
+  // recur anywhere else is an error
+  // (fn (a) (+ 1 (recur a)))
+  params = list(sym("a"),
+    list(sym("+", num(1, list(sym("recur", sym("a")))))));
+  fn = eval(&env, list(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  fn = Cell::copy(fn);
+  env.results.unwind(0);
+  assert_null(eval(&env, list(Cell::copy(fn, num(1)))));
+  assert_eq(env.locals.depth, 0);
+  env.results.unwind(0);
+  env.set_max_depth(Env::kDefaultMaxDepth);
+
+  // An inner function is compiled once, and closures of it share its body
+  // and code while capturing values of their own
+  // (def adder (fn (a) (fn (b) (+ a b))))
+  params = list(sym("a"), list(sym("fn",
+    list(sym("b"), list(sym("+", sym("a", sym("b"))))))));
+  fn = eval(&env, list(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  env.define(const_cast<Sym*>(intern_sym("adder")), Cell::copy(fn));
+  env.results.unwind(0);
+  Cell* add3 = eval(&env, list(sym("adder", num(3))));
+  assert_true(add3 != 0 && add3->type == Type::FN);
+  add3 = Cell::copy(add3);
+  Cell* add4 = eval(&env, list(sym("adder", num(4))));
+  assert_true(add4 != 0 && add4->type == Type::FN);
+  add4 = Cell::copy(add4);
+  env.results.unwind(0);
+  Fn* fn3 = (Fn*)add3->value.p;
+  Fn* fn4 = (Fn*)add4->value.p;
+  assert_true(fn3 != fn4);
+  assert_true(fn3->_proto != 0);
+  assert_eq(fn3->_proto, fn4->_proto);
+  assert_eq(fn3->body(), fn4->body());
+  assert_eq(fn3->_code, fn4->_code);
+  assert_eq(fn3->capture_count(), 1);
+  assert_eq(fn3->param(0).name, intern_sym("b")->name);
+  result = eval(&env, list(Cell::copy(add3, num(10))));
+  assert_eq(Cell::intValue(result), 13);
+  result = eval(&env, list(Cell::copy(add4, num(10))));
+  assert_eq(Cell::intValue(result), 14);
+  assert_eq(env.locals.depth, 0);
+  env.results.unwind(0);
+
+  // Closures keep their prototypes and captures alive
+  env.define(const_cast<Sym*>(intern_sym("add3")), add3);
+  env.define(const_cast<Sym*>(intern_sym("adder")), num(0));
+  gc_collect();
+  result = eval(&env, list(sym("add3", num(1))));
+  assert_eq(Cell::intValue(result), 4);
+  env.results.unwind(0);
+
+  // Locals of any enclosing function and loop can be captured, and calls of
+  // closures in tail position bind their captures
+  // (fn (n) (loop (i n acc 0)
+  //   (if (= i 0)
+  //     ((fn (x) (+ x acc)) n)
+  //     (recur (- i 1) ((fn (x) (fn (y) (+ x y i))) acc) 1))))
+  Cell* nested = list(sym("fn", list(sym("x"), list(sym("fn",
+    list(sym("y"), list(sym("+", sym("x", sym("y", sym("i")))))))))));
+  nested->set_rest(sym("acc"));
+  Cell* make = list(list(nested, num(1)));
+  recur = list(sym("recur", list(sym("-", sym("i", num(1))), make)));
+  Cell* done = list(list(sym("fn", list(sym("x"),
+    list(sym("+", sym("x", sym("acc")))))), sym("n")), recur);
+  test = list(sym("if", list(sym("=", sym("i", num(0))), done)));
+  params = list(sym("n"), list(sym("loop",
+    list(sym("i", sym("n", sym("acc", num(0)))), test))));
+  fn = eval(&env, list(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  fn = Cell::copy(fn);
+  env.results.unwind(0);
+  // acc goes 0, 0+1+3, 4+1+2, 7+1+1 = 9, and the result is 9 + 3
+  result = eval(&env, list(Cell::copy(fn, num(3))));
+  assert_true(result != 0);
+  assert_eq(Cell::intValue(result), 12);
+  assert_eq(env.locals.depth, 0);
+  env.results.unwind(0);
+
+  // An inner function which captures nothing is not made a closure of
+  // (fn () (fn (b) b))
+  params = list(0, list(sym("fn", list(sym("b"), sym("b")))));
+  fn = eval(&env, list(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  fn = Cell::copy(fn);
+  env.results.unwind(0);
+  Cell* inner = eval(&env, list(Cell::copy(fn)));
+  assert_true(inner != 0 && inner->type == Type::FN);
+  assert_null(((Fn*)inner->value.p)->_proto);
+  assert_eq(inner->value.p, eval(&env, list(Cell::copy(fn)))->value.p);
+  env.results.unwind(0);
+
+  // Calls of pure BIFs with constant arguments are folded
+  // (fn (a) (+ a (+ 1 (* 60 60))))
+  Cell* hour = list(sym("*", num(60, num(60))));
+  params = list(sym("a"),
+    list(sym("+", sym("a", list(sym("+", num(1, hour)))))));
+  fn = eval(&env, list(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  fn = Cell::copy(fn);
+  env.results.unwind(0);
+  Cell* folded = ((Cell*)((Fn*)fn->value.p)->body()->value.p)->rest();
+  folded = folded->rest();
+  assert_true(folded->type == Type::INT);
+  assert_eq(Cell::intValue(folded), 3601);
+  result = eval(&env, list(Cell::copy(fn, num(1))));
+  assert_eq(Cell::intValue(result), 3602);
+  env.results.unwind(0);
+
+  // So are constants of the core namespace, and calls of cons
+  // (fn () (if (= true true) (cons 1 (quote (2))) nil))
+  Cell* quoted = Cell::createQuote(list(num(2)));
+  params = list(0, list(sym("if", list(sym("=", sym("true", sym("true"))),
+    list(sym("cons", num(1, quoted)), sym("nil"))))));
+  fn = eval(&env, list(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  fn = Cell::copy(fn);
+  env.results.unwind(0);
+  folded = ((Cell*)((Fn*)fn->value.p)->body()->value.p)->rest();
+  assert_true(folded->type == Type::BOOL);
+  assert_true(folded->rest()->type == Type::QUOTE);
+  assert_true(folded->rest()->rest()->type == Type::QUOTE);
+  result = eval(&env, list(Cell::copy(fn)));
+  assert_true(result != 0 && result->type == Type::LIST);
+  assert_eq(Cell::intValue((Cell*)result->value.p), 1);
+  env.results.unwind(0);
+
+  // but not calls which would fail, nor Vars which have been rebound
+  // (fn () (/ 1 0))
+  params = list(0, list(sym("/", num(1, num(0)))));
+  fn = eval(&env, list(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  assert_true(((Fn*)fn->value.p)->body()->type == Type::LIST);
+  env.results.unwind(0);
+  {
+    Env env2;
+    env2.define(const_cast<Sym*>(intern_sym("true")), num(0));
+    // (fn () (+ 1 2 true))
+    params = list(0, list(sym("+", num(1, num(2, sym("true"))))));
+    fn = eval(&env2, list(sym("fn", params)));
+    assert_true(fn != 0 && fn->type == Type::FN);
+    assert_true(((Fn*)fn->value.p)->body()->type == Type::LIST);
+    env2.results.unwind(0);
+  }
+
+  return 0;
+}
@@ -0,0 +1,435 @@
+#include <lum/gc.h>
+#include <lum/heap.h>
+#include <lum/cell.h>
+#include <lum/fn.h>
+#include <lum/atom.h>
+#include <lum/env.h>
+#include <lum/sched.h>
+#include <chrono>
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+
+namespace lum {
+
+thread_local uint32_t _gc_alloc_budget = kGCAllocBatch;
+uint32_t _gc_color = 0;
+volatile bool _gc_requested = false;
+
+static int32_t  alloc_batches = 0;      // since last collection
+static int32_t  threshold_batches = 256; // 64Ki cells
+static int32_t  min_threshold_batches = 256;
+static GCStats  stats;
+
+static Spinlock roots_lock = LUM_SPINLOCK_INIT;
+static std::vector<Env*> envs;
+static std::vector<Scheduler*> schedulers;
+static Fn* fns = 0; // all Fns, linked through Fn::_gc_next
+static Atom* atoms = 0; // all Atoms, linked through Atom::_gc_next
+
+// Stopping the world. Mutators are threads with at least one live Env.
+static std::mutex world_mutex;
+static std::condition_variable world_cond; // signals a finished collection
+static int32_t  running_mutators = 0; // neither stopped nor blocked
+static uint64_t collection_count = 0;
+static thread_local uint32_t thread_env_count = 0;
+
+
+void _gc_alloc_batch_done() {
+  _gc_alloc_budget = kGCAllocBatch;
+  LumAtomicAdd32(&alloc_batches, 1);
+  if (alloc_batches >= threshold_batches) {
+    _gc_requested = true;
+  }
+}
+
+
+void gc_set_threshold(size_t cells) {
+  size_t batches = (cells + kGCAllocBatch - 1) / kGCAllocBatch;
+  min_threshold_batches = batches == 0 ? 1 : (int32_t)batches;
+  threshold_batches = min_threshold_batches;
+}
+
+
+const GCStats& gc_stats() {
+  return stats;
+}
+
+
+static void collect();
+
+// With world_mutex held: collect if one was requested and no mutator is
+// running anymore, waking up those which wait for it
+static void collect_if_stopped() {
+  if (running_mutators != 0 || !_gc_requested) {
+    return;
+  }
+  collect();
+  ++collection_count;
+  world_cond.notify_all();
+}
+
+
+void gc_register_env(Env* env) {
+  {
+    ScopedSpinlock lock(roots_lock);
+    envs.push_back(env);
+  }
+  if (thread_env_count++ == 0) {
+    std::lock_guard<std::mutex> lock(world_mutex);
+    ++running_mutators;
+  }
+}
+
+
+void gc_unregister_env(Env* env) {
+  {
+    ScopedSpinlock lock(roots_lock);
+    envs.erase(std::remove(envs.begin(), envs.end(), env), envs.end());
+  }
+  if (--thread_env_count == 0) {
+    std::lock_guard<std::mutex> lock(world_mutex);
+    --running_mutators;
+    collect_if_stopped();
+  }
+}
+
+
+void gc_register_scheduler(Scheduler* sched) {
+  ScopedSpinlock lock(roots_lock);
+  schedulers.push_back(sched);
+}
+
+
+void gc_unregister_scheduler(Scheduler* sched) {
+  ScopedSpinlock lock(roots_lock);
+  schedulers.erase(std::remove(schedulers.begin(), schedulers.end(), sched),
+                   schedulers.end());
+}
+
+
+void gc_register_fn(Fn* fn) {
+  ScopedSpinlock lock(roots_lock);
+  fn->_gc_color = _gc_color;
+  fn->_gc_prev = 0;
+  fn->_gc_next = fns;
+  if (fns != 0) {
+    fns->_gc_prev = fn;
+  }
+  fns = fn;
+}
+
+
+void gc_unregister_fn(Fn* fn) {
+  ScopedSpinlock lock(roots_lock);
+  if (fn->_gc_prev != 0) {
+    fn->_gc_prev->_gc_next = fn->_gc_next;
+  } else {
+    fns = fn->_gc_next;
+  }
+  if (fn->_gc_next != 0) {
+    fn->_gc_next->_gc_prev = fn->_gc_prev;
+  }
+}
+
+
+void gc_register_atom(Atom* atom) {
+  ScopedSpinlock lock(roots_lock);
+  atom->_gc_color = _gc_color;
+  atom->_gc_prev = 0;
+  atom->_gc_next = atoms;
+  if (atoms != 0) {
+    atoms->_gc_prev = atom;
+  }
+  atoms = atom;
+}
+
+
+void gc_unregister_atom(Atom* atom) {
+  ScopedSpinlock lock(roots_lock);
+  if (atom->_gc_prev != 0) {
+    atom->_gc_prev->_gc_next = atom->_gc_next;
+  } else {
+    atoms = atom->_gc_next;
+  }
+  if (atom->_gc_next != 0) {
+    atom->_gc_next->_gc_prev = atom->_gc_prev;
+  }
+}
+
+// ---------------------------------------------------------------------------
+// Mark
+
+struct Marker {
+  uint32_t color;
+  std::vector<Cell*> grey; // cells whose chains are yet to be traced
+
+  void add(Cell* c) {
+    if (c != 0 && !Cell::isImm(c) && !Cell::isImmortal(c)) {
+      grey.push_back(c);
+    }
+  }
+
+  // A closure keeps its prototype and its captured values alive
+  void add(Fn* fn) {
+    if (fn->_gc_color == color) {
+      return;
+    }
+    fn->_gc_color = color;
+    add(fn->_body);
+    if (fn->_proto != 0) {
+      add(fn->_proto);
+      for (uint32_t i = 0; i != fn->capture_count(); ++i) {
+        add(fn->captures()[i]);
+      }
+    }
+  }
+
+  template <typename T, size_t N>
+  void add(const Stack<T,N>& stack) {
+    for (size_t i = 0; i != stack.depth; ++i) { add(stack.at(i)); }
+  }
+
+  void add(Namespace& ns) {
+    for (auto& entry : ns.mappings._map) { add(entry.second.get()); }
+  }
+
+  void add(Env* env) {
+    add(env->locals);
+    add(env->apply_stack);
+    add(env->results.cell_stack);
+    // Cells in the nursery are never collected, but they may reference cells
+    // in the heap
+    env->nursery.for_each([this](Cell* c) { add(c); });
+    for (size_t i = 0; i != env->compile_stack.depth; ++i) {
+      add(env->compile_stack.at(i)->_body);
+    }
+    add(env->namespaces->core);
+    for (auto& entry : env->namespaces->map) { add(entry.second); }
+  }
+
+  // A task keeps its form and its result alive
+  void add(Task* t) {
+    if (t->_gc_color == color) {
+      return;
+    }
+    t->_gc_color = color;
+    add(t->form);
+    add(t->result);
+  }
+
+  // An atom keeps its value alive
+  void add(Atom* atom) {
+    if (atom->_gc_color == color) {
+      return;
+    }
+    atom->_gc_color = color;
+    add(atom->get());
+  }
+
+  // Processes which have not finished yet, and those spawned from C++ which
+  // have not been joined, are roots. Others, and promises, are reached
+  // through TASK and FUTURE cells.
+  void add(Scheduler* sched) {
+    ScopedSpinlock lock(sched->_tasks_lock);
+    for (Task* t = sched->_tasks; t != 0; t = t->_all_next) {
+      if ((!t->is_done && t->form != 0) || t->_is_held) {
+        add(t);
+      }
+    }
+  }
+
+  void trace() {
+    while (!grey.empty()) {
+      Cell* c = grey.back();
+      grey.pop_back();
+      // Follow the rest chain in this loop, so that only nested lists and
+      // function bodies take up room on the grey stack.
+      while (c != 0 && !Cell::isImmortal(c) &&
+             (c->flags & Cell::kFlagGCColor) != color)
+      {
+        c->flags = (c->flags & ~Cell::kFlagGCColor) | color;
+        switch (c->type) {
+          case Type::LIST:
+          case Type::QUOTE: { add((Cell*)c->value.p); break; }
+          case Type::FN: { add((Fn*)c->value.p); break; }
+          case Type::TASK:
+          case Type::FUTURE: { add((Task*)c->value.p); break; }
+          case Type::ATOM: { add((Atom*)c->value.p); break; }
+          default: break;
+        }
+        c = c->rest();
+      }
+    }
+  }
+};
+
+// ---------------------------------------------------------------------------
+// Sweep
+
+static void sweep_cells(uint32_t color) {
+  const uint32_t size_class = heap_size_class(sizeof(Cell));
+  uint64_t live = 0;
+  for (HeapSlab* s = heap_slabs(); s != 0; s = s->all_next) {
+    if (s->size_class != size_class) {
+      continue;
+    }
+    // Walk slots backwards. Since freed slots are pushed onto the front of
+    // the free list, this leaves them in address order, which lets
+    // heap_alloc_run hand out contiguous runs.
+    char* p = s->slots_end();
+    while (p != s->slots_begin()) {
+      p -= s->slot_size;
+      if (heap_is_free(p)) {
+        continue;
+      }
+      Cell* c = (Cell*)p;
+      if ((c->flags & Cell::kFlagGCColor) != color) {
+        // Not Cell::free since that might print `c` which could reference
+        // cells we already freed.
+        if (c->type != Type::UNKNOWN) {
+          mem_note_free((uint32_t)c->type, sizeof(Cell));
+        }
+        heap_free(c);
+        ++stats.cells_freed;
+      } else {
+        ++live;
+      }
+    }
+  }
+  stats.live_cells = live;
+}
+
+
+static void sweep_fns(uint32_t color) {
+  Fn* fn = fns;
+  while (fn != 0) {
+    Fn* next = fn->_gc_next;
+    if (fn->_gc_color != color) {
+      Fn::free(fn);
+      ++stats.fns_freed;
+    }
+    fn = next;
+  }
+}
+
+
+static void sweep_atoms(uint32_t color) {
+  Atom* atom = atoms;
+  while (atom != 0) {
+    Atom* next = atom->_gc_next;
+    if (atom->_gc_color != color) {
+      Atom::free(atom);
+      ++stats.atoms_freed;
+    }
+    atom = next;
+  }
+}
+
+
+static void sweep_tasks(Scheduler* sched, uint32_t color) {
+  ScopedSpinlock lock(sched->_tasks_lock);
+  Task* t = sched->_tasks;
+  while (t != 0) {
+    Task* next = t->_all_next;
+    if (t->_gc_color != color) {
+      if (t->_all_prev != 0) {
+        t->_all_prev->_all_next = next;
+      } else {
+        sched->_tasks = next;
+      }
+      if (next != 0) {
+        next->_all_prev = t->_all_prev;
+      }
+      delete t;
+      ++stats.tasks_freed;
+    }
+    t = next;
+  }
+}
+
+// ---------------------------------------------------------------------------
+
+// Collect with the world stopped and world_mutex held
+static void collect() {
+  auto start = std::chrono::steady_clock::now();
+
+  Marker m;
+  m.color = _gc_color ^ Cell::kFlagGCColor;
+  spinlock_lock(roots_lock);
+  for (Env* env : envs) {
+    m.add(env);
+  }
+  for (Scheduler* sched : schedulers) {
+    m.add(sched);
+  }
+  spinlock_unlock(roots_lock);
+  m.trace();
+
+  sweep_cells(m.color);
+  sweep_fns(m.color);
+  sweep_atoms(m.color);
+  spinlock_lock(roots_lock);
+  for (Scheduler* sched : schedulers) {
+    sweep_tasks(sched, m.color);
+  }
+  spinlock_unlock(roots_lock);
+  _gc_color = m.color;
+
+  // Don't collect again until we have allocated at least as many cells as
+  // there are live ones, keeping the cost of collection proportional to the
+  // amount of allocation.
+  int32_t live_batches = (int32_t)(stats.live_cells / kGCAllocBatch);
+  threshold_batches = LUM_MAX(min_threshold_batches, live_batches);
+  alloc_batches = 0;
+  _gc_requested = false;
+
+  auto pause = std::chrono::steady_clock::now() - start;
+  uint64_t ns = (uint64_t)
+    std::chrono::duration_cast<std::chrono::nanoseconds>(pause).count();
+  ++stats.collections;
+  stats.pause_last_ns = ns;
+  stats.pause_total_ns += ns;
+  if (ns > stats.pause_max_ns) {
+    stats.pause_max_ns = ns;
+  }
+}
+
+
+void gc_collect() {
+  _gc_requested = true;
+  std::unique_lock<std::mutex> lock(world_mutex);
+  uint64_t count = collection_count;
+  bool is_mutator = thread_env_count != 0;
+  if (is_mutator) {
+    --running_mutators;
+  }
+  collect_if_stopped();
+  while (collection_count == count) {
+    world_cond.wait(lock);
+  }
+  if (is_mutator) {
+    ++running_mutators;
+  }
+}
+
+
+void gc_blocking_begin() {
+  if (thread_env_count == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(world_mutex);
+  --running_mutators;
+  collect_if_stopped();
+}
+
+
+void gc_blocking_end() {
+  if (thread_env_count == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(world_mutex);
+  ++running_mutators;
+}
+
+} // namespace lum
@@ -0,0 +1,109 @@
+#ifndef _LUM_GC_H_
+#define _LUM_GC_H_
+
+#include <lum/common.h>
+
+namespace lum {
+
+struct Env;
+struct Fn;
+struct Atom;
+struct Scheduler;
+
+// Precise mark-sweep garbage collector for Cells and the Fns they reference.
+//
+// The roots are the locals, results, apply and compile stacks and the
+// nursery (see nursery.h) of every live Env, together with the Vars of all
+// of its namespaces and the unfinished processes of schedulers (see
+// sched.h). Fns are reached through FN cells and their bodies are traced
+// like any other cell chain, and likewise tasks through TASK and FUTURE
+// cells and atoms through ATOM cells.
+//
+// Instead of setting and later clearing a mark bit, each collection flips the
+// color that counts as "marked" and paints reachable cells with it. Cells
+// which do not live in the heap are therefore never in need of a clearing
+// pass. New cells are given the color of the previous collection, which makes
+// them unmarked in the next one.
+//
+// Collection is stop-the-world and only happens at safepoints (see
+// Env::safepoint), where no cell is held exclusively by C++ code: before
+// each top-level form, on entry to a function and at each round of a loop or
+// tail call (see fn.cc), and between the processes a worker runs. Allocation
+// merely requests a collection once enough cells have been allocated since
+// the previous one.
+//
+// Each thread with a live Env is a mutator. A collection waits until every
+// mutator has either stopped at a safepoint or is blocked, having called
+// gc_blocking_begin, and the last of them to get there does the work. A
+// mutator must therefore reach safepoints regularly or block through
+// gc_blocking_begin while waiting for other threads.
+
+struct GCStats {
+  uint64_t collections    = 0;
+  uint64_t cells_freed    = 0; // in total
+  uint64_t fns_freed      = 0; // in total
+  uint64_t tasks_freed    = 0; // in total
+  uint64_t atoms_freed    = 0; // in total
+  uint64_t live_cells     = 0; // after the last collection
+  uint64_t pause_last_ns  = 0;
+  uint64_t pause_max_ns   = 0;
+  uint64_t pause_total_ns = 0;
+};
+
+// Collect garbage now, once all other mutators have stopped
+void gc_collect();
+
+// The calling thread will not touch any cell until gc_blocking_end, and
+// every cell it uses is reachable from the roots, so collection may happen
+// without waiting for it. gc_blocking_end waits for a collection which is
+// in progress to finish.
+void gc_blocking_begin();
+void gc_blocking_end();
+
+// Collect garbage if allocation pressure has requested it
+inline void gc_collect_if_needed();
+
+// Number of cells that need to be allocated before a collection is
+// requested. The effective threshold is never lower than the number of cells
+// which survived the last collection.
+void gc_set_threshold(size_t cells);
+
+const GCStats& gc_stats();
+
+// Registration of roots and of objects which are not cells
+void gc_register_env(Env*);
+void gc_unregister_env(Env*);
+void gc_register_fn(Fn*);
+void gc_unregister_fn(Fn*);
+void gc_register_atom(Atom*);
+void gc_unregister_atom(Atom*);
+void gc_register_scheduler(Scheduler*);
+void gc_unregister_scheduler(Scheduler*);
+
+// ---- impl ----
+
+// Allocations are counted per thread and reported in batches
+static constexpr uint32_t kGCAllocBatch = 256;
+
+extern thread_local uint32_t _gc_alloc_budget;
+extern uint32_t _gc_color;
+extern volatile bool _gc_requested;
+void _gc_alloc_batch_done();
+
+inline void gc_note_alloc() {
+  if (--_gc_alloc_budget == 0) {
+    _gc_alloc_batch_done();
+  }
+}
+
+// Flags for a newly allocated cell
+inline uint32_t gc_alloc_flags() { return _gc_color; }
+
+inline void gc_collect_if_needed() {
+  if (_gc_requested) {
+    gc_collect();
+  }
+}
+
+} // namespace lum
+#endif // _LUM_GC_H_
@@ -0,0 +1,47 @@
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <lum/heap.h>
+#include <lum/gc.h>
+#include "test.h"
+
+using namespace lum;
+
+// (+ 1 2)
+static Cell* make_sum() {
+  Cell* a = Cell::createInt(2);
+  a = Cell::createInt(1, a);
+  a = Cell::createSym(kSym_sum, a);
+  return Cell::createList(a);
+}
+
+int main(int argc, const char** argv) {
+  Env env;
+  gc_set_threshold(1024);
+
+  // Values bound to Vars are roots
+  Cell* kept = Cell::createInt(4242);
+  env.define(const_cast<Sym*>(intern_sym("kept")), kept);
+
+  for (int i = 0; i != 20000; ++i) {
+    Cell* result = eval(&env, make_sum());
+    assert_eq(Cell::intValue(result), 3);
+    env.results.unwind(0);
+  }
+
+  const GCStats& stats = gc_stats();
+  assert_true(stats.collections > 0);
+  assert_true(stats.cells_freed > 0);
+  assert_true(stats.pause_max_ns >= stats.pause_last_ns);
+
+  // Memory stays bounded: each iteration allocates 3 cells, and we never
+  // let more than about two thresholds' worth of them pile up.
+  gc_collect();
+  assert_true(stats.live_cells < 4096);
+
+  assert_false(heap_is_free(kept));
+  assert_eq(kept->value.i, 4242);
+  assert_eq(env.resolve_symbol(const_cast<Sym*>(intern_sym("kept")))->get(),
+            kept);
+
+  return 0;
+}
@@ -0,0 +1,293 @@
+#include <lum/heap.h>
+#if LUM_TARGET_OS_POSIX
+  #include <sys/mman.h>
+#endif
+
+namespace lum {
+
+// Number of objects owned by other threads that we collect before handing
+// them back to their slabs.
+static constexpr uint32_t kHeapBatchSize = 64;
+
+struct HeapThread {
+  HeapSlab* active[kHeapSizeClassCount]; // slabs which might have free slots
+  HeapSlab* full[kHeapSizeClassCount];   // slabs which were full last we looked
+  HeapFreeSlot* pending[kHeapBatchSize]; // freed objects owned by others
+  uint32_t pending_count;
+};
+
+static thread_local HeapThread* t_heap = 0;
+
+// Slabs not owned by any thread, by size class
+static HeapSlab* pool[kHeapSizeClassCount];
+static HeapSlab* all_slabs = 0;
+static Spinlock  pool_lock = LUM_SPINLOCK_INIT;
+
+
+static HeapThread* heap_thread() {
+  if (t_heap == 0) {
+    t_heap = (HeapThread*)calloc(1, sizeof(HeapThread));
+    if (t_heap == 0) {
+      LUM_FATAL("out of memory - unable to allocate heap thread state");
+    }
+  }
+  return t_heap;
+}
+
+
+static HeapSlab* heap_slab_map() {
+#if LUM_TARGET_OS_POSIX
+  // Map twice the size we need and trim off both ends, leaving a region
+  // which is aligned to kHeapSlabSize.
+  size_t len = kHeapSlabSize * 2;
+  char* p = (char*)mmap(0, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (p == (char*)MAP_FAILED) {
+    return 0;
+  }
+  uintptr_t aligned =
+    ((uintptr_t)p + (kHeapSlabSize - 1)) & ~(uintptr_t)(kHeapSlabSize - 1);
+  size_t head = aligned - (uintptr_t)p;
+  size_t tail = len - head - kHeapSlabSize;
+  if (head != 0) { munmap(p, head); }
+  if (tail != 0) { munmap((void*)(aligned + kHeapSlabSize), tail); }
+  return (HeapSlab*)aligned;
+#else
+  void* p = 0;
+  return posix_memalign(&p, kHeapSlabSize, kHeapSlabSize) == 0
+    ? (HeapSlab*)p : 0;
+#endif
+}
+
+
+static HeapSlab* heap_slab_create(uint32_t size_class) {
+  HeapSlab* s = heap_slab_map();
+  if (s == 0) {
+    return 0;
+  }
+  s->next = 0;
+  s->owner = 0;
+  s->size_class = size_class;
+  s->slot_size = (uint32_t)heap_slot_size(size_class);
+  s->slot_count =
+    (uint32_t)((kHeapSlabSize - HeapSlab::kHeaderSize) / s->slot_size);
+  s->remote_free = 0;
+
+  // Thread all slots onto the free list in address order, so that
+  // consecutive allocations are laid out sequentially in memory.
+  HeapFreeSlot* next = 0;
+  char* p = s->slots_end();
+  while (p != s->slots_begin()) {
+    p -= s->slot_size;
+    HeapFreeSlot* slot = (HeapFreeSlot*)p;
+    slot->tag = kHeapFreeSlotTag;
+    slot->next = next;
+    next = slot;
+  }
+  s->free_list = next;
+
+  spinlock_lock(pool_lock);
+  s->all_next = all_slabs;
+  all_slabs = s;
+  spinlock_unlock(pool_lock);
+  return s;
+}
+
+
+// Move any objects that other threads have returned to the free list.
+// Must only be called by the owner of `s`.
+static void heap_slab_drain(HeapSlab* s) {
+  if (s->remote_free == 0) {
+    return;
+  }
+  HeapFreeSlot* slot =
+    (HeapFreeSlot*)LumAtomicSwap(&s->remote_free, (HeapFreeSlot*)0);
+  while (slot != 0) {
+    HeapFreeSlot* next = slot->next;
+    slot->next = s->free_list;
+    s->free_list = slot;
+    slot = next;
+  }
+}
+
+
+static HeapSlab* heap_refill(HeapThread* t, uint32_t sc) {
+  // Look through slabs we believe have free slots, moving the ones that
+  // turn out to be full to the full list.
+  HeapSlab* s;
+  while ((s = t->active[sc]) != 0) {
+    heap_slab_drain(s);
+    if (s->free_list != 0) {
+      return s;
+    }
+    t->active[sc] = s->next;
+    s->next = t->full[sc];
+    t->full[sc] = s;
+  }
+
+  // Recover full slabs which have had objects freed since they filled up.
+  // This happens at most once per slab's worth of allocations.
+  HeapSlab** pp = &t->full[sc];
+  while ((s = *pp) != 0) {
+    heap_slab_drain(s);
+    if (s->free_list != 0) {
+      *pp = s->next;
+      s->next = t->active[sc];
+      t->active[sc] = s;
+    } else {
+      pp = &s->next;
+    }
+  }
+  if (t->active[sc] != 0) {
+    return t->active[sc];
+  }
+
+  // Adopt a slab from the pool, or map a new one
+  while (1) {
+    spinlock_lock(pool_lock);
+    s = pool[sc];
+    if (s != 0) {
+      pool[sc] = s->next;
+    }
+    spinlock_unlock(pool_lock);
+
+    if (s == 0) {
+      s = heap_slab_create(sc);
+      if (s == 0) {
+        fprintf(stderr, "out of memory - unable to allocate heap slab\n");
+        return 0;
+      }
+    }
+
+    s->owner = t;
+    heap_slab_drain(s);
+    if (s->free_list != 0) {
+      s->next = 0;
+      t->active[sc] = s;
+      return s;
+    }
+    s->next = t->full[sc];
+    t->full[sc] = s;
+  }
+}
+
+
+// Return batched objects to their slabs. Consecutive objects which belong to
+// the same slab are linked together and pushed with a single CAS.
+static void heap_flush_pending(HeapThread* t) {
+  uint32_t i = 0;
+  while (i != t->pending_count) {
+    HeapFreeSlot* head = t->pending[i++];
+    HeapFreeSlot* tail = head;
+    HeapSlab* s = HeapSlab::of(head);
+    while (i != t->pending_count && HeapSlab::of(t->pending[i]) == s) {
+      tail->next = t->pending[i++];
+      tail = tail->next;
+    }
+    HeapFreeSlot* prev;
+    do {
+      prev = s->remote_free;
+      tail->next = prev;
+    } while (!LumAtomicBoolCmpSwap(&s->remote_free, prev, head));
+  }
+  t->pending_count = 0;
+}
+
+
+void* heap_alloc(size_t size) {
+  assert(size <= kHeapMaxSize);
+  uint32_t sc = heap_size_class(size);
+  HeapThread* t = heap_thread();
+  HeapSlab* s = t->active[sc];
+  if (s == 0 || s->free_list == 0) {
+    if ((s = heap_refill(t, sc)) == 0) {
+      return 0;
+    }
+  }
+  HeapFreeSlot* slot = s->free_list;
+  s->free_list = slot->next;
+  return (void*)slot;
+}
+
+
+void* heap_alloc_run(size_t size, size_t* count) {
+  assert(size <= kHeapMaxSize);
+  assert(*count != 0);
+  uint32_t sc = heap_size_class(size);
+  HeapThread* t = heap_thread();
+  HeapSlab* s = t->active[sc];
+  if (s == 0 || s->free_list == 0) {
+    if ((s = heap_refill(t, sc)) == 0) {
+      return 0;
+    }
+  }
+  // Take slots off the free list for as long as they are adjacent. Fresh
+  // slabs have their free list in address order, and so does a slab which
+  // has been swept (see gc.cc), so this usually yields long runs.
+  HeapFreeSlot* first = s->free_list;
+  HeapFreeSlot* last = first;
+  size_t n = 1;
+  while (n != *count &&
+         last->next == (HeapFreeSlot*)((char*)last + s->slot_size))
+  {
+    last = last->next;
+    ++n;
+  }
+  s->free_list = last->next;
+  *count = n;
+  return (void*)first;
+}
+
+
+void heap_free(void* p) {
+  if (p == 0) {
+    return;
+  }
+  HeapSlab* s = HeapSlab::of(p);
+  HeapThread* t = heap_thread();
+  HeapFreeSlot* slot = (HeapFreeSlot*)p;
+  slot->tag = kHeapFreeSlotTag;
+  if (s->owner == t) {
+    slot->next = s->free_list;
+    s->free_list = slot;
+  } else {
+    t->pending[t->pending_count++] = slot;
+    if (t->pending_count == kHeapBatchSize) {
+      heap_flush_pending(t);
+    }
+  }
+}
+
+
+HeapSlab* heap_slabs() {
+  return all_slabs;
+}
+
+
+void heap_thread_exit() {
+  HeapThread* t = t_heap;
+  if (t == 0) {
+    return;
+  }
+  heap_flush_pending(t);
+
+  spinlock_lock(pool_lock);
+  for (uint32_t sc = 0; sc != kHeapSizeClassCount; ++sc) {
+    HeapSlab* lists[] = {t->active[sc], t->full[sc]};
+    for (HeapSlab* s : lists) {
+      while (s != 0) {
+        HeapSlab* next = s->next;
+        s->owner = 0;
+        s->next = pool[sc];
+        pool[sc] = s;
+        s = next;
+      }
+    }
+  }
+  spinlock_unlock(pool_lock);
+
+  std::free(t);
+  t_heap = 0;
+}
+
+} // namespace lum
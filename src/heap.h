@@ -0,0 +1,103 @@
+#ifndef _LUM_HEAP_H_
+#define _LUM_HEAP_H_
+
+#include <lum/common.h>
+
+namespace lum {
+
+// Slab allocator for small, fixed-size objects like Cells.
+//
+// Memory is carved out of page-backed slabs of kHeapSlabSize bytes. A slab is
+// aligned to its size, so the slab owning an object is found by masking the
+// object's address. Each slab serves exactly one size class and is owned by a
+// single thread, which allocates from and frees to the slab's free list
+// without any synchronization.
+//
+// Objects freed by a thread which does not own their slab are collected in a
+// thread-local batch. When the batch fills up, the objects are handed back to
+// their owning slabs with one compare-and-swap per run of same-slab objects.
+// The owner picks them up the next time it runs out of free slots.
+//
+// A free slot has its first word set to kHeapFreeSlotTag. Objects stored in
+// the heap must never have all bits of their first word set, which lets a
+// slab be walked while telling live objects apart from free slots.
+
+static constexpr size_t   kHeapSlabSize = 64 * 1024;
+static constexpr size_t   kHeapSizeClassCount = 7;
+static constexpr size_t   kHeapMaxSize = 128;
+static constexpr uint64_t kHeapFreeSlotTag = UINT64_MAX;
+
+// Size class index for an object of `size` bytes.
+constexpr uint32_t heap_size_class(size_t size) {
+  return size <= 16 ? 0 :
+         size <= 24 ? 1 :
+         size <= 32 ? 2 :
+         size <= 48 ? 3 :
+         size <= 64 ? 4 :
+         size <= 96 ? 5 : 6;
+}
+
+// Slot size in bytes of `size_class`
+constexpr size_t heap_slot_size(uint32_t size_class) {
+  return size_class == 0 ? 16 :
+         size_class == 1 ? 24 :
+         size_class == 2 ? 32 :
+         size_class == 3 ? 48 :
+         size_class == 4 ? 64 :
+         size_class == 5 ? 96 : 128;
+}
+
+struct HeapThread;
+
+struct HeapFreeSlot {
+  uint64_t      tag; // kHeapFreeSlotTag
+  HeapFreeSlot* next;
+};
+
+struct HeapSlab {
+  HeapSlab*     next;      // next slab in its owner's list or in the pool
+  HeapSlab*     all_next;  // next slab in the list of all slabs
+  HeapThread*   owner;     // 0 when in the pool
+  uint32_t      size_class;
+  uint32_t      slot_size;
+  uint32_t      slot_count;
+  HeapFreeSlot* free_list; // only touched by the owner
+  HeapFreeSlot* volatile remote_free; // pushed to by other threads
+
+  char* slots_begin() { return ((char*)this) + kHeaderSize; }
+  char* slots_end() { return slots_begin() + (slot_size * slot_count); }
+
+  static HeapSlab* of(const void* p) {
+    return (HeapSlab*)((uintptr_t)p & ~(uintptr_t)(kHeapSlabSize - 1));
+  }
+
+  static constexpr size_t kHeaderSize = 64;
+};
+
+// Allocate `size` bytes. `size` must be <= kHeapMaxSize.
+void* heap_alloc(size_t size);
+
+// Allocate up to `*count` objects of `size` bytes which are laid out back to
+// back in memory. Returns the first object and stores the number of objects
+// allocated, which is at least one, in `*count`. Returns 0 if out of memory.
+void* heap_alloc_run(size_t size, size_t* count);
+
+// Return memory allocated with heap_alloc
+void heap_free(void* p);
+
+// Hand back any batched objects to their slabs and give up ownership of the
+// calling thread's slabs. Should be called by a thread before it exits.
+void heap_thread_exit();
+
+// Returns the most recently created slab. All slabs are linked through
+// HeapSlab::all_next and are never unmapped, so the list can be walked
+// without locking.
+HeapSlab* heap_slabs();
+
+// Returns true if `p` was freed with heap_free and has not been reallocated
+inline bool heap_is_free(const void* p) {
+  return ((const HeapFreeSlot*)p)->tag == kHeapFreeSlotTag;
+}
+
+} // namespace lum
+#endif // _LUM_HEAP_H_
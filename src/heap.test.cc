@@ -0,0 +1,69 @@
+#include <lum/heap.h>
+#include "test.h"
+#include <thread>
+
+using namespace lum;
+
+int main(int argc, const char** argv) {
+  // Size classes
+  assert_eq(heap_size_class(1), 0);
+  assert_eq(heap_size_class(24), 1);
+  assert_eq(heap_size_class(25), 2);
+  assert_eq(heap_size_class(kHeapMaxSize), kHeapSizeClassCount-1);
+  assert_true(heap_slot_size(heap_size_class(40)) >= 40);
+
+  // Consecutive allocations are laid out sequentially within a slab
+  const size_t N = 10000;
+  void** v = (void**)malloc(sizeof(void*) * N);
+  for (size_t i = 0; i != N; ++i) {
+    v[i] = heap_alloc(24);
+    assert_not_eq(v[i], (void*)0);
+    assert_eq(((uintptr_t)v[i]) % 8, 0);
+    memset(v[i], 0, 24);
+  }
+  assert_eq((char*)v[1], ((char*)v[0]) + 24);
+  assert_eq(HeapSlab::of(v[1])->size_class, heap_size_class(24));
+
+  // Freed slots are tagged and reused
+  heap_free(v[N-1]);
+  assert_true(heap_is_free(v[N-1]));
+  void* p = heap_alloc(24);
+  assert_eq(p, v[N-1]);
+  memset(p, 0, 24);
+
+  // Objects freed by another thread are handed back to the owning slab
+  std::thread([&] {
+    for (size_t i = 0; i != N; ++i) {
+      heap_free(v[i]);
+    }
+    heap_thread_exit();
+  }).join();
+  for (size_t i = 0; i != N; ++i) {
+    assert_true(heap_is_free(v[i]));
+  }
+  for (size_t i = 0; i != N; ++i) {
+    p = heap_alloc(24);
+    assert_eq(HeapSlab::of(p)->owner, HeapSlab::of(v[0])->owner);
+    memset(p, 0, 24);
+  }
+  // The above should all have been satisfied by slots returned from the
+  // other thread, and thus live in the same slabs as before.
+  assert_eq(HeapSlab::of(p)->size_class, heap_size_class(24));
+
+  // Runs of adjacent objects
+  size_t count = 100;
+  char* run = (char*)heap_alloc_run(32, &count);
+  assert_not_eq(run, (char*)0);
+  assert_true(count >= 1 && count <= 100);
+  for (size_t i = 0; i != count; ++i) {
+    assert_eq(HeapSlab::of(run + (i * 32))->size_class, heap_size_class(32));
+    memset(run + (i * 32), 0, 32);
+  }
+  // A fresh slab hands out the full run
+  count = 100;
+  run = (char*)heap_alloc_run(32, &count);
+  assert_eq(count, 100);
+
+  free(v);
+  return 0;
+}
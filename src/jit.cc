@@ -0,0 +1,370 @@
+#include <lum/jit.h>
+#include <lum/env.h>
+#include <lum/memstats.h>
+#include <cmath>
+#if LUM_JIT
+#include <sys/mman.h>
+#endif
+
+namespace lum {
+
+bool jit_enabled() {
+  #if LUM_JIT
+  const char* s = getenv("LUM_JIT");
+  return s == 0 || strcmp(s, "0") != 0;
+  #else
+  return false;
+  #endif
+}
+
+#if LUM_JIT
+
+// ---- operations called from machine code ----
+
+static void jit_local(Env* env, Reg* dst, size_t offset) {
+  vm_load(*dst, env->get_local(offset));
+}
+
+static void jit_var(Reg* dst, Var* var) {
+  vm_load(*dst, var->get());
+}
+
+static bool jit_eval(Env* env, Reg* dst, Cell* c) {
+  return vm_eval(env, *dst, c);
+}
+
+static bool jit_number(const Reg* r) {
+  return vm_check_number(*r);
+}
+
+static bool jit_arith(Op op, Reg* dst, const Reg* a, const Reg* b) {
+  return vm_arith(op, *dst, *a, *b);
+}
+
+static void jit_remf(Reg* dst, const Reg* a, const Reg* b) {
+  dst->type = Type::FLOAT;
+  dst->value.f = std::fmod(a->value.f, b->value.f);
+}
+
+static Cell* jit_box(const Reg* r) {
+  return vm_box(*r);
+}
+
+static bool jit_is_false(const Reg* r) {
+  return vm_is_false(*r);
+}
+
+static bool jit_is_applicable(const Reg* r) {
+  return vm_is_applicable(*r);
+}
+
+static bool jit_call(Env* env, Reg* r, size_t count) {
+  return vm_call(env, r, (uint32_t)count);
+}
+
+static Cell* jit_tail(Env* env, Reg* r, size_t count) {
+  return vm_tail(env, r, (uint32_t)count);
+}
+
+// ---- assembler ----
+
+namespace {
+
+enum Gp : uint8_t { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSI = 6, RDI = 7 };
+
+// Emits the few x86-64 instructions we need. Registers of the VM are
+// addressed relative to r12, which points at the register file in the stack
+// frame, and rbx holds the Env.
+struct Asm {
+  std::vector<uint8_t> buf;
+  std::vector<size_t>  fail_jumps; // positions of rel32s to patch
+  std::vector<size_t>  labels; // position of each instruction's code
+  std::vector<std::pair<size_t,size_t>> jumps; // rel32s, instructions
+
+  void emit(std::initializer_list<uint8_t> bytes) {
+    buf.insert(buf.end(), bytes);
+  }
+
+  void emit32(uint32_t v) {
+    for (int i = 0; i != 4; ++i) { buf.push_back((uint8_t)(v >> (i * 8))); }
+  }
+
+  void emit64(uint64_t v) {
+    emit32((uint32_t)v);
+    emit32((uint32_t)(v >> 32));
+  }
+
+  // `opcode` (including prefixes) with a [r12 + disp] operand
+  void mem(std::initializer_list<uint8_t> opcode, uint8_t reg, int32_t disp) {
+    emit(opcode);
+    emit({(uint8_t)(0x84 | (reg << 3)), 0x24}); // mod=10 rm=100, SIB base=r12
+    emit32((uint32_t)disp);
+  }
+
+  void mov_imm(Gp r, uint64_t v) {
+    emit({0x48, (uint8_t)(0xb8 + r)});
+    emit64(v);
+  }
+
+  void lea(Gp r, int32_t disp) { mem({0x49, 0x8d}, r, disp); }
+  void mov_env(Gp r)           { emit({0x48, 0x89, (uint8_t)(0xd8 | r)}); }
+
+  template <typename F>
+  void call(F* fn) {
+    mov_imm(RAX, reinterpret_cast<uint64_t>(fn));
+    emit({0xff, 0xd0}); // call rax
+  }
+
+  // Jump to the failure exit if the bool returned by the last call is false
+  void check() {
+    emit({0x84, 0xc0, 0x0f, 0x84}); // test al, al; jz rel32
+    fail_jumps.push_back(buf.size());
+    emit32(0);
+  }
+
+  // Jump (`opcode` taking a rel32) to the code of instruction `target`
+  void jump(std::initializer_list<uint8_t> opcode, size_t target) {
+    emit(opcode);
+    jumps.emplace_back(buf.size(), target);
+    emit32(0);
+  }
+
+  void patch_jumps() {
+    for (const auto& j : jumps) {
+      uint32_t rel = (uint32_t)(labels[j.second] - (j.first + 4));
+      memcpy(&buf[j.first], &rel, 4);
+    }
+  }
+
+  void prologue(uint32_t frame_size) {
+    emit({0x53, 0x41, 0x54});         // push rbx; push r12
+    emit({0x48, 0x89, 0xfb});         // mov rbx, rdi
+    emit({0x48, 0x81, 0xec});         // sub rsp, frame_size
+    emit32(frame_size);
+    emit({0x49, 0x89, 0xe4});         // mov r12, rsp
+  }
+
+  void epilogue(uint32_t frame_size) {
+    emit({0x48, 0x81, 0xc4});         // add rsp, frame_size
+    emit32(frame_size);
+    emit({0x41, 0x5c, 0x5b, 0xc3});   // pop r12; pop rbx; ret
+  }
+
+  // Return NULL from wherever check() jumps
+  void fail_exit(uint32_t frame_size) {
+    for (size_t pos : fail_jumps) {
+      uint32_t rel = (uint32_t)(buf.size() - (pos + 4));
+      memcpy(&buf[pos], &rel, 4);
+    }
+    emit({0x31, 0xc0});               // xor eax, eax
+    epilogue(frame_size);
+  }
+};
+
+// Offsets of a register's type and value in the register file
+inline int32_t reg_type(uint32_t r)  { return (int32_t)(r * sizeof(Reg)); }
+inline int32_t reg_value(uint32_t r) {
+  return (int32_t)(r * sizeof(Reg) + offsetof(Reg, value));
+}
+
+void set_type(Asm& a, uint32_t r, Type type) {
+  a.mem({0x41, 0xc6}, 0, reg_type(r)); // mov byte [r12 + disp], imm8
+  a.buf.push_back((uint8_t)type);
+}
+
+// Arithmetic on ints which are in registers `b` and `c`
+void int_op(Asm& a, Op op, const Instr& i) {
+  a.mem({0x49, 0x8b}, RAX, reg_value(i.b));            // mov rax, B
+  switch (op) {
+    case Op::ADDI: { a.mem({0x49, 0x03}, RAX, reg_value(i.c)); break; }
+    case Op::SUBI: { a.mem({0x49, 0x2b}, RAX, reg_value(i.c)); break; }
+    case Op::MULI: { a.mem({0x49, 0x0f, 0xaf}, RAX, reg_value(i.c)); break; }
+    default: {
+      a.emit({0x48, 0x99});                            // cqo
+      a.mem({0x49, 0xf7}, 7, reg_value(i.c));          // idiv qword C
+      break;
+    }
+  }
+  a.mem({0x49, 0x89}, (op == Op::REMI) ? RDX : RAX, reg_value(i.a));
+  set_type(a, i.a, Type::INT);
+}
+
+// Arithmetic on floats which are in registers `b` and `c`
+void float_op(Asm& a, uint8_t opcode, const Instr& i) {
+  a.mem({0xf2, 0x41, 0x0f, 0x10}, 0, reg_value(i.b));      // movsd xmm0, B
+  a.mem({0xf2, 0x41, 0x0f, opcode}, 0, reg_value(i.c));    // op xmm0, C
+  a.mem({0xf2, 0x41, 0x0f, 0x11}, 0, reg_value(i.a));      // movsd A, xmm0
+  set_type(a, i.a, Type::FLOAT);
+}
+
+} // namespace
+
+// ---- translation ----
+
+bool jit_compile(Code* code) {
+  if (__atomic_load_n(&code->native, __ATOMIC_ACQUIRE) != 0) {
+    return true;
+  }
+  Asm a;
+  uint32_t frame_size = code->reg_count * sizeof(Reg) + 8; // aligns rsp
+  a.prologue(frame_size);
+
+  for (const Instr& i : code->instrs) {
+    a.labels.push_back(a.buf.size());
+    switch (i.op) {
+      case Op::LOADK: {
+        // Load the constant now, and store its register's contents
+        Reg r;
+        vm_load(r, code->consts[i.bx()]);
+        set_type(a, i.a, r.type);
+        a.mov_imm(RAX, (uint64_t)r.value.i);
+        a.mem({0x49, 0x89}, RAX, reg_value(i.a));  // mov A, rax
+        break;
+      }
+      case Op::LOCAL:
+      case Op::LOCALI:
+      case Op::LOCALF: {
+        a.mov_env(RDI);
+        a.lea(RSI, reg_type(i.a));
+        a.mov_imm(RDX, i.bx());
+        a.call(jit_local);
+        break;
+      }
+      case Op::VAR: {
+        a.lea(RDI, reg_type(i.a));
+        a.mov_imm(RSI, reinterpret_cast<uint64_t>(code->vars[i.bx()]));
+        a.call(jit_var);
+        break;
+      }
+      case Op::EVAL: {
+        a.mov_env(RDI);
+        a.lea(RSI, reg_type(i.a));
+        a.mov_imm(RDX, reinterpret_cast<uint64_t>(code->consts[i.bx()]));
+        a.call(jit_eval);
+        a.check();
+        break;
+      }
+      case Op::NUM: {
+        a.lea(RDI, reg_type(i.a));
+        a.call(jit_number);
+        a.check();
+        break;
+      }
+      case Op::ADD:
+      case Op::SUB:
+      case Op::MUL:
+      case Op::DIV:
+      case Op::REM: {
+        a.mov_imm(RDI, (uint64_t)i.op);
+        a.lea(RSI, reg_type(i.a));
+        a.lea(RDX, reg_type(i.b));
+        a.lea(RCX, reg_type(i.c));
+        a.call(jit_arith);
+        a.check();
+        break;
+      }
+      case Op::ADDI:
+      case Op::SUBI:
+      case Op::MULI:
+      case Op::DIVI:
+      case Op::REMI: { int_op(a, i.op, i); break; }
+      case Op::ADDF: { float_op(a, 0x58, i); break; }
+      case Op::SUBF: { float_op(a, 0x5c, i); break; }
+      case Op::MULF: { float_op(a, 0x59, i); break; }
+      case Op::DIVF: { float_op(a, 0x5e, i); break; }
+      case Op::REMF: {
+        a.lea(RDI, reg_type(i.a));
+        a.lea(RSI, reg_type(i.b));
+        a.lea(RDX, reg_type(i.c));
+        a.call(jit_remf);
+        break;
+      }
+      case Op::JMP: { a.jump({0xe9}, i.bx()); break; }
+      case Op::JMPF: {
+        a.lea(RDI, reg_type(i.a));
+        a.call(jit_is_false);
+        a.emit({0x84, 0xc0});                  // test al, al
+        a.jump({0x0f, 0x85}, i.bx());          // jnz
+        break;
+      }
+      case Op::JMPX: {
+        a.lea(RDI, reg_type(i.a));
+        a.call(jit_is_applicable);
+        a.emit({0x84, 0xc0});                  // test al, al
+        a.jump({0x0f, 0x84}, i.bx());          // jz
+        break;
+      }
+      case Op::CALL: {
+        a.mov_env(RDI);
+        a.lea(RSI, reg_type(i.a));
+        a.mov_imm(RDX, i.b);
+        a.call(jit_call);
+        a.check();
+        break;
+      }
+      case Op::TAIL: {
+        a.mov_env(RDI);
+        a.lea(RSI, reg_type(i.a));
+        a.mov_imm(RDX, i.b);
+        a.call(jit_tail);
+        a.epilogue(frame_size);
+        break;
+      }
+      case Op::RET: {
+        a.lea(RDI, reg_type(i.a));
+        a.call(jit_box);
+        a.epilogue(frame_size);
+        break;
+      }
+    }
+  }
+  a.patch_jumps();
+  a.fail_exit(frame_size);
+
+  // Copy to memory which we then make executable instead of writable
+  size_t size = a.buf.size();
+  void* mem = mmap(0, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    std::cerr << "out of memory for machine code\n";
+    return false;
+  }
+  memcpy(mem, a.buf.data(), size);
+  if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(mem, size);
+    std::cerr << "unable to make machine code executable\n";
+    return false;
+  }
+  mem_note_alloc(kMemKindCode, size);
+  code->native_mem = mem;
+  code->native_size = size;
+  // Other threads may be running the code, and switch to the machine code
+  // as soon as they see it (see vm_exec)
+  __atomic_store_n(&code->native, (Cell* (*)(Env*, const Code*))mem,
+                   __ATOMIC_RELEASE);
+  return true;
+}
+
+
+void jit_free(Code* code) {
+  if (code->native_mem == 0) {
+    return;
+  }
+  munmap(code->native_mem, code->native_size);
+  mem_note_free(kMemKindCode, code->native_size);
+  code->native = 0;
+  code->native_mem = 0;
+  code->native_size = 0;
+}
+
+#else // !LUM_JIT
+
+bool jit_compile(Code* code) {
+  return false;
+}
+
+void jit_free(Code* code) {}
+
+#endif // LUM_JIT
+
+} // namespace lum
@@ -0,0 +1,43 @@
+#ifndef _LUM_JIT_H_
+#define _LUM_JIT_H_
+
+#include <lum/common.h>
+#include <lum/vm.h>
+
+namespace lum {
+
+// Baseline JIT.
+//
+// Translates the bytecode of a function body (see vm.h) to x86-64 machine
+// code in executable memory, one instruction at a time, using a small
+// built-in assembler. Registers live in the native stack frame. Arithmetic
+// on ints and floats whose types are known when compiling, and constants,
+// are done inline. Other instructions call the same operations the VM uses,
+// and calls to BIFs which the VM would hand to `eval` go through
+// Bif::apply directly.
+//
+// eval_body translates a function's code once the function has been applied
+// Fn::kJitAfter times. Setting the environment variable LUM_JIT to 0 turns
+// the JIT off. It is only available on x86-64 Linux, and compiled out
+// entirely when LUM_JIT is defined to 0.
+
+#ifndef LUM_JIT
+  #if LUM_VM && defined(__x86_64__) && defined(__linux__)
+    #define LUM_JIT 1
+  #else
+    #define LUM_JIT 0
+  #endif
+#endif
+
+// True unless the JIT has been turned off
+bool jit_enabled();
+
+// Translate `code`, setting code->native. Returns false if the JIT is not
+// available or out of memory.
+bool jit_compile(Code* code);
+
+// Free the machine code of `code`, if any
+void jit_free(Code* code);
+
+} // namespace lum
+#endif // _LUM_JIT_H_
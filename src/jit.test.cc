@@ -0,0 +1,136 @@
+#include <lum/jit.h>
+#include <lum/fn.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include "test.h"
+
+using namespace lum;
+
+// Compile (fn (a b) body), and its bytecode to machine code
+static Fn* make_native_fn(Env& env, Cell* body) {
+  Fn* f = make_fn(env, body);
+  assert_true(f->_code != 0);
+  assert_true(jit_compile(f->_code));
+  assert_true(f->_code->native != 0);
+  return f;
+}
+
+// Run `code` of `fn` with `a` and `b` as machine code, as bytecode and by
+// walking its body, and check that the results are the same
+static Cell* run_all(Env& env, Fn* fn, const Code* code, Cell* a, Cell* b) {
+  env.locals.push(a);
+  env.locals.push(b);
+  Cell* expected = eval(&env, fn->body());
+  Cell* bytecode = vm_run(&env, code);
+  Cell* actual = code->native(&env, code);
+  env.unwind_locals(0);
+  assert_same(bytecode, expected);
+  assert_same(actual, expected);
+  env.results.unwind(0);
+  return actual;
+}
+
+int main(int argc, const char** argv) {
+  #if LUM_JIT
+  Env env;
+
+  // (- (* a b) (/ a 2) (rem b 3) 1)
+  Fn* fn = make_native_fn(env, list(sym("-",
+    list(sym("*", sym("a", sym("b"))),
+    list(sym("/", sym("a", Cell::createInt(2))),
+    list(sym("rem", sym("b", Cell::createInt(3))),
+    Cell::createInt(1)))))));
+  const Code* code = fn->_code;
+  Cell* r = run_all(env, fn, code, Cell::createInt(10), Cell::createInt(7));
+  assert_eq(Cell::intValue(r), 10*7 - 10/2 - 7%3 - 1);
+  r = run_all(env, fn, code, Cell::createInt(-3000000000),
+              Cell::createInt(5));
+  assert_eq(Cell::intValue(r), -3000000000LL*5 - -3000000000LL/2 - 5%3 - 1);
+  r = run_all(env, fn, code, Cell::createFloat(2.5), Cell::createInt(4));
+  assert_true(Cell::typeOf(r) == Type::FLOAT);
+  r = run_all(env, fn, code, Cell::createInt(4), Cell::createFloat(-1.5));
+  assert_true(Cell::typeOf(r) == Type::FLOAT);
+
+  // Bad arguments fail the same way
+  assert_null(run_all(env, fn, code, Cell::createInt(1),
+                      Cell::createBool(true)));
+
+  // Specialized code does arithmetic inline
+  Type ints[] = {Type::INT, Type::INT};
+  Code* special = Code::create(&env, fn, ints);
+  assert_true(jit_compile(special));
+  r = run_all(env, fn, special, Cell::createInt(-7), Cell::createInt(9));
+  assert_eq(Cell::intValue(r), -7*9 - -7/2 - 9%3 - 1);
+  r = run_all(env, fn, special, Cell::createInt(3000000000),
+              Cell::createInt(-2));
+  assert_eq(Cell::intValue(r), 3000000000LL*-2 - 3000000000LL/2 - -2%3 - 1);
+  Code::free(special);
+
+  Type floats[] = {Type::FLOAT, Type::FLOAT};
+  special = Code::create(&env, fn, floats);
+  assert_true(jit_compile(special));
+  r = run_all(env, fn, special, Cell::createFloat(2.5),
+              Cell::createFloat(-7.25));
+  assert_true(Cell::floatValue(r) == 2.5*-7.25 - 2.5/2 - fmod(-7.25, 3) - 1);
+  Code::free(special);
+
+  // Constants, Vars and calls to BIFs and other functions
+  // (def c 100) (def f (fn (a b) (+ a b)))
+  // (+ c (f 1 2) (* 0.5 a) (if (= a b) 7 1))
+  eval(&env, list(sym("def", sym("c", Cell::createInt(100)))));
+  Fn* f = make_native_fn(env, list(sym("+", sym("a", sym("b")))));
+  env.define(const_cast<Sym*>(intern_sym("f")), Cell::createFn(f));
+  Cell* cond = list(sym("if", list(sym("=", sym("a", sym("b"))),
+    Cell::createInt(7, Cell::createInt(1)))));
+  fn = make_native_fn(env, list(sym("+", sym("c",
+    list(sym("f", Cell::createInt(1, Cell::createInt(2))),
+    list(sym("*", Cell::createFloat(0.5, sym("a"))), cond))))));
+  r = run_all(env, fn, fn->_code, Cell::createInt(1000), Cell::createInt(0));
+  assert_true(Cell::floatValue(r) == 100 + 3 + 500.0 + 1);
+  assert_null(run_all(env, fn, fn->_code, sym("x"), Cell::createInt(0)));
+  r = run_all(env, fn, fn->_code, Cell::createInt(3), Cell::createInt(3));
+  assert_true(Cell::floatValue(r) == 100 + 3 + 1.5 + 7);
+
+  // Calls to locals, and tail calls, which are handed back to the caller
+  // (- (a b b) 1) and (f b a)
+  fn = make_native_fn(env, list(sym("-", list(sym("a", sym("b", sym("b"))),
+    Cell::createInt(1)))));
+  r = run_all(env, fn, fn->_code, Cell::createFn(f), Cell::createInt(4));
+  assert_eq(Cell::intValue(r), 7);
+  assert_null(run_all(env, fn, fn->_code, Cell::createInt(1),
+                      Cell::createInt(4)));
+  fn = make_native_fn(env, list(sym("f", sym("b", sym("a")))));
+  env.locals.push(Cell::createInt(1));
+  env.locals.push(Cell::createInt(2));
+  assert_eq(fn->_code->native(&env, fn->_code), kTailCall);
+  env.unwind_locals(0);
+  assert_eq(Cell::intValue(env.tail_call_args[1]), 2);
+  env.results.unwind(0);
+
+  // Hot functions are translated unless LUM_JIT=0
+  for (int enable = 0; enable != 2; ++enable) {
+    if (enable) {
+      unsetenv("LUM_JIT");
+    } else {
+      setenv("LUM_JIT", "0", 1);
+    }
+    assert_eq(jit_enabled(), enable != 0);
+    Cell* c = eval(&env, list(sym("fn",
+      list(sym("a", sym("b")), list(sym("-", sym("a", sym("b"))))))));
+    fn = (Fn*)c->value.p;
+    env.results.unwind(0);
+    for (uint32_t i = 0; i != Fn::kJitAfter + 1; ++i) {
+      Cell* call = list(Cell::createFn(fn,
+        Cell::createInt(i, Cell::createInt(1))));
+      r = eval(&env, call);
+      assert_eq(Cell::intValue(r), (int64_t)i - 1);
+      env.results.unwind(0);
+    }
+    assert_eq(fn->_code->native != 0, enable != 0);
+    assert_eq(fn->_special->native != 0, enable != 0);
+  }
+
+  #endif
+
+  return 0;
+}
@@ -11,6 +11,8 @@
 #include <lum/eval.h>
 #include <lum/print.h>
 #include <lum/map.h>
+#include <lum/aot.h>
+#include <fstream>
 
 namespace lum {
 
@@ -25,6 +27,112 @@ static Cell* print_eval(Env& env, Cell* expr) {
   return result;
 }
 
+// Evaluate a top-level form of a file. As `def` does not evaluate the value
+// it is given, (def name (...)) evaluates the list and defines name to its
+// value, so that files can define functions.
+static Cell* load_form(Env& env, Cell* form) {
+  Cell* head = (form->type == Type::LIST) ? (Cell*)form->value.p : 0;
+  Cell* value = (head != 0) ? head->rest() : 0;
+  if (head == 0 || head->type != Type::SYM ||
+      (Sym*)head->value.p != kSym_def ||
+      value == 0 || value->type != Type::SYM ||
+      value->rest() == 0 || value->rest()->type != Type::LIST)
+  {
+    return eval(&env, form);
+  }
+  Cell* result = eval(&env, Cell::copy(value->rest(), 0));
+  if (result == 0) {
+    return 0;
+  }
+  result = Cell::copy(result);
+  env.results.unwind(0);
+  return Cell::createVar(env.define((Sym*)value->value.p, result));
+}
+
+// Read the file at `path` into `source`. Returns false on error.
+static bool read_file(const char* path, std::string& source) {
+  std::ifstream file(path);
+  if (!file) {
+    std::cerr << "unable to read " << path << "\n";
+    return false;
+  }
+  source.assign((std::istreambuf_iterator<char>(file)),
+                std::istreambuf_iterator<char>());
+  return true;
+}
+
+// Evaluate the forms in `source`, read from `path`, with load_form. Returns
+// the value of the last one, nil for an empty source, or NULL on error.
+static Cell* load_source(Env& env, const char* path, const char* source) {
+  Reader reader(source);
+  Cell* result = Cell::createNil();
+  while (reader.waiting()) {
+    Cell* form = reader.read();
+    if (form == 0) {
+      if (reader.error != 0) {
+        std::cerr << path << ":" << (reader.error->origin.line + 1)
+                  << ": read error: " << reader.error->message << "\n";
+        return 0;
+      }
+      break;
+    }
+    result = load_form(env, form);
+    env.results.unwind(0);
+    if (result == 0) {
+      return 0;
+    }
+  }
+  return result;
+}
+
+// lum --aot FILE [NS]: evaluate the forms in FILE and write C++ source for
+// the functions in namespace NS, and FILE itself, to stdout (see aot.h)
+static int aot_main(Env& env, int argc, char** argv) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0] << " --aot FILE [NS]\n";
+    return 1;
+  }
+  std::string source;
+  if (!read_file(argv[2], source) ||
+      load_source(env, argv[2], source.c_str()) == 0)
+  {
+    return 1;
+  }
+  Namespace* ns = (argc > 3) ? env.ns_get(intern_str(argv[3])) : env.ns;
+  aot_emit(ns, std::cout, source.c_str());
+  return 0;
+}
+
+// lum FILE: evaluate the forms in FILE and print the value of the last one.
+// Functions which were compiled ahead of time from FILE and linked into the
+// program run as machine code (see aot.h).
+static int run_main(Env& env, int argc, char** argv) {
+  std::string source;
+  if (!read_file(argv[1], source)) {
+    return 1;
+  }
+  Cell* result = load_source(env, argv[1], source.c_str());
+  if (result == 0) {
+    return 1;
+  }
+  std::cout << result << "\n";
+  return 0;
+}
+
+// lum, linked with code compiled ahead of time: evaluate the files which the
+// code was compiled from, and print the value of the last one
+static int run_embedded(Env& env, const std::vector<const char*>& sources) {
+  Cell* result = 0;
+  for (const char* source : sources) {
+    result = load_source(env, "<aot>", source);
+    if (result == 0) {
+      return 1;
+    }
+  }
+  std::cout << result << "\n";
+  return 0;
+}
+
 // -----------------------------------------------------------------------
 // (+ 1 5000 (+ 25))
 // 
@@ -44,6 +152,16 @@ static Cell* print_eval(Env& env, Cell* expr) {
 int main(int argc, char** argv) {
   using std::cout;
   Env env;
+  if (argc > 1 && strcmp(argv[1], "--aot") == 0) {
+    return aot_main(env, argc, argv);
+  }
+  if (argc > 1) {
+    return run_main(env, argc, argv);
+  }
+  std::vector<const char*> sources = aot_sources();
+  if (!sources.empty()) {
+    return run_embedded(env, sources);
+  }
 
 
   #if 0 // PersistentMap
@@ -163,8 +281,8 @@ int main(int argc, char** argv) {
   Cell* result = eval(&env, expr1);
   std::cout << ";=> " << result << '\n';
   assert(result != 0);
-  assert(result->type == Type::INT);
-  assert(result->value.i == 39);
+  assert(Cell::typeOf(result) == Type::INT);
+  assert(Cell::intValue(result) == 39);
   env.results.unwind(0);
 
   // `(+ 6 7) => (+ 6 7)
@@ -0,0 +1,61 @@
+#include <lum/memstats.h>
+#include <lum/cell.h>
+
+namespace lum {
+
+thread_local MemThreadStats* _mem_thread_stats = 0;
+
+static MemThreadStats* all_threads = 0;
+static Spinlock all_threads_lock = LUM_SPINLOCK_INIT;
+
+
+MemThreadStats* _mem_thread_stats_init() {
+  MemThreadStats* t = (MemThreadStats*)calloc(1, sizeof(MemThreadStats));
+  if (t == 0) {
+    LUM_FATAL("out of memory - unable to allocate memory statistics");
+  }
+  spinlock_lock(all_threads_lock);
+  t->next = all_threads;
+  all_threads = t;
+  spinlock_unlock(all_threads_lock);
+  _mem_thread_stats = t;
+  return t;
+}
+
+
+void mem_stats(MemStat* out) {
+  for (uint32_t kind = 0; kind != kMemKindCount; ++kind) {
+    out[kind] = MemStat();
+  }
+  spinlock_lock(all_threads_lock);
+  MemThreadStats* t = all_threads;
+  spinlock_unlock(all_threads_lock);
+  // Threads are only ever added to the front of the list, so it can be
+  // walked without holding the lock.
+  for (; t != 0; t = t->next) {
+    for (uint32_t kind = 0; kind != kMemKindCount; ++kind) {
+      const MemStat& s = t->kinds[kind];
+      out[kind].live  += s.live;
+      out[kind].total += s.total;
+      out[kind].bytes += s.bytes;
+      out[kind].peak  += s.peak;
+    }
+  }
+}
+
+
+const char* mem_kind_name(uint32_t kind) {
+  if (kind < kTypeCount) {
+    return Cell::type_name((Type)kind);
+  }
+  switch (kind) {
+    case kMemKindStr: { return "str-object"; }
+    case kMemKindSym: { return "sym-object"; }
+    case kMemKindFn:  { return "fn-object"; }
+    case kMemKindCode: { return "code-object"; }
+    case kMemKindNursery: { return "nursery-cell"; }
+    default:          { return 0; }
+  }
+}
+
+} // namespace lum
@@ -0,0 +1,96 @@
+#ifndef _LUM_MEMSTATS_H_
+#define _LUM_MEMSTATS_H_
+
+#include <lum/common.h>
+
+namespace lum {
+
+// Allocation statistics per kind of object.
+//
+// Cells are counted by Type from the moment they are given one, and objects
+// which are not cells (strings, symbols, functions and their code) have kinds
+// of their own. Cells in a nursery (see nursery.h) are counted as one kind
+// whatever their type, and by type once promoted to the heap. Every thread
+// updates counters of its own, without any synchronization, and mem_stats
+// sums them up across threads on demand.
+//
+// Counters of threads which have exited are kept, so totals never go down.
+// A cell freed by another thread than the one which allocated it is counted
+// as live on one thread and as freed on the other, which evens out in the
+// sum. For the same reason, `peak` is the sum of the threads' high-water
+// marks, which is exact for a single thread and an upper bound otherwise.
+
+#ifndef LUM_MEM_STATS
+  #define LUM_MEM_STATS 1
+#endif
+
+struct MemStat {
+  int64_t  live  = 0; // objects currently allocated
+  uint64_t total = 0; // objects allocated in total
+  int64_t  bytes = 0; // bytes currently allocated
+  int64_t  peak  = 0; // high-water mark of `live`
+};
+
+// Cell types map to kinds 0 up to kMemKindCellTypes, followed by the kinds of
+// objects which are not cells.
+static constexpr uint32_t kMemKindCellTypes = 16;
+enum : uint32_t {
+  kMemKindStr = kMemKindCellTypes,
+  kMemKindSym,
+  kMemKindFn,
+  kMemKindCode,
+  kMemKindNursery,
+  kMemKindCount,
+};
+
+// Writes the statistics of all threads, summed up, to `out`, which must
+// have room for kMemKindCount entries
+void mem_stats(MemStat* out);
+
+// Name of a kind, or NULL if `kind` is not in use
+const char* mem_kind_name(uint32_t kind);
+
+// Record the allocation or freeing of an object of `kind`
+inline void mem_note_alloc(uint32_t kind, size_t bytes);
+inline void mem_note_free(uint32_t kind, size_t bytes);
+
+// ---- impl ----
+
+struct MemThreadStats {
+  MemStat kinds[kMemKindCount];
+  MemThreadStats* next;
+};
+
+extern thread_local MemThreadStats* _mem_thread_stats;
+MemThreadStats* _mem_thread_stats_init();
+
+inline MemStat& _mem_stat(uint32_t kind) {
+  assert(kind < kMemKindCount);
+  MemThreadStats* t = _mem_thread_stats;
+  if (t == 0) {
+    t = _mem_thread_stats_init();
+  }
+  return t->kinds[kind];
+}
+
+inline void mem_note_alloc(uint32_t kind, size_t bytes) {
+#if LUM_MEM_STATS
+  MemStat& s = _mem_stat(kind);
+  ++s.total;
+  s.bytes += (int64_t)bytes;
+  if (++s.live > s.peak) {
+    s.peak = s.live;
+  }
+#endif
+}
+
+inline void mem_note_free(uint32_t kind, size_t bytes) {
+#if LUM_MEM_STATS
+  MemStat& s = _mem_stat(kind);
+  --s.live;
+  s.bytes -= (int64_t)bytes;
+#endif
+}
+
+} // namespace lum
+#endif // _LUM_MEMSTATS_H_
@@ -0,0 +1,83 @@
+#include <lum/memstats.h>
+#include <lum/cell.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <lum/heap.h>
+#include "test.h"
+#include <thread>
+
+using namespace lum;
+
+static MemStat stat_of(uint32_t kind) {
+  MemStat stats[kMemKindCount];
+  mem_stats(stats);
+  return stats[kind];
+}
+
+int main(int argc, const char** argv) {
+  const uint32_t kFloat = (uint32_t)Type::FLOAT;
+  MemStat before = stat_of(kFloat);
+
+  // Heap cells are counted until freed
+  Cell* a = Cell::createFloat(1.0);
+  Cell* b = Cell::createFloat(2.0);
+  MemStat s = stat_of(kFloat);
+  assert_eq(s.live, before.live + 2);
+  assert_eq(s.total, before.total + 2);
+  assert_eq(s.bytes, before.bytes + (int64_t)(2 * sizeof(Cell)));
+  assert_true(s.peak >= s.live);
+  Cell::free(a);
+  Cell::free(b);
+  s = stat_of(kFloat);
+  assert_eq(s.live, before.live);
+  assert_eq(s.total, before.total + 2);
+
+  // Cells allocated in a nursery frame are counted as nursery cells until it
+  // is left, and the result which lives on is counted by type from then on
+  Env env;
+  MemStat nursery = stat_of(kMemKindNursery);
+  Nursery::Frame f = env.nursery.enter();
+  for (int i = 0; i != 100; ++i) {
+    Cell::createFloat((double)i);
+  }
+  assert_eq(stat_of(kFloat).live, before.live);
+  assert_eq(stat_of(kMemKindNursery).live, nursery.live + 100);
+  Cell* r = env.nursery.leave(f, Cell::createFloat(3.0));
+  assert_eq(stat_of(kFloat).live, before.live + 1);
+  assert_eq(stat_of(kFloat).total, before.total + 3);
+  assert_eq(stat_of(kMemKindNursery).live, nursery.live);
+  assert_eq(stat_of(kMemKindNursery).total, nursery.total + 101);
+  Cell::free(r);
+
+  // Counters of all threads are summed up
+  std::thread([] {
+    Cell::createFloat(4.0);
+    heap_thread_exit();
+  }).join();
+  assert_eq(stat_of(kFloat).total, before.total + 4);
+
+  // Strings and symbols
+  MemStat syms = stat_of(kMemKindSym);
+  intern_sym("memstats-test-symbol");
+  assert_eq(stat_of(kMemKindSym).live, syms.live + 1);
+
+  // (mem-stats) lists every kind in use
+  Cell* expr = Cell::createList(Cell::createSym(kSym_mem_stats));
+  r = eval(&env, expr);
+  assert_true(r != 0 && r->type == Type::LIST);
+  bool found = false;
+  for (Cell* e = (Cell*)r->value.p; e != 0; e = e->rest()) {
+    assert_true(e->type == Type::LIST);
+    Cell* kind = (Cell*)e->value.p;
+    assert_true(kind->type == Type::KEYWORD);
+    if (strcmp(((Sym*)kind->value.p)->c_str(), "float") == 0) {
+      found = true;
+      Cell* total = kind->rest()->rest();
+      assert_eq(total->value.i, (int64_t)stat_of(kFloat).total);
+    }
+  }
+  assert_true(found);
+  env.results.unwind(0);
+
+  return 0;
+}
@@ -0,0 +1,104 @@
+// Cost of the arithmetic BIFs per operation, in general and through their
+// specializations for one and two arguments.
+//
+//   make bench/numop
+#include <lum/bif.h>
+#include <lum/cell.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <chrono>
+
+using namespace lum;
+
+static constexpr size_t kIterations = 10000000;
+
+static Cell* bif(const Bif* b, Cell* rest) {
+  return Cell::createPtr(Type::BIF, (void*)b, rest);
+}
+
+// Nanoseconds per call of `impl` with `args`
+static double time_impl(Env& env, Bif::Impl impl, Cell* args) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i != kIterations; ++i) {
+    Cell* r = impl(&env, args);
+    asm volatile("" : : "r"(r) : "memory");
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::nano> ns = end - start;
+  return ns.count() / kIterations;
+}
+
+static void set_arity_flags(Cell* c, uint32_t flags) {
+  c->flags = (c->flags & ~(Cell::kFlagArity1 | Cell::kFlagArity2)) | flags;
+}
+
+// Nanoseconds per evaluation of the call `form`. It and the calls in its
+// arguments are marked with `flags` like Fn::compile marks them.
+static double time_eval(Env& env, Cell* form, uint32_t flags) {
+  set_arity_flags(form, flags);
+  for (Cell* a = ((Cell*)form->value.p)->rest(); a != 0; a = a->rest()) {
+    if (a->type == Type::LIST) {
+      set_arity_flags(a, flags);
+    }
+  }
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i != kIterations; ++i) {
+    size_t results_index = env.results.index();
+    Cell* r = eval_list(&env, form);
+    asm volatile("" : : "r"(r) : "memory");
+    env.results.unwind(results_index);
+  }
+  auto end = std::chrono::steady_clock::now();
+  std::chrono::duration<double, std::nano> ns = end - start;
+  return ns.count() / kIterations;
+}
+
+static void report(const char* name, double generic, double fixed) {
+  printf("%-28s %8.2f ns %8.2f ns %6.2fx\n",
+         name, generic, fixed, generic / fixed);
+}
+
+int main(int argc, const char** argv) {
+  Env env;
+  const Bif* add = kBif_sum;
+
+  // Keep a frame open, as inside a function, so that evaluating a call is
+  // not a top-level form with a nursery frame and safepoint of its own
+  Nursery::Frame frame = env.nursery.enter();
+
+  printf("%-28s %11s %11s %7s\n", "", "generic", "fixed", "speedup");
+
+  Cell* ii = Cell::createInt(3, Cell::createInt(4));
+  report("(+ int int)", time_impl(env, add->apply, ii),
+         time_impl(env, add->apply_fixed(2), ii));
+
+  Cell* ff = Cell::createFloat(3.5, Cell::createFloat(4.5));
+  report("(+ float float)", time_impl(env, add->apply, ff),
+         time_impl(env, add->apply_fixed(2), ff));
+
+  Cell* fi = Cell::createFloat(3.5, Cell::createInt(4));
+  report("(+ float int)", time_impl(env, add->apply, fi),
+         time_impl(env, add->apply_fixed(2), fi));
+
+  Cell* i = Cell::createInt(3);
+  report("(+ int)", time_impl(env, add->apply, i),
+         time_impl(env, add->apply_fixed(1), i));
+
+  // Through eval_list, with arguments which need to be evaluated
+  // (+ (* 3 4) (- 5 6))
+  Cell* a = Cell::createList(bif(kBif_mul,
+    Cell::createInt(3, Cell::createInt(4))));
+  Cell* b = Cell::createList(bif(kBif_sub,
+    Cell::createInt(5, Cell::createInt(6))));
+  Cell* nested = Cell::createList(bif(kBif_sum, a));
+  a->set_rest(b);
+  Cell* form = Cell::createList(bif(kBif_sum,
+    Cell::createInt(3, Cell::createInt(4))));
+  report("eval (+ 3 4)", time_eval(env, form, 0),
+         time_eval(env, form, Cell::kFlagArity2));
+  report("eval (+ (* 3 4) (- 5 6))", time_eval(env, nested, 0),
+         time_eval(env, nested, Cell::kFlagArity2));
+
+  env.nursery.leave(frame, 0);
+  return 0;
+}
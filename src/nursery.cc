@@ -0,0 +1,234 @@
+#include <lum/nursery.h>
+#include <lum/cell.h>
+
+namespace lum {
+
+thread_local Nursery* Nursery::_current = 0;
+
+
+Nursery::~Nursery() {
+  if (_current == this) {
+    _current = 0;
+  }
+  for (char* chunk : _chunks) {
+    std::free(chunk);
+  }
+}
+
+
+bool Nursery::grow() {
+  uint32_t next = (_pos == 0) ? 0 : _chunk + 1;
+  if (next == _chunks.size()) {
+    char* chunk = (char*)malloc(kChunkSize);
+    if (chunk == 0) {
+      fprintf(stderr, "out of memory - unable to allocate nursery chunk\n");
+      return false;
+    }
+    _chunks.push_back(chunk);
+  }
+  _chunk = next;
+  _pos = _chunks[next];
+  _end = _pos + kChunkSize;
+  return true;
+}
+
+
+Cell* Nursery::alloc_run(size_t* count) {
+  if (_end - _pos < (ptrdiff_t)sizeof(Cell)) {
+    if (!grow()) { return 0; }
+  }
+  size_t avail = (size_t)(_end - _pos) / sizeof(Cell);
+  if (*count > avail) {
+    *count = avail;
+  }
+  Cell* c = (Cell*)_pos;
+  _pos += sizeof(Cell) * (*count);
+  note_alloc(*count);
+  return c;
+}
+
+
+void Nursery::reset(const Frame& frame) {
+#if LUM_MEM_STATS
+  // Everything allocated since the frame was entered goes at once. Cells
+  // which have been moved out of the frame were counted again where they
+  // went, see forward().
+  int64_t bytes = 0;
+  for (uint32_t i = frame.chunk; i <= _chunk; ++i) {
+    const char* begin = (i == frame.chunk) ? frame.pos : _chunks[i];
+    const char* end = (i == _chunk) ? _pos : _chunks[i] + kChunkSize;
+    bytes += end - begin;
+  }
+  MemStat& s = _mem_stat(kMemKindNursery);
+  s.live -= bytes / (int64_t)sizeof(Cell);
+  s.bytes -= bytes;
+#endif // LUM_MEM_STATS
+  _chunk = frame.chunk;
+  _pos = frame.pos;
+  _end = _chunks[_chunk] + kChunkSize;
+}
+
+
+void Nursery::update_current() {
+  if (_depth != 0 && _suspended == 0) {
+    _current = this;
+  } else if (_current == this) {
+    _current = 0;
+  }
+}
+
+
+Nursery::Frame Nursery::enter() {
+  if (_pos == 0 && !grow()) {
+    LUM_FATAL("unable to allocate nursery");
+  }
+  Frame frame = {_chunk, _pos};
+  if (_depth++ == 0) {
+    update_current();
+  }
+  return frame;
+}
+
+
+bool Nursery::contains(const Frame& frame, const Cell* c) const {
+  const char* p = (const char*)c;
+  for (uint32_t i = frame.chunk; i <= _chunk; ++i) {
+    const char* begin = (i == frame.chunk) ? frame.pos : _chunks[i];
+    const char* end = (i == _chunk) ? _pos : _chunks[i] + kChunkSize;
+    if (p >= begin && p < end) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+bool Nursery::contains(const Cell* c) const {
+  if (_chunks.empty()) {
+    return false;
+  }
+  Frame bottom = {0, _chunks[0]};
+  return contains(bottom, c);
+}
+
+
+// Copy `c` to the heap if it lives in `frame`, leaving a forwarding pointer
+// behind so that cells reachable through several paths are copied only once.
+// The part of `c`'s chain which lives in the frame is copied along with it,
+// so that the chain ends up as a contiguous run in the heap. Fields of the
+// copies are updated later, from `_work`.
+Cell* Nursery::forward(const Frame& frame, Cell* c) {
+  if (c == 0 || !contains(frame, c)) {
+    return c;
+  }
+  if (c->flags & Cell::kFlagForwarded) {
+    return (Cell*)c->value.p;
+  }
+  Cell* first = c;
+  while (c != 0 && contains(frame, c) &&
+         (c->flags & Cell::kFlagForwarded) == 0)
+  {
+    size_t count = 0;
+    for (Cell* p = c;
+         p != 0 && contains(frame, p) &&
+         (p->flags & Cell::kFlagForwarded) == 0;
+         p = p->rest())
+    {
+      ++count;
+    }
+    Cell* run = Cell::alloc_heap_run(&count);
+    for (size_t i = 0; i != count; ++i) {
+      Cell* h = run + i;
+      uint32_t flags = h->flags;
+      memcpy((void*)h, (const void*)c, sizeof(Cell));
+      h->flags = flags;
+      Cell::note_alloc(h); // now a heap cell of its type
+      c->flags |= Cell::kFlagForwarded;
+      c->value.p = (void*)h;
+      _work.push_back(h);
+      c = c->rest();
+    }
+  }
+  return (Cell*)first->value.p;
+}
+
+
+void Nursery::forward_work(const Frame& frame) {
+  while (!_work.empty()) {
+    Cell* h = _work.back();
+    _work.pop_back();
+    h->set_rest(forward(frame, h->rest()));
+    if (h->type == Type::LIST || h->type == Type::QUOTE) {
+      h->value.p = (void*)forward(frame, (Cell*)h->value.p);
+    }
+  }
+}
+
+
+// True if `c` lives in `frame` and does not reference anything else in it
+bool Nursery::is_atom(const Frame& frame, const Cell* c) const {
+  return c != 0 && contains(frame, c) &&
+         c->type != Type::LIST && c->type != Type::QUOTE &&
+         !contains(frame, c->rest());
+}
+
+
+Cell* Nursery::leave(const Frame& frame, Cell* result) {
+  assert(_depth != 0);
+
+  if (_depth > 1 && is_atom(frame, result)) {
+    // An atom which we can move into the enclosing frame
+    alignas(Cell) char tmp[sizeof(Cell)];
+    memcpy((void*)tmp, (const void*)result, sizeof(Cell));
+    result->flags |= Cell::kFlagForwarded; // moved, not freed
+    reset(frame);
+    result = alloc();
+    memcpy((void*)result, (const void*)tmp, sizeof(Cell));
+  } else {
+    // Promote everything reachable from `result` to the heap
+    result = forward(frame, result);
+    forward_work(frame);
+    reset(frame);
+  }
+
+  if (--_depth == 0) {
+    update_current();
+  }
+  return result;
+}
+
+
+void Nursery::keep(const Frame& frame, Cell** values, size_t count) {
+  assert(_depth != 0);
+  bool all_atoms = true;
+  for (size_t i = 0; i != count && all_atoms; ++i) {
+    all_atoms = !contains(frame, values[i]) || is_atom(frame, values[i]);
+  }
+
+  if (all_atoms) {
+    // Copy the atoms aside, and back to the start of the frame
+    _kept.clear();
+    _kept_index.clear();
+    for (size_t i = 0; i != count; ++i) {
+      if (contains(frame, values[i])) {
+        _kept.push_back(*values[i]);
+        _kept_index.push_back(i);
+        values[i]->flags |= Cell::kFlagForwarded; // moved, not freed
+      }
+    }
+    reset(frame);
+    for (size_t k = 0; k != _kept.size(); ++k) {
+      Cell* c = alloc();
+      memcpy((void*)c, (const void*)&_kept[k], sizeof(Cell));
+      values[_kept_index[k]] = c;
+    }
+  } else {
+    for (size_t i = 0; i != count; ++i) {
+      values[i] = forward(frame, values[i]);
+    }
+    forward_work(frame);
+    reset(frame);
+  }
+}
+
+} // namespace lum
@@ -0,0 +1,131 @@
+#ifndef _LUM_NURSERY_H_
+#define _LUM_NURSERY_H_
+
+#include <lum/common.h>
+#include <lum/cell.h>
+
+namespace lum {
+
+// Bump-pointer region for short-lived cells.
+//
+// Each Env owns a nursery, and opens a frame in it while evaluating a
+// top-level form and while applying a user function. Cells allocated by the
+// Env's thread while a frame is open are carved out of the nursery by bumping
+// a pointer. When the frame is left, the cells reachable from the frame's
+// result are moved out and everything else allocated in the frame is thrown
+// away at once by resetting the pointer.
+//
+// A result which is a single atom (e.g. an int produced by arithmetic) is
+// moved into the enclosing frame. Anything else, and all results of the
+// outermost frame, are promoted to the heap. Immediates (see cell.h) never
+// live in a frame and pass through untouched.
+//
+// This relies on cells which were allocated before a frame was entered never
+// being made to reference cells allocated inside it. The only code which
+// mutates existing cells is the compiler, and so allocation while compiling
+// bypasses the nursery (see suspend()).
+struct Nursery {
+  struct Frame {
+    uint32_t chunk;
+    char*    pos;
+  };
+
+  Nursery() {}
+  ~Nursery();
+  LUM_CXX_DISALLOW_COPY(Nursery);
+
+  // Open a new frame
+  Frame enter();
+
+  // Close `frame`, freeing all cells allocated since it was entered except
+  // those reachable from `result`. Returns the new location of `result`.
+  Cell* leave(const Frame& frame, Cell* result);
+
+  // Free all cells allocated since `frame` was entered except those
+  // reachable from `values`, which are updated to their new locations, and
+  // keep the frame open. Atoms are moved to the start of the frame, anything
+  // else is promoted to the heap.
+  void keep(const Frame& frame, Cell** values, size_t count);
+
+  // Allocation bypasses the nursery between calls to suspend() and resume()
+  void suspend() { ++_suspended; update_current(); }
+  void resume() { --_suspended; update_current(); }
+
+  // Number of open frames
+  uint32_t depth() const { return _depth; }
+
+  // True if `c` was allocated in this nursery and is still alive
+  bool contains(const Cell* c) const;
+
+  // Call `f` with each cell allocated in the open frames, including those
+  // which are no longer reachable
+  template <typename F>
+  void for_each(F f) const {
+    const size_t chunk_cells = kChunkSize / sizeof(Cell);
+    for (uint32_t i = 0; _depth != 0 && i <= _chunk; ++i) {
+      Cell* c = (Cell*)_chunks[i];
+      Cell* end = (i == _chunk) ? (Cell*)_pos : c + chunk_cells;
+      for (; c != end; ++c) { f(c); }
+    }
+  }
+
+  // Allocate a cell. Returns 0 if out of memory.
+  Cell* alloc() {
+    if (_end - _pos < (ptrdiff_t)sizeof(Cell)) {
+      if (!grow()) { return 0; }
+    }
+    Cell* c = (Cell*)_pos;
+    _pos += sizeof(Cell);
+    note_alloc(1);
+    return c;
+  }
+
+  // Allocate up to `*count` adjacent cells, updating `*count` to the number
+  // allocated. Returns 0 if out of memory.
+  Cell* alloc_run(size_t* count);
+
+  // The nursery which the calling thread is currently allocating from, or
+  // NULL if cells should be allocated in the heap.
+  static Nursery* current() { return _current; }
+
+  static constexpr size_t kChunkSize = 64 * 1024;
+
+private:
+  bool grow();
+  void reset(const Frame& frame);
+
+  // Nursery cells are counted as a kind of their own, and not by type, so
+  // that dropping a frame does not have to look at its cells
+  void note_alloc(size_t count) {
+#if LUM_MEM_STATS
+    MemStat& s = _mem_stat(kMemKindNursery);
+    s.total += count;
+    s.bytes += (int64_t)(count * sizeof(Cell));
+    s.live += (int64_t)count;
+    if (s.live > s.peak) {
+      s.peak = s.live;
+    }
+#endif // LUM_MEM_STATS
+  }
+
+  void update_current();
+  bool contains(const Frame& frame, const Cell* c) const;
+  Cell* forward(const Frame& frame, Cell* c);
+  void forward_work(const Frame& frame);
+  bool is_atom(const Frame& frame, const Cell* c) const;
+
+  std::vector<char*> _chunks;
+  std::vector<Cell*> _work; // promoted cells with fields yet to be forwarded
+  std::vector<Cell>  _kept; // atoms being moved by keep()
+  std::vector<size_t> _kept_index;
+  uint32_t _chunk = 0;
+  char*    _pos = 0;
+  char*    _end = 0;
+  uint32_t _depth = 0;
+  uint32_t _suspended = 0;
+
+  static thread_local Nursery* _current;
+};
+
+} // namespace lum
+#endif // _LUM_NURSERY_H_
@@ -0,0 +1,68 @@
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <lum/heap.h>
+#include <lum/nursery.h>
+#include "test.h"
+
+using namespace lum;
+
+int main(int argc, const char** argv) {
+  Env env;
+  Nursery& n = env.nursery;
+
+  // Nothing is allocated in the nursery unless a frame is open
+  Cell* c = Cell::createInt(1);
+  assert_false(n.contains(c));
+  assert_null(Nursery::current());
+
+  // Temporaries are dropped, atoms move to the enclosing frame
+  Nursery::Frame f1 = n.enter();
+  assert_eq(Nursery::current(), &n);
+  Cell* outer = Cell::createInt(10001);
+  Nursery::Frame f2 = n.enter();
+  for (int i = 0; i != 10000; ++i) {
+    Cell::createInt(10000 + i); // garbage
+  }
+  Cell* atom = n.leave(f2, Cell::createInt(10007));
+  assert_true(n.contains(atom));
+  assert_true(atom->type == Type::INT);
+  assert_eq(atom->value.i, 10007);
+  assert_eq((char*)atom, ((char*)outer) + sizeof(Cell));
+
+  // Compound results of the outermost frame are promoted to the heap,
+  // preserving structure.
+  Cell* list = Cell::createList(
+    Cell::createInt(1, Cell::createQuote(Cell::createInt(2))));
+  Cell* r = n.leave(f1, list);
+  assert_eq(n.depth(), 0);
+  assert_null(Nursery::current());
+  assert_false(n.contains(r));
+  assert_false(heap_is_free(r));
+  assert_true(r->type == Type::LIST);
+  Cell* first = (Cell*)r->value.p;
+  assert_eq(first->value.i, 1);
+  assert_true(first->rest()->type == Type::QUOTE);
+  assert_eq(((Cell*)first->rest()->value.p)->value.i, 2);
+  assert_false(n.contains(first->rest()));
+  // The chain was promoted as a contiguous run
+  assert_eq(first->rest(), first + 1);
+
+  // Allocation bypasses the nursery while suspended
+  Nursery::Frame f3 = n.enter();
+  n.suspend();
+  c = Cell::createInt(3);
+  n.resume();
+  assert_false(n.contains(c));
+  assert_true(n.contains(Cell::createInt(10004)));
+  n.leave(f3, 0);
+
+  // Results of top-level evaluation end up in the heap
+  Cell* expr = Cell::createList(
+    Cell::createSym(kSym_sum, Cell::createInt(1, Cell::createInt(2))));
+  r = eval(&env, expr);
+  assert_eq(Cell::intValue(r), 3);
+  assert_false(n.contains(r));
+  assert_eq(n.depth(), 0);
+
+  return 0;
+}
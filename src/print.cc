@@ -9,17 +9,20 @@
 namespace lum {
 
 inline void _print_rest(std::ostream& s, const Cell* c, bool rest) {
-  if (rest && c->rest != 0) { s << ' '; _print(s, c->rest, rest); }
+  if (rest && !Cell::isImm(c) && c->rest() != 0) {
+    s << ' '; _print(s, c->rest(), rest);
+  }
 }
 
 std::ostream& _print(std::ostream& s, const Cell* c, bool rest) {
   if (c != 0) {
-    switch (c->type) {
-      case Type::BOOL: { s << std::dec << (c->value.i ? "true" : "false");
+    switch (Cell::typeOf(c)) {
+      case Type::BOOL: {
+        s << std::dec << (Cell::intValue(c) ? "true" : "false");
         _print_rest(s, c, rest); break; }
-      case Type::INT: { s << std::dec << c->value.i;
+      case Type::INT: { s << std::dec << Cell::intValue(c);
         _print_rest(s, c, rest); break; }
-      case Type::FLOAT: { s << std::dec << c->value.f;
+      case Type::FLOAT: { s << std::dec << Cell::floatValue(c);
         _print_rest(s, c, rest); break; }
       case Type::BIF: { s << Cell::getBif(c);
         _print_rest(s, c, rest); break; }
@@ -27,7 +30,7 @@ std::ostream& _print(std::ostream& s, const Cell* c, bool rest) {
         _print_rest(s, c, rest); break; }
       case Type::KEYWORD: { s << ':' << ((Sym*)c->value.p)->c_str();
         _print_rest(s, c, rest); break; }
-      case Type::SYM: { s << (Sym*)c->value.p;
+      case Type::SYM: { s << (Sym*)Cell::ptrValue(c);
         _print_rest(s, c, rest); break; }
       case Type::VAR: { s << (Var*)c->value.p;
         _print_rest(s, c, rest); break; }
@@ -45,6 +48,21 @@ std::ostream& _print(std::ostream& s, const Cell* c, bool rest) {
         _print_rest(s, c, rest);
         break;
       }
+      case Type::TASK: {
+        s << "#<task " << c->value.p << '>';
+        _print_rest(s, c, rest);
+        break;
+      }
+      case Type::FUTURE: {
+        s << "#<future " << c->value.p << '>';
+        _print_rest(s, c, rest);
+        break;
+      }
+      case Type::ATOM: {
+        s << "#<atom " << c->value.p << '>';
+        _print_rest(s, c, rest);
+        break;
+      }
       case Type::UNKNOWN: { s << "#<unknown>"; break; }
     }
   }
@@ -3,6 +3,7 @@
 
 #include <lum/common.h>
 #include <lum/cell.h>
+#include <lum/trace.h>
 #include <deque>
 
 namespace lum {
@@ -76,6 +77,9 @@ struct Reader {
 
   void append_cell(Cell* cell);
 
+  // An INT or FLOAT cell if all of `s` is a number, else NULL
+  static Cell* parse_number(const std::string& s);
+
   void clear_error() { if (error) { delete error; } }
   template <typename... Args>
   void set_error(Args&&... args) {
@@ -140,9 +144,9 @@ void Reader::append_cell(Cell* cell) {
     } else {
       // Next in an existing cons
       assert(frame.tail != 0);
-      assert(frame.tail->rest == 0);
+      assert(frame.tail->rest() == 0);
       assert(frame.container->type == Type::LIST);
-      frame.tail->rest = cell;
+      frame.tail->set_rest(cell);
     }
 
     frame.tail = cell;
@@ -150,34 +154,34 @@ void Reader::append_cell(Cell* cell) {
 }
 
 inline void Reader::read_root() {
-  std::cout << "read_root()\n";
+  LUM_TRACE(READER, 1, "read_root()");
   switch (*input.curr) {
     case '\n': {
-      std::cout << "got newline\n";
+      LUM_TRACE(READER, 1, "got newline");
       read_newline();
       break;
     }
     case ' ': case '\t': case '\r': case ',': {
-      std::cout << "ignoring whitespace\n";
+      LUM_TRACE(READER, 1, "ignoring whitespace");
       input.consume1();
       break;
     }
     case '\'': {
-      std::cout << "got quote\n";
+      LUM_TRACE(READER, 1, "got quote");
       stack.emplace_back(Cell::createQuote(0));
       input.consume1();
       break;
     }
     case '(': {
       // beginning of a list
-      std::cout << "got '('\n";
+      LUM_TRACE(READER, 1, "got '('");
       stack.emplace_back(Cell::createList(0));
       input.consume1();
       break;
     }
     case ')': {
       // end of a list
-      std::cout << "got ')'\n";
+      LUM_TRACE(READER, 1, "got ')'");
       if (stack.empty() || stack.back().container->type != Type::LIST) {
         set_error(Error::Code::UnbalancedGroup, "Unexpected ')'");
         return;
@@ -186,12 +190,16 @@ inline void Reader::read_root() {
       Cell* cell = frame.container;
       stack.pop_back();
       input.consume1();
+      // Now that the whole list has been read, lay it out as a contiguous
+      // run of cells
+      cell->value.p = (void*)Cell::copyChain((Cell*)cell->value.p);
       append_cell(cell);
       break;
     }
     // case '"': { ... future State::TEXT }
     default: {
-      std::cout << "got char '" << *input.curr << "' -> State::SYM\n";
+      LUM_TRACE(READER, 1,
+                "got char '" << *input.curr << "' -> State::SYM");
       buffer.push_back(*input.curr);
       input.consume1();
       state = State::SYM;
@@ -200,16 +208,49 @@ inline void Reader::read_root() {
   }
 }
 
+inline Cell* Reader::parse_number(const std::string& s) {
+  // A digit, possibly after a sign or a point. Anything else, like "-" or
+  // "inf", is a symbol.
+  size_t i = (s[0] == '-' || s[0] == '+') ? 1 : 0;
+  i += (i < s.size() && s[i] == '.') ? 1 : 0;
+  if (i >= s.size() || s[i] < '0' || s[i] > '9') {
+    return 0;
+  }
+  const char* begin = s.c_str();
+  char* end;
+  errno = 0;
+  long long n = strtoll(begin, &end, 10);
+  if (*end == '\0' && errno == 0) {
+    // Not one of the immortal small ints, as the cell is linked into a list
+    Cell* c = Cell::create(Type::INT);
+    c->value.i = n;
+    return c;
+  }
+  double f = strtod(begin, &end);
+  if (*end == '\0') {
+    return Cell::createFloat(f);
+  }
+  return 0;
+}
+
 inline void Reader::read_symbol() {
-  std::cout << "read_symbol()\n";
+  LUM_TRACE(READER, 1, "read_symbol()");
   switch (*input.curr) {
     case '\n': case '\r': case '\t': case ' ':
     case '(': case ')':
     case '\'': {
-      // End of symbol
+      // End of symbol, or of a number
+      Cell* number = parse_number(buffer);
+      if (number != 0) {
+        LUM_TRACE(READER, 1, "got number " << number);
+        append_cell(number);
+        buffer.clear();
+        state = State::ROOT;
+        break;
+      }
       const Str* str = intern_str(buffer.c_str());
       const Sym* sym = intern_sym(str);
-      std::cout << "got symbol '" << sym << "'\n";
+      LUM_TRACE(READER, 1, "got symbol '" << sym << "'");
       append_cell(Cell::createSym(sym));
       buffer.clear();
       state = State::ROOT;
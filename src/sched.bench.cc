@@ -0,0 +1,122 @@
+// Scaling of a fork/join workload, recursive parallel fib, with the number
+// of workers. pfib spawns one of its two recursive calls as a process until
+// `depth` levels down, and from there on calls plain recursive fib. Then
+// the same for pmap applying fib to each element of a list, whose baseline
+// is pmap with a single worker, which does not split the list.
+//
+//   make bench/sched
+//
+// Runs with 1, 2, 4 ... workers up to the number of hardware threads, or up
+// to the number given as the first argument.
+#include <lum/sched.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <lum/read.h>
+#include <chrono>
+#include <thread>
+
+using namespace lum;
+
+static constexpr int64_t kN = 27;
+static constexpr int64_t kDepth = 10;
+
+static const char* kFib =
+  "(fn (n) (if (= n 0) 0 (if (= n 1) 1 (+ (fib (- n 1)) (fib (- n 2))))))";
+static const char* kPfib =
+  "(fn (n depth) (if (= depth 0) (fib n)"
+  "  ((fn (t) (+ (pfib (- n 2) (- depth 1)) (join t)))"
+  "   (spawn pfib (- n 1) (- depth 1)))))";
+
+static constexpr int64_t kMapCount = 2000;
+static constexpr int64_t kMapN = 15;
+
+static Cell* read(const char* source) {
+  Reader reader(source);
+  Cell* form = reader.read();
+  assert(form != 0);
+  return form;
+}
+
+static void define(Env& env, const char* name, const char* source) {
+  Cell* value = eval(&env, read(source));
+  assert(value != 0);
+  env.define(const_cast<Sym*>(intern_sym(name)), value);
+  env.results.unwind(0);
+}
+
+static int64_t fib(int64_t n) {
+  return n < 2 ? n : fib(n - 1) + fib(n - 2);
+}
+
+// Milliseconds to evaluate `form`, which must evaluate to `expected`
+static double time_form(Env& env, Cell* form, int64_t expected) {
+  auto start = std::chrono::steady_clock::now();
+  Cell* r = eval(&env, form);
+  auto end = std::chrono::steady_clock::now();
+  if (r == 0 || Cell::intValue(r) != expected) {
+    fprintf(stderr, "wrong result\n");
+    exit(1);
+  }
+  env.results.unwind(0);
+  std::chrono::duration<double, std::milli> ms = end - start;
+  return ms.count();
+}
+
+// Time `source` with 1, 2, 4 ... workers. Speedups are relative to `base`
+// milliseconds, or to the time with one worker if 0.
+static void run(Env& env, const char* name, const char* source,
+                int64_t expected, double base, uint32_t max_workers)
+{
+  printf("%-10s %13s %9s %9s\n", name, "", "speedup", "steals");
+  for (uint32_t workers = 1; workers <= max_workers; workers *= 2) {
+    Scheduler* sched = Scheduler::create(&env, workers);
+    env.namespaces->scheduler = sched;
+    Cell* form = read(source);
+    time_form(env, form, expected);
+    double ms = time_form(env, form, expected);
+    if (base == 0) {
+      base = ms;
+    }
+    uint64_t steals = 0;
+    for (uint32_t i = 0; i != sched->worker_count(); ++i) {
+      steals += sched->worker(i).tasks_stolen;
+    }
+    printf("%-10u %10.1f ms %8.2fx %9llu\n",
+           workers, ms, base / ms, (unsigned long long)steals);
+    env.namespaces->scheduler = 0;
+    Scheduler::free(sched);
+  }
+}
+
+int main(int argc, const char** argv) {
+  Env env;
+  // Bind the names first, so that the functions can refer to them
+  env.define(const_cast<Sym*>(intern_sym("fib")), Cell::createNil());
+  env.define(const_cast<Sym*>(intern_sym("pfib")), Cell::createNil());
+  define(env, "fib", kFib);
+  define(env, "pfib", kPfib);
+  char source[64];
+
+  // Warm up, so that fib is specialized and compiled to machine code
+  snprintf(source, sizeof(source), "(fib %lld)", (long long)kN);
+  Cell* fib_form = read(source);
+  time_form(env, fib_form, fib(kN));
+  double base = time_form(env, fib_form, fib(kN));
+  printf("%-10s %10.1f ms\n", "sequential", base);
+
+  uint32_t max_workers = argc > 1 ? (uint32_t)atoi(argv[1])
+                                  : std::thread::hardware_concurrency();
+  max_workers = LUM_MAX(1u, max_workers);
+  snprintf(source, sizeof(source), "(join (spawn pfib %lld %lld))",
+           (long long)kN, (long long)kDepth);
+  run(env, "pfib", source, fib(kN), base, max_workers);
+
+  Cell* xs = 0;
+  for (int64_t i = 0; i != kMapCount; ++i) {
+    xs = Cell::createInt(kMapN, xs);
+  }
+  env.define(const_cast<Sym*>(intern_sym("xs")), Cell::createList(xs));
+  snprintf(source, sizeof(source), "(preduce + 0 (pmap fib xs))");
+  run(env, "pmap", source, kMapCount * fib(kMapN), 0, max_workers);
+  return 0;
+}
@@ -0,0 +1,493 @@
+#include <lum/sched.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <lum/heap.h>
+#include <lum/gc.h>
+#include <thread>
+
+namespace lum {
+
+thread_local Scheduler::Worker* Scheduler::_current_worker = 0;
+
+// ---------------------------------------------------------------------------
+// Deque
+//
+// See "Dynamic Circular Work-Stealing Deque" by Chase and Lev. Arrays which
+// are outgrown are kept until the deque is destroyed, since a thief might
+// still read from one.
+
+static constexpr int64_t kDequeInitialCapacity = 64;
+
+static Scheduler::Deque::Array* new_array(int64_t capacity,
+                                          Scheduler::Deque::Array* prev)
+{
+  typedef Scheduler::Deque::Array Array;
+  Array* a = (Array*)malloc(sizeof(Array) + sizeof(Task*) * (capacity - 1));
+  if (a != 0) {
+    a->capacity = capacity;
+    a->prev = prev;
+  }
+  return a;
+}
+
+
+Scheduler::Deque::Deque() : top(0), bottom(0), array(0) {}
+
+
+Scheduler::Deque::~Deque() {
+  Array* a = array;
+  while (a != 0) {
+    Array* prev = a->prev;
+    std::free(a);
+    a = prev;
+  }
+}
+
+
+Scheduler::Deque::Array* Scheduler::Deque::grow(Array* a, int64_t b,
+                                                int64_t t)
+{
+  Array* bigger = new_array(a == 0 ? kDequeInitialCapacity : a->capacity * 2,
+                            a);
+  if (bigger == 0) {
+    return 0;
+  }
+  for (int64_t i = t; i != b; ++i) {
+    bigger->put(i, a->get(i));
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  array = bigger;
+  return bigger;
+}
+
+
+bool Scheduler::Deque::push(Task* task) {
+  int64_t b = bottom;
+  int64_t t = top;
+  Array* a = array;
+  if (a == 0 || b - t >= a->capacity - 1) {
+    a = grow(a, b, t);
+    if (a == 0) {
+      return false;
+    }
+  }
+  a->put(b, task);
+  // Thieves which see the new bottom must see the task
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  bottom = b + 1;
+  return true;
+}
+
+
+Task* Scheduler::Deque::pop() {
+  int64_t b = bottom - 1;
+  Array* a = array;
+  bottom = b;
+  // Thieves must see the new bottom before we look at top
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t t = top;
+  if (t > b) {
+    // Empty
+    bottom = b + 1;
+    return 0;
+  }
+  Task* task = a->get(b);
+  if (t == b) {
+    // The last task, which a thief might be taking at the same time
+    if (LumAtomicCmpSwap(&top, t, t + 1) != t) {
+      task = 0;
+    }
+    bottom = b + 1;
+  }
+  return task;
+}
+
+
+Task* Scheduler::Deque::steal() {
+  int64_t t = top;
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  int64_t b = bottom;
+  if (t >= b) {
+    return 0;
+  }
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  Array* a = array;
+  Task* task = a->get(t);
+  if (LumAtomicCmpSwap(&top, t, t + 1) != t) {
+    return 0;
+  }
+  return task;
+}
+
+// ---------------------------------------------------------------------------
+// Scheduler
+
+Scheduler* Scheduler::create(Env* env, uint32_t worker_count) {
+  if (worker_count == 0) {
+    worker_count = LUM_MAX(1u, std::thread::hardware_concurrency());
+  }
+  Scheduler* sched = new (std::nothrow) Scheduler;
+  if (sched == 0) {
+    return 0;
+  }
+  sched->_env = env;
+  sched->_sleeping = 0;
+  sched->_queue_head = 0;
+  sched->_queue_tail = 0;
+  sched->_is_stopping = false;
+  sched->_tasks = 0;
+  gc_register_scheduler(sched);
+  for (uint32_t i = 0; i != worker_count; ++i) {
+    Worker* w = new Worker;
+    w->sched = sched;
+    w->env = 0;
+    w->tasks_run = 0;
+    w->tasks_stolen = 0;
+    w->join_depth = 0;
+    w->random = 0x9e3779b9u * (i + 1);
+    sched->_workers.push_back(w);
+  }
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, kWorkerStackSize);
+  for (Worker* w : sched->_workers) {
+    if (pthread_create(&w->thread, &attr, &Scheduler::start, w) != 0) {
+      LUM_FATAL("unable to start worker thread");
+    }
+  }
+  pthread_attr_destroy(&attr);
+  return sched;
+}
+
+
+void* Scheduler::start(void* worker) {
+  Worker* w = (Worker*)worker;
+  w->sched->work(w);
+  return 0;
+}
+
+
+void Scheduler::free(Scheduler* sched) {
+  {
+    std::lock_guard<std::mutex> lock(sched->_mutex);
+    sched->_is_stopping = true;
+  }
+  sched->_cond.notify_all();
+  // Workers finish the queued processes first, which may need a collection
+  gc_blocking_begin();
+  for (Worker* w : sched->_workers) {
+    pthread_join(w->thread, 0);
+  }
+  gc_blocking_end();
+  for (Worker* w : sched->_workers) {
+    delete w;
+  }
+  gc_unregister_scheduler(sched);
+  while (sched->_tasks != 0) {
+    Task* t = sched->_tasks;
+    sched->_tasks = t->_all_next;
+    delete t;
+  }
+  delete sched;
+}
+
+
+Scheduler* Scheduler::of(Env* env) {
+  Namespaces* namespaces = env->namespaces;
+  Scheduler* sched = namespaces->scheduler;
+  if (sched != 0) {
+    return sched;
+  }
+  ScopedSpinlock lock(namespaces->lock);
+  if (namespaces->scheduler == 0) {
+    // LUM_WORKERS=N runs processes on N threads instead of one per hardware
+    // thread
+    const char* workers = getenv("LUM_WORKERS");
+    uint32_t count = workers == 0 ? 0 : (uint32_t)atoi(workers);
+    namespaces->scheduler = create(env, count);
+  }
+  return namespaces->scheduler;
+}
+
+
+Task* Scheduler::create_task(Cell* form, bool is_held) {
+  assert(Nursery::current() == 0 || !Nursery::current()->contains(form));
+  Task* t = new (std::nothrow) Task;
+  if (t == 0) {
+    return 0;
+  }
+  t->form = form;
+  t->result = 0;
+  t->is_done = false;
+  t->_is_held = is_held;
+  t->_gc_color = _gc_color;
+  t->_sched = this;
+  t->_next = 0;
+  ScopedSpinlock lock(_tasks_lock);
+  t->_all_prev = 0;
+  t->_all_next = _tasks;
+  if (_tasks != 0) {
+    _tasks->_all_prev = t;
+  }
+  _tasks = t;
+  return t;
+}
+
+
+// Make `t` runnable, on the deque of the calling worker if it is one of ours.
+// A task which can not be queued is left done without a result, for the
+// collector to free.
+bool Scheduler::enqueue(Task* t) {
+  Worker* w = _current_worker;
+  if (w != 0 && w->sched == this) {
+    if (!w->deque.push(t)) {
+      t->_is_held = false;
+      t->is_done = true;
+      return false;
+    }
+  } else {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_queue_tail != 0) {
+      _queue_tail->_next = t;
+    } else {
+      _queue_head = t;
+    }
+    _queue_tail = t;
+  }
+  wake();
+  return true;
+}
+
+
+// Wake up the threads which wait for tasks, if there are any
+void Scheduler::wake() {
+  // Pairs with the increment of _sleeping before looking for tasks
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (_sleeping != 0) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _cond.notify_all();
+  }
+}
+
+
+Task* Scheduler::spawn(Cell* form) {
+  Task* t = create_task(form, true);
+  if (t == 0 || !enqueue(t)) {
+    return 0;
+  }
+  return t;
+}
+
+
+Cell* Scheduler::spawn_cell(Cell* form, Type type) {
+  Task* t = create_task(form, false);
+  if (t == 0) {
+    return 0;
+  }
+  Cell* c = Cell::createPtr(type, (void*)t, 0);
+  if (!enqueue(t)) {
+    return 0;
+  }
+  return c;
+}
+
+
+Cell* Scheduler::promise_cell() {
+  Task* t = create_task(0, false);
+  if (t == 0) {
+    return 0;
+  }
+  return Cell::createPtr(Type::FUTURE, (void*)t, 0);
+}
+
+
+bool Scheduler::deliver(Task* task, Cell* value) {
+  assert(task->form == 0);
+  assert(Nursery::current() == 0 || !Nursery::current()->contains(value));
+  if (value != 0 && !Cell::isImm(value)) {
+    Cell::share(value);
+  }
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (task->is_done) {
+      return false;
+    }
+    task->result = value;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    task->is_done = true;
+  }
+  wake();
+  return true;
+}
+
+
+Cell* Scheduler::join(Env* env, Task* task) {
+  Worker* w = _current_worker;
+  bool can_help = w != 0 && w->sched == this &&
+                  w->join_depth < kMaxJoinDepth;
+  while (!task->done()) {
+    Task* other = can_help ? find_task(w) : 0;
+    if (other != 0) {
+      ++w->join_depth;
+      run(w, other);
+      --w->join_depth;
+      continue;
+    }
+    gc_blocking_begin();
+    bool is_abandoned;
+    {
+      std::unique_lock<std::mutex> lock(_mutex);
+      LumAtomicAddAndFetch(&_sleeping, 1);
+      while (!task->is_done && !(can_help && has_work()) &&
+             !is_abandoned_promise(task))
+      {
+        _cond.wait(lock);
+      }
+      LumAtomicSubAndFetch(&_sleeping, 1);
+      is_abandoned = !task->is_done && is_abandoned_promise(task);
+    }
+    gc_blocking_end();
+    if (is_abandoned) {
+      return 0;
+    }
+  }
+
+  // The result stays reachable through the task until it is a result of
+  // `env`
+  Cell* result = task->result;
+  if (result != 0) {
+    env->results.push(result);
+  }
+  task->_is_held = false;
+  return result;
+}
+
+
+// Whether `task` is a promise which is not delivered and is given up on: the
+// scheduler is stopping and no queued process is left which could deliver
+// it. Called with _mutex locked.
+bool Scheduler::is_abandoned_promise(const Task* task) const {
+  return task->form == 0 && _is_stopping && !has_work();
+}
+
+
+bool Scheduler::has_work() const {
+  if (_queue_head != 0) {
+    return true;
+  }
+  for (const Worker* w : _workers) {
+    if (!w->deque.is_empty()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+Task* Scheduler::pop_shared() {
+  Task* t = _queue_head;
+  if (t != 0) {
+    _queue_head = t->_next;
+    if (_queue_head == 0) {
+      _queue_tail = 0;
+    }
+  }
+  return t;
+}
+
+
+// The next task for `w` to run: its own newest one, else one spawned by
+// another thread, else the oldest one of another worker
+Task* Scheduler::find_task(Worker* w) {
+  Task* t = w->deque.pop();
+  if (t != 0) {
+    return t;
+  }
+  if (_queue_head != 0) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    t = pop_shared();
+    if (t != 0) {
+      return t;
+    }
+  }
+  uint32_t count = (uint32_t)_workers.size();
+  if (count < 2) {
+    return 0;
+  }
+  // xorshift32
+  w->random ^= w->random << 13;
+  w->random ^= w->random >> 17;
+  w->random ^= w->random << 5;
+  uint32_t start = w->random % count;
+  for (uint32_t i = 0; i != count; ++i) {
+    Worker* victim = _workers[(start + i) % count];
+    if (victim != w && (t = victim->deque.steal()) != 0) {
+      ++w->tasks_stolen;
+      return t;
+    }
+  }
+  return 0;
+}
+
+
+void Scheduler::run(Worker* w, Task* task) {
+  Env* env = w->env;
+  size_t results_index = env->results.index();
+  // A process which runs while another one waits in join is not a top-level
+  // form: it gets no nursery frame of its own, so allocate in the heap
+  bool is_nested = env->apply_stack.depth != 0 || env->nursery.depth() != 0;
+  if (is_nested) {
+    env->nursery.suspend();
+  }
+  Cell* result = eval(env, task->form);
+  if (is_nested) {
+    env->nursery.resume();
+  }
+  if (result != 0 && !Cell::isImm(result)) {
+    // Any number of processes might join it
+    Cell::share(result);
+  }
+  env->results.unwind(results_index);
+  ++w->tasks_run;
+  task->result = result;
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  task->is_done = true;
+  wake();
+}
+
+
+void Scheduler::work(Worker* w) {
+  {
+    Env env(_env);
+    w->env = &env;
+    _current_worker = w;
+    while (true) {
+      Task* t = find_task(w);
+      if (t != 0) {
+        run(w, t);
+        env.safepoint();
+        continue;
+      }
+      gc_blocking_begin();
+      bool is_stopping;
+      {
+        std::unique_lock<std::mutex> lock(_mutex);
+        LumAtomicAddAndFetch(&_sleeping, 1);
+        while (!_is_stopping && !has_work()) {
+          _cond.wait(lock);
+        }
+        LumAtomicSubAndFetch(&_sleeping, 1);
+        is_stopping = _is_stopping && !has_work();
+      }
+      gc_blocking_end();
+      if (is_stopping) {
+        break;
+      }
+    }
+    _current_worker = 0;
+    w->env = 0;
+  }
+  heap_thread_exit();
+}
+
+} // namespace lum
@@ -0,0 +1,198 @@
+#ifndef _LUM_SCHED_H_
+#define _LUM_SCHED_H_
+
+#include <lum/common.h>
+#include <lum/cell.h>
+#include <condition_variable>
+#include <mutex>
+#include <pthread.h>
+
+namespace lum {
+
+struct Cell;
+struct Env;
+struct Scheduler;
+
+// Scheduler for lightweight Lum processes.
+//
+// A process evaluates a form, like a top-level form, on one of a fixed pool
+// of OS threads (workers). Processes are not threads of their own but
+// entries in run queues, and a worker runs them one after another to
+// completion, so any number of them can be spawned. Each worker has an Env
+// of its own, with its own locals, results and apply stacks and nursery,
+// which shares the namespaces, and so the Vars, of the Env the scheduler was
+// created with.
+//
+// Each worker has a run queue of its own, a Chase-Lev deque. A process
+// spawned on a worker is pushed onto the bottom of the worker's deque, and
+// the worker pops processes from the bottom again, so that it runs the ones
+// it spawned last, whose data is most likely still in its caches, first.
+// A worker which runs out of processes steals the oldest one from the top of
+// the deque of another, randomly picked, worker. Processes spawned by other
+// threads go into a shared queue which workers look at before stealing.
+//
+// Joining a process from a worker runs other processes in the meantime,
+// usually the one which is being joined. Their results are then allocated
+// in the heap, as they must outlive the frames of the process which is
+// waiting. Processes run like this nest on the worker's stack, up to
+// kMaxJoinDepth of them, after which the worker blocks until the process it
+// joins is done. Threads which wait block through gc_blocking_begin, so that
+// collection can proceed (see gc.h). Collection waits for a worker which is
+// busy until it finishes the process it runs or joins another.
+//
+// A worker which blocks leaves the pool until the process it waits for is
+// done, and nothing replaces it. Processes which wait for others that are
+// still queued can therefore deadlock the scheduler: once every worker
+// blocks, e.g. in a chain of more than worker_count() * kMaxJoinDepth
+// processes each of which joins the next, or when all of them deref
+// promises which queued processes would deliver, nothing is left to run the
+// processes waited for.
+//
+// A promise is a task without a form. It is never queued, and it is done
+// once a value has been delivered to it, which wakes up whoever joins it.
+
+struct Task {
+  Cell* form;         // NULL for a promise
+  Cell* result;       // once done. NULL if evaluation failed.
+  volatile bool is_done;
+
+  // Whether the task is done, after which its result may be read
+  bool done() const { return __atomic_load_n(&is_done, __ATOMIC_ACQUIRE); }
+
+  // Tasks are freed by the garbage collector once they are done and
+  // unreachable: through a TASK cell, or as spawned from C++ until joined.
+  bool       _is_held;
+  uint32_t   _gc_color;
+  Scheduler* _sched;
+  Task*      _next;     // in the shared run queue
+  Task*      _all_next; // in the scheduler's list of all tasks
+  Task*      _all_prev;
+};
+
+struct Scheduler {
+  // Chase-Lev work-stealing deque. Only the worker which owns it pushes and
+  // pops, at the bottom, while any thread may steal from the top.
+  struct Deque {
+    struct Array {
+      int64_t      capacity; // a power of two
+      Array*       prev;     // smaller array which this one replaced
+      Task* volatile items[1];
+
+      Task* get(int64_t i) const { return items[i & (capacity - 1)]; }
+      void put(int64_t i, Task* t) { items[i & (capacity - 1)] = t; }
+    };
+
+    Deque();
+    ~Deque();
+    LUM_CXX_DISALLOW_COPY(Deque);
+
+    // Owner only. push returns false if out of memory.
+    bool  push(Task* t);
+    Task* pop();
+    // Any thread. Returns NULL if empty or if another thread won the race.
+    Task* steal();
+    bool  is_empty() const { return bottom - top <= 0; }
+
+    volatile int64_t top;
+    volatile int64_t bottom;
+    Array* volatile  array;
+
+  private:
+    Array* grow(Array* a, int64_t bottom, int64_t top);
+  };
+
+  struct Worker {
+    Scheduler*  sched;
+    Env*        env;
+    Deque       deque;
+    pthread_t   thread;
+    uint64_t    tasks_run;
+    uint64_t    tasks_stolen;
+    uint32_t    join_depth; // processes run from within join
+    uint32_t    random; // state for picking victims to steal from
+  };
+
+  // Workers run on threads with a stack of this size, so that a process
+  // which calls deeper than Env::kDefaultMaxDepth gets an error rather than
+  // a crash. A call takes up to about 1 KiB of stack in unoptimized builds,
+  // and more with sanitizers. The platform's default for threads other than
+  // the main one can be much smaller, e.g. 512 KiB on macOS.
+  static constexpr size_t kWorkerStackSize = 32 * 1024 * 1024;
+
+  // How many processes a worker runs nested from within join before it
+  // blocks instead. Each nested process takes up stack and delays the ones
+  // it runs within until it finishes.
+  static constexpr uint32_t kMaxJoinDepth = 64;
+
+  // Start `worker_count` workers, one per hardware thread if 0, sharing the
+  // namespaces of `env`. Returns NULL if out of memory.
+  static Scheduler* create(Env* env, uint32_t worker_count=0);
+
+  // Wait for all processes to finish and stop the workers. Processes which
+  // wait for a promise which is never delivered fail (see join). Must be called
+  // from the thread of the Env the scheduler was created with, once none of
+  // its tasks is referenced anymore.
+  static void free(Scheduler*);
+
+  // The scheduler shared by `env` and the Envs of its workers, which is
+  // created and started when first asked for. Returns NULL if out of memory.
+  static Scheduler* of(Env* env);
+
+  // Start a process which evaluates `form`. The form must not live in a
+  // nursery. The task must be joined exactly once. Returns NULL if out of
+  // memory.
+  Task* spawn(Cell* form);
+
+  // Like spawn, but returns a cell of `type`, TASK or FUTURE, for the task,
+  // which keeps it alive and can be joined any number of times (see the
+  // `join` and `deref` BIFs)
+  Cell* spawn_cell(Cell* form, Type type=Type::TASK);
+
+  // Returns a FUTURE cell for a new promise, or NULL if out of memory
+  Cell* promise_cell();
+
+  // Complete promise `task` with `value`, which must not live in a nursery
+  // and is shared. Returns false if the promise was already delivered.
+  bool deliver(Task* task, Cell* value);
+
+  // Wait for `task` to finish. Returns its result, which is pushed onto
+  // env->results, or NULL if evaluation failed. `env` is the Env of the
+  // calling thread. Waiting for a promise fails once the scheduler is
+  // stopping and no process is left to run, as nothing can deliver it then.
+  Cell* join(Env* env, Task* task);
+
+  uint32_t worker_count() const { return (uint32_t)_workers.size(); }
+  const Worker& worker(uint32_t i) const { return *_workers[i]; }
+
+  // The worker which the calling thread is, or NULL
+  static Worker* current_worker() { return _current_worker; }
+
+  Env*                    _env;
+  std::vector<Worker*>    _workers;
+  std::mutex              _mutex;
+  std::condition_variable _cond;  // signals new tasks and finished ones
+  volatile int32_t        _sleeping; // threads waiting on _cond
+  Task*                   _queue_head; // spawned by other threads
+  Task*                   _queue_tail;
+  bool                    _is_stopping;
+
+  Spinlock _tasks_lock = LUM_SPINLOCK_INIT;
+  Task*    _tasks; // all tasks which have not been freed, see gc.cc
+
+  static thread_local Worker* _current_worker;
+
+private:
+  Task* create_task(Cell* form, bool is_held);
+  bool  enqueue(Task* t);
+  Task* find_task(Worker* w);
+  bool  has_work() const;
+  bool  is_abandoned_promise(const Task* task) const;
+  Task* pop_shared(); // with _mutex held
+  void  wake();
+  void  run(Worker* w, Task* task);
+  void  work(Worker* w);
+  static void* start(void* worker); // thread entry
+};
+
+} // namespace lum
+#endif // _LUM_SCHED_H_
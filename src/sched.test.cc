@@ -0,0 +1,414 @@
+#include <lum/sched.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <lum/fn.h>
+#include <lum/gc.h>
+#include "test.h"
+#include <thread>
+
+using namespace lum;
+
+static void test_deque() {
+  Task tasks[200];
+  Scheduler::Deque deque;
+  assert_true(deque.is_empty());
+  assert_null(deque.pop());
+  assert_null(deque.steal());
+
+  // The owner takes the newest task and thieves the oldest one, also after
+  // the deque has grown
+  for (Task& t : tasks) {
+    assert_true(deque.push(&t));
+  }
+  assert_true(deque.pop() == &tasks[199]);
+  assert_true(deque.steal() == &tasks[0]);
+  assert_true(deque.steal() == &tasks[1]);
+  assert_true(deque.pop() == &tasks[198]);
+  size_t count = 4;
+  while (deque.pop() != 0) {
+    ++count;
+  }
+  assert_eq(count, LUM_COUNTOF(tasks));
+  assert_true(deque.is_empty());
+
+  // Every task is taken exactly once while thieves race with the owner
+  static constexpr int kThieves = 3;
+  static constexpr int kRounds = 2000;
+  int32_t taken[LUM_COUNTOF(tasks)] = {0};
+  volatile bool is_done = false;
+  std::vector<std::thread> thieves;
+  for (int i = 0; i != kThieves; ++i) {
+    thieves.emplace_back([&] {
+      while (!is_done) {
+        Task* t = deque.steal();
+        if (t != 0) {
+          LumAtomicAddAndFetch(&taken[t - tasks], 1);
+        }
+      }
+    });
+  }
+  for (int round = 0; round != kRounds; ++round) {
+    for (Task& t : tasks) {
+      deque.push(&t);
+    }
+    Task* t;
+    while ((t = deque.pop()) != 0) {
+      LumAtomicAddAndFetch(&taken[t - tasks], 1);
+    }
+    // Wait for the thieves to count what they took
+    for (Task& t : tasks) {
+      while (((volatile int32_t*)taken)[&t - tasks] != round + 1) {
+        std::this_thread::yield();
+      }
+    }
+  }
+  is_done = true;
+  for (std::thread& t : thieves) {
+    t.join();
+  }
+  for (int32_t n : taken) {
+    assert_eq(n, kRounds);
+  }
+}
+
+// Evaluates `source` while another thread collects garbage, and then
+// delivers 5 to promise `p`, which the source waits for
+static Cell* eval_collecting(Env& env, const char* source) {
+  Cell* p = eval_source(env, "(promise)");
+  assert_true(p != 0);
+  env.define(const_cast<Sym*>(intern_sym("p")), p);
+  std::thread collector([p] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    gc_collect();
+    Task* task = (Task*)p->value.p;
+    task->_sched->deliver(task, Cell::immInt(5));
+  });
+  // The form is not reachable from any other root
+  Cell* form = read(source);
+  env.results.push(form);
+  Cell* r = eval(&env, form);
+  collector.join();
+  return r;
+}
+
+// (pfib n depth) spawns one of its recursive calls as a process until
+// `depth` levels down
+static void test_spawn(Env& env) {
+  env.define(const_cast<Sym*>(intern_sym("fib")), Cell::createNil());
+  env.define(const_cast<Sym*>(intern_sym("pfib")), Cell::createNil());
+  const char* fns[][2] = {
+    {"fib", "(fn (n) (if (= n 0) 0 (if (= n 1) 1 "
+            "  (+ (fib (- n 1)) (fib (- n 2))))))"},
+    {"pfib", "(fn (n depth) (if (= depth 0) (fib n)"
+             "  ((fn (t) (+ (pfib (- n 2) (- depth 1)) (join t)))"
+             "   (spawn pfib (- n 1) (- depth 1)))))"},
+  };
+  for (auto& fn : fns) {
+    Cell* value = eval(&env, read(fn[1]));
+    assert_true(value != 0 && Cell::typeOf(value) == Type::FN);
+    env.define(const_cast<Sym*>(intern_sym(fn[0])), value);
+    env.results.unwind(0);
+  }
+
+  // Joined processes may already be collected while others still run
+  uint64_t tasks_freed = gc_stats().tasks_freed;
+  Cell* task = eval(&env, read("(spawn pfib 18 5)"));
+  assert_true(task != 0 && Cell::typeOf(task) == Type::TASK);
+  Scheduler* sched = env.namespaces->scheduler;
+  assert_true(sched != 0);
+  assert_eq(sched->worker_count(), 3u);
+  env.define(const_cast<Sym*>(intern_sym("t")), task);
+  env.results.unwind(0);
+
+  // A task can be joined more than once, from any thread
+  for (int i = 0; i != 2; ++i) {
+    Cell* result = eval(&env, read("(join t)"));
+    assert_true(result != 0);
+    assert_eq(Cell::intValue(result), 2584);
+    env.results.unwind(0);
+  }
+  uint64_t tasks_run = 0;
+  for (uint32_t i = 0; i != sched->worker_count(); ++i) {
+    tasks_run += sched->worker(i).tasks_run;
+  }
+  assert_eq(tasks_run, (uint64_t)32);
+
+  // Arguments are passed as values, lists included
+  Cell* result = eval(&env, read("(join (spawn cons 1 (cons 2 (cons 3))))"));
+  assert_true(result != 0 && Cell::typeOf(result) == Type::LIST);
+  assert_eq(Cell::intValue((Cell*)result->value.p), 1);
+  env.results.unwind(0);
+
+  assert_null(eval(&env, read("(join 1)")));
+  assert_null(eval(&env, read("(join (spawn no-such-fn))")));
+  env.results.unwind(0);
+
+  // Workers have the stack to evaluate as deep as the maximum call depth,
+  // and report going deeper than that as an error
+  env.define(const_cast<Sym*>(intern_sym("depth")), Cell::createNil());
+  env.define(const_cast<Sym*>(intern_sym("depth")),
+             eval(&env, read("(fn (n) (if (= n 0) 0 (+ 1 (depth (- n 1)))))")));
+  env.results.unwind(0);
+  result = eval_source(env, "(join (spawn depth 3000))");
+  assert_true(result != 0);
+  assert_eq(Cell::intValue(result), 3000);
+  assert_null(eval_source(env, "(join (spawn depth 100000))"));
+
+  // A worker which runs kMaxJoinDepth processes nested within join blocks,
+  // and the others run the rest of a chain of joins
+  static_assert(Scheduler::kMaxJoinDepth < 100 &&
+                Scheduler::kMaxJoinDepth * 3 > 100, "chain of 100 joins");
+  env.define(const_cast<Sym*>(intern_sym("chain")), Cell::createNil());
+  env.define(const_cast<Sym*>(intern_sym("chain")),
+             eval(&env, read("(fn (n) (if (= n 0) 0"
+                             "  (+ 1 (join (spawn chain (- n 1))))))")));
+  env.results.unwind(0);
+  result = eval_source(env, "(join (spawn chain 100))");
+  assert_true(result != 0);
+  assert_eq(Cell::intValue(result), 100);
+  env.results.unwind(0);
+
+  // Tasks are freed once done and unreachable
+  env.define(const_cast<Sym*>(intern_sym("t")), Cell::createNil());
+  gc_collect();
+  assert_true(gc_stats().tasks_freed >= tasks_freed + 32);
+
+  // Arguments made by functions, whose results only spawn holds, live on
+  // while the arguments after them are evaluated
+  result = eval_collecting(env, "(join (spawn (fn (f x) (+ (deref f) x))"
+                                "             ((fn () (future 2)))"
+                                "             (deref p)))");
+  assert_true(result != 0);
+  assert_eq(Cell::intValue(result), 7);
+  env.results.unwind(0);
+}
+
+// pmap, pfilter and preduce give the same results as doing one element after
+// another, whether or not the elements are processed in parallel
+static void test_pseq(Env& env) {
+  Scheduler* sched = Scheduler::of(&env);
+  const char* fns[][2] = {
+    {"sq", "(fn (x) (* x x))"},
+    {"slow-sq", "(fn (x) (+ (* x x) (- (fib 14) 377)))"},
+    {"odd", "(fn (x) (= (rem x 2) 1))"},
+    {"pair", "(fn (x) (cons x (cons (* x 2))))"},
+  };
+  for (auto& fn : fns) {
+    env.define(const_cast<Sym*>(intern_sym(fn[0])), eval(&env, read(fn[1])));
+    env.results.unwind(0);
+  }
+  static constexpr int64_t kCount = 3000;
+  Cell* xs = 0;
+  for (int64_t i = kCount; i-- != 0;) {
+    xs = Cell::createInt(i % 2 ? i : -i, xs);
+  }
+  env.define(const_cast<Sym*>(intern_sym("xs")), Cell::createList(xs));
+  env.define(const_cast<Sym*>(intern_sym("none")), Cell::createList(0));
+
+  uint64_t tasks_run = 0;
+  for (uint32_t i = 0; i != sched->worker_count(); ++i) {
+    tasks_run -= sched->worker(i).tasks_run;
+  }
+  const char* maps[] = {"(pmap sq xs)", "(pmap slow-sq xs)"};
+  for (const char* source : maps) {
+    Cell* r = eval(&env, read(source));
+    assert_true(r != 0 && Cell::typeOf(r) == Type::LIST);
+    Cell* x = xs;
+    size_t count = 0;
+    for (Cell* c = (Cell*)r->value.p; c != 0; c = c->rest(), x = x->rest()) {
+      assert_eq(Cell::intValue(c), x->value.i * x->value.i);
+      ++count;
+    }
+    assert_eq(count, (size_t)kCount);
+    env.results.unwind(0);
+    gc_collect();
+  }
+  // The slow function is worth running on several workers
+  for (uint32_t i = 0; i != sched->worker_count(); ++i) {
+    tasks_run += sched->worker(i).tasks_run;
+  }
+  assert_true(tasks_run > 1);
+
+  // Lists made by the function
+  Cell* r = eval(&env, read("(pmap pair xs)"));
+  assert_true(r != 0 && Cell::typeOf(r) == Type::LIST);
+  Cell* x = xs;
+  for (Cell* c = (Cell*)r->value.p; c != 0; c = c->rest(), x = x->rest()) {
+    assert_true(Cell::typeOf(c) == Type::LIST);
+    Cell* first = (Cell*)c->value.p;
+    assert_eq(Cell::intValue(first), x->value.i);
+    assert_eq(Cell::intValue(first->rest()), x->value.i * 2);
+  }
+  env.results.unwind(0);
+
+  r = eval(&env, read("(pfilter odd xs)"));
+  assert_true(r != 0 && Cell::typeOf(r) == Type::LIST);
+  int64_t expected = 1;
+  for (Cell* c = (Cell*)r->value.p; c != 0; c = c->rest(), expected += 2) {
+    assert_eq(Cell::intValue(c), expected);
+  }
+  assert_eq(expected, kCount + 1);
+  env.results.unwind(0);
+
+  // -0 + 1 - 2 + 3 ...
+  r = eval(&env, read("(preduce + 7 xs)"));
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), 7 + kCount / 2);
+  env.results.unwind(0);
+  // From within a process
+  r = eval(&env,
+           read("(join (spawn (fn () (preduce + 0 (pmap slow-sq xs)))))"));
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), (kCount - 1) * kCount * (2 * kCount - 1) / 6);
+  env.results.unwind(0);
+  // In order, for an associative f which is not commutative
+  r = eval(&env, read("(preduce (fn (a x) (+ x (- (fib 14) 377))) 7 xs)"));
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), kCount - 1);
+  env.results.unwind(0);
+  // Any f, for a list which is too short to be worth splitting up
+  r = eval(&env, read("(preduce - 0 (cons 1 (cons 2 (cons 3 (cons 4 (cons 5"
+                      " (cons 6 (cons 7 (cons 8 (cons 9 (cons 10 (cons 11"
+                      " (cons 12 (cons 13 (cons 14 (cons 15 (cons 16 (cons 17"
+                      " (cons 18 (cons 19 (cons 20)))))))))))))))))))))"));
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), -210);
+  env.results.unwind(0);
+  r = eval(&env, read("(preduce + 7 none)"));
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), 7);
+  env.results.unwind(0);
+  r = eval(&env, read("(pmap sq none)"));
+  assert_true(r != 0 && Cell::typeOf(r) == Type::LIST);
+  assert_null(r->value.p);
+  env.results.unwind(0);
+
+  assert_null(eval_source(env, "(pmap 1 xs)"));
+  assert_null(eval_source(env, "(pmap sq 1)"));
+  assert_null(eval_source(env, "(pfilter odd)"));
+  assert_null(eval_source(env, "(pmap no-such-fn xs)"));
+  assert_null(eval_source(env, "(pmap (fn (x) (+ x no-such-var)) xs)"));
+}
+
+// Futures evaluate in processes, and promises are done once delivered, also
+// when a process is waiting for them
+static void test_future(Env& env) {
+  Cell* r = eval(&env, read("(deref (future (fib 15)))"));
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), 610);
+  env.results.unwind(0);
+  r = eval(&env, read("((fn (x) (deref (future (* x 2)))) 21)"));
+  assert_true(r != 0);
+  assert_eq(Cell::intValue(r), 42);
+  env.results.unwind(0);
+
+  env.define(const_cast<Sym*>(intern_sym("p")), eval(&env, read("(promise)")));
+  Cell* q = eval(&env, read("(future (cons (deref p) (cons 1)))"));
+  assert_true(q != 0 && Cell::typeOf(q) == Type::FUTURE);
+  env.define(const_cast<Sym*>(intern_sym("q")), q);
+  env.results.unwind(0);
+  gc_collect();
+  assert_false(((Task*)q->value.p)->done());
+  r = eval(&env, read("(deliver p (cons 41))"));
+  assert_true(r != 0 && Cell::intValue(r) == 1);
+  r = eval(&env, read("(deliver p 0)"));
+  assert_true(r != 0 && Cell::intValue(r) == 0);
+  for (int i = 0; i != 2; ++i) {
+    r = eval(&env, read("(deref q)"));
+    assert_true(r != 0 && Cell::typeOf(r) == Type::LIST);
+    Cell* first = (Cell*)r->value.p;
+    assert_true(Cell::typeOf(first) == Type::LIST);
+    assert_eq(Cell::intValue((Cell*)first->value.p), 41);
+    assert_eq(Cell::intValue(first->rest()), 1);
+    env.results.unwind(0);
+  }
+
+  // The promise lives on while the value to deliver is evaluated
+  r = eval_collecting(env, "(deliver ((fn () (promise))) (deref p))");
+  assert_true(r != 0 && Cell::intValue(r) == 1);
+  env.results.unwind(0);
+
+  assert_null(eval_source(env, "(deref 1)"));
+  assert_null(eval_source(env, "(deref (spawn + 1))"));
+  assert_null(eval_source(env, "(deref (future no-such-var))"));
+  assert_null(eval_source(env, "(deliver (future 1) 2)"));
+  assert_null(eval_source(env, "(future)"));
+  assert_null(eval_source(env, "(future 1 2)"));
+  assert_null(eval_source(env, "(fn (x) (future x x))"));
+
+  // Promises which nobody can deliver to are freed
+  eval_source(env, "(promise)");
+  env.define(const_cast<Sym*>(intern_sym("p")), Cell::createNil());
+  env.define(const_cast<Sym*>(intern_sym("q")), Cell::createNil());
+  uint64_t tasks_freed = gc_stats().tasks_freed;
+  gc_collect();
+  assert_true(gc_stats().tasks_freed >= tasks_freed + 3);
+}
+
+int main(int argc, const char** argv) {
+  test_deque();
+
+  Env env;
+  gc_set_threshold(1024);
+
+  // Vars defined on the creating thread are visible to the workers
+  // (def f (fn (a b) (+ (* a b) k)))
+  env.define(const_cast<Sym*>(intern_sym("k")), Cell::createInt(5));
+  Cell* body = list(sym("+", list(sym("*", sym("a", sym("b"))), sym("k"))));
+  Cell* fn = eval(&env, list(sym("fn", list(sym("a", sym("b")), body))));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  env.define(const_cast<Sym*>(intern_sym("f")), fn);
+  env.results.unwind(0);
+
+  Scheduler* sched = Scheduler::create(&env, 4);
+  assert_true(sched != 0);
+  assert_eq(sched->worker_count(), 4u);
+  assert_null(Scheduler::current_worker());
+
+  // Many more processes than workers, each calling f enough times to
+  // allocate past the collection threshold
+  const int kCount = 2000;
+  std::vector<Task*> tasks;
+  for (int i = 0; i != kCount; ++i) {
+    // (f i 3)
+    Cell* form = list(sym("f", Cell::createInt(i, Cell::createInt(3))));
+    tasks.push_back(sched->spawn(form));
+  }
+  uint64_t collections = gc_stats().collections;
+  for (int i = 0; i != kCount; ++i) {
+    Cell* result = sched->join(&env, tasks[i]);
+    assert_true(result != 0);
+    assert_eq(Cell::intValue(result), i * 3 + 5);
+    env.results.unwind(0);
+    // Collect while the workers are busy
+    if (i % 100 == 0) {
+      gc_collect();
+    }
+  }
+  assert_true(gc_stats().collections > collections);
+
+  // A process which fails has no result
+  Task* t = sched->spawn(list(sym("no-such-fn", Cell::createInt(1))));
+  assert_null(sched->join(&env, t));
+
+  uint64_t tasks_run = 0;
+  for (uint32_t i = 0; i != sched->worker_count(); ++i) {
+    tasks_run += sched->worker(i).tasks_run;
+  }
+  assert_eq(tasks_run, (uint64_t)kCount + 1);
+
+  Scheduler::free(sched);
+
+  setenv("LUM_WORKERS", "3", 1);
+  test_spawn(env);
+  test_pseq(env);
+  test_future(env);
+
+  // A process which waits for a promise that is never delivered fails when
+  // the scheduler stops, instead of keeping it from stopping
+  {
+    Env other;
+    assert_true(eval_source(other, "(future (deref (promise)))") != 0);
+  }
+  return 0;
+}
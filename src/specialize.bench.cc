@@ -0,0 +1,60 @@
+// Cost of running a numeric function body as generic bytecode, as bytecode
+// specialized for int and float arguments, and as machine code translated
+// from the specialized bytecode.
+//
+//   make bench/specialize
+#include <lum/fn.h>
+#include <lum/cell.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <lum/vm.h>
+#include <lum/jit.h>
+#include <chrono>
+#include "test.h"
+
+using namespace lum;
+
+static constexpr size_t kIterations = 10000000;
+
+// Nanoseconds per run of `code` with `a` and `b` as arguments
+static double time_code(Env& env, const Code* code, Cell* a, Cell* b) {
+  env.locals.push(a);
+  env.locals.push(b);
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i != kIterations; ++i) {
+    Cell* r = vm_exec(&env, code);
+    asm volatile("" : : "r"(r) : "memory");
+  }
+  auto end = std::chrono::steady_clock::now();
+  env.unwind_locals(0);
+  std::chrono::duration<double, std::nano> ns = end - start;
+  return ns.count() / kIterations;
+}
+
+static void report(Env& env, const char* name, Fn* fn, Cell* a, Cell* b) {
+  Type types[] = {Cell::typeOf(a), Cell::typeOf(b)};
+  Code* special = Code::create(&env, fn, types);
+  double generic = time_code(env, fn->_code, a, b);
+  double fixed = time_code(env, special, a, b);
+  double native = jit_compile(special) ? time_code(env, special, a, b) : 0;
+  printf("%-28s %8.2f ns %8.2f ns %8.2f ns %6.2fx\n",
+         name, generic, fixed, native, generic / fixed);
+  Code::free(special);
+}
+
+int main(int argc, const char** argv) {
+  Env env;
+
+  // (fn (a b) (+ (* a a) (* b b) (- a b)))
+  Cell* body = list(sym("+", list(sym("*", sym("a", sym("a"))),
+    list(sym("*", sym("b", sym("b"))), list(sym("-", sym("a", sym("b"))))))));
+  Fn* fn = make_fn(env, body);
+
+  Nursery::Frame frame = env.nursery.enter();
+  printf("%-28s %11s %11s %11s %7s\n",
+         "", "generic", "special", "native", "speedup");
+  report(env, "int int", fn, Cell::immInt(3), Cell::immInt(4));
+  report(env, "float float", fn, Cell::immFloat(3.5), Cell::immFloat(4.5));
+  env.nursery.leave(frame, 0);
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include <lum/str.h>
+#include <lum/memstats.h>
 #include <unordered_map>
 
 namespace lum {
@@ -13,6 +14,7 @@ Str* Str::create(const char* cstr, uint32_t length) {
   if (obj == 0) {
     fprintf(stderr, "out of memory - unable to allocate string\n");
   } else {
+    mem_note_alloc(kMemKindStr, sizeof(Str) + length + 1);
     obj->hash = hash::fnv1a(cstr, length);
     obj->length = length;
     memcpy((void*)&obj->_cstr, (const void*)cstr, length + 1);
@@ -21,6 +23,9 @@ Str* Str::create(const char* cstr, uint32_t length) {
 }
 
 void Str::free(Str* str) {
+  if (str != 0) {
+    mem_note_free(kMemKindStr, sizeof(Str) + str->length + 1);
+  }
   std::free(str);
 }
 
@@ -8,6 +8,8 @@
 //
 //            Name   Value
 LUM_SYM_APPLY(core,  "core", 0)
+LUM_SYM_APPLY(pseq_chunk, "&pseq-chunk", 0) // see bif.cc
+LUM_SYM_APPLY(compiled_loop, "&loop", 0) // see bif.cc
 
 #endif // !LUM_SYM_APPLY_ONLY_CORE
 
@@ -19,7 +21,7 @@ LUM_SYM_APPLY(core,  "core", 0)
 // In addition, the core namespace will be populated.
 //
 //            Name   Value    Cell creation method
-LUM_SYM_APPLY(nil,   "nil",   Cell::createSym(kSym_nil) )
+LUM_SYM_APPLY(nil,   "nil",   Cell::createNil() )
 LUM_SYM_APPLY(true,  "true",  Cell::createBool(true) )
 LUM_SYM_APPLY(false, "false", Cell::createBool(false) )
 
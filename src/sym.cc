@@ -1,4 +1,5 @@
 #include <lum/sym.h>
+#include <lum/memstats.h>
 #include <unordered_map>
 
 namespace lum {
@@ -26,6 +27,7 @@ namespace lum {
 
 Sym* Sym::create(const Str* ns, const Str* name) {
   Sym* sym = (Sym*)malloc(sizeof(Sym));
+  mem_note_alloc(kMemKindSym, sizeof(Sym));
   sym->ns = ns;
   sym->name = name;
   sym->_str = 0;
@@ -38,6 +40,7 @@ void Sym::free(Sym* sym) {
     Str::free(const_cast<Str*>(sym->_str));
     sym->_str = 0;
   }
+  mem_note_free(kMemKindSym, sizeof(Sym));
   std::free(sym);
 }
 
@@ -81,12 +84,14 @@ const Str* intern_str(const char* cstr) {
   const Str* obj = 0;
   spinlock_lock(str_intern_map_lock);
   // Create a new entry in the intern map, but only if the string doesn't
-  // already exist.
-  auto P = str_intern_map.emplace(cstr, obj);
-  if (P.second) {
-    P.first->second = obj = Str::create(cstr);
+  // already exist. The key is the string of the entry, as `cstr` may not
+  // outlive the call.
+  auto it = str_intern_map.find(cstr);
+  if (it != str_intern_map.end()) {
+    obj = it->second;
   } else {
-    obj = P.first->second;
+    obj = Str::create(cstr);
+    str_intern_map.emplace(obj->c_str(), obj);
   }
   spinlock_unlock(str_intern_map_lock);
   return obj;
@@ -116,6 +121,8 @@ const Str* intern_str_nscat(const Str* ns, const Str* name) {
   if (actual != obj) {
     // already existed
     std::free(obj);
+  } else {
+    mem_note_alloc(kMemKindStr, sizeof(Str) + len + 1);
   }
   return actual;
 }
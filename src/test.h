@@ -1,10 +1,10 @@
-// Helpers for tests
+// Helpers for tests, which benchmarks use for building forms as well
 #ifndef _LUM_TEST_H_
 #define _LUM_TEST_H_
 
 #include <lum/common.h>
 
-#if !LUM_DEBUG
+#if !LUM_DEBUG && !LUM_BENCH
   #warning "Running test in release mode"
 #endif
 
@@ -16,6 +16,11 @@
 
 // ------------------------------
 #ifdef __cplusplus
+#include <lum/cell.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <lum/fn.h>
+#include <lum/read.h>
 #include <iostream>
 
 namespace lum {
@@ -85,6 +90,53 @@ inline void _assert_eq_cstr(
 #define assert_null(a) \
   ::lum::_assert_eq((a), #a, (void*)NULL, "NULL", LUM_FILENAME, __LINE__)
 
+// Building forms by hand, e.g. list(sym("+", sym("a", sym("b"))))
+inline Cell* sym(const char* name, Cell* rest=0) {
+  return Cell::createSym(intern_sym(name), rest);
+}
+
+inline Cell* list(Cell* first, Cell* rest=0) {
+  return Cell::createList(first, rest);
+}
+
+// Reads the first form in `source`
+inline Cell* read(const char* source) {
+  Reader reader(source);
+  Cell* form = reader.read();
+  assert_true(form != 0);
+  return form;
+}
+
+// Evaluates the first form in `source`, dropping the results stack
+inline Cell* eval_source(Env& env, const char* source) {
+  Cell* r = eval(&env, read(source));
+  env.results.unwind(0);
+  return r;
+}
+
+// Compiles (fn (a b) body)
+inline Fn* make_fn(Env& env, Cell* body) {
+  Cell* params = list(sym("a", sym("b")), body);
+  Cell* fn = eval(&env, list(sym("fn", params)));
+  assert_true(fn != 0 && fn->type == Type::FN);
+  env.results.unwind(0);
+  return (Fn*)fn->value.p;
+}
+
+// Checks that two ways of evaluating the same form both failed or both
+// returned the same number
+inline void assert_same(Cell* actual, Cell* expected) {
+  if (actual == 0 || expected == 0) {
+    assert_eq(actual, expected);
+  } else if (Cell::typeOf(actual) != Cell::typeOf(expected)) {
+    assert_true(Cell::typeOf(actual) == Cell::typeOf(expected));
+  } else if (Cell::typeOf(actual) == Type::FLOAT) {
+    assert_true(Cell::floatValue(actual) == Cell::floatValue(expected));
+  } else {
+    assert_eq(Cell::intValue(actual), Cell::intValue(expected));
+  }
+}
+
 } // namespace lum
 #endif // __cplusplus
 
@@ -0,0 +1,86 @@
+#include <lum/trace.h>
+
+namespace lum {
+
+static_assert((kTraceRingSize & (kTraceRingSize - 1)) == 0,
+              "kTraceRingSize must be a power of two");
+
+struct TraceEntry {
+  // Position of the entry plus one once it has been written, 0 while it is
+  // being written
+  volatile uint64_t seq;
+  TraceSys sys;
+  uint8_t  len;
+  char     text[kTraceTextSize];
+};
+
+static_assert(kTraceTextSize <= UINT8_MAX, "TraceEntry::len is too small");
+
+// Writers claim positions by incrementing `ring_head`. An entry may come out
+// garbled if the ring wraps around while it is being written, which takes
+// kTraceRingSize other entries to be written in the meantime.
+static TraceEntry ring[kTraceRingSize];
+static volatile uint64_t ring_head = 0;
+static volatile uint64_t ring_start = 0; // first position to dump
+
+
+TraceLine::TraceLine(TraceSys sys) : _os(this) {
+  _seq = LumAtomicAddAndFetch(&ring_head, (uint64_t)1) - 1;
+  _entry = &ring[_seq & (kTraceRingSize - 1)];
+  _entry->seq = 0;
+  __sync_synchronize();
+  _entry->sys = sys;
+  setp(_entry->text, _entry->text + kTraceTextSize);
+}
+
+
+TraceLine::~TraceLine() {
+  _entry->len = (uint8_t)(pptr() - pbase());
+  __sync_synchronize();
+  _entry->seq = _seq + 1;
+}
+
+
+size_t trace_dump(std::ostream& os) {
+  uint64_t head = ring_head;
+  uint64_t pos = ring_start;
+  if (head - pos > kTraceRingSize) {
+    pos = head - kTraceRingSize;
+  }
+  size_t count = 0;
+  for (; pos != head; ++pos) {
+    const TraceEntry& e = ring[pos & (kTraceRingSize - 1)];
+    uint64_t seq = e.seq;
+    __sync_synchronize();
+    TraceSys sys = e.sys;
+    char text[kTraceTextSize];
+    size_t len = e.len;
+    memcpy(text, e.text, len);
+    __sync_synchronize();
+    if (seq != pos + 1 || e.seq != seq) {
+      continue; // being written or already overwritten
+    }
+    os << trace_sys_name(sys) << ": ";
+    os.write(text, (std::streamsize)len) << '\n';
+    ++count;
+  }
+  return count;
+}
+
+
+void trace_clear() {
+  ring_start = ring_head;
+}
+
+
+const char* trace_sys_name(TraceSys sys) {
+  switch (sys) {
+    #define LUM_TRACE_SYS_NAME(Name, name) \
+      case TraceSys::Name: { return name; }
+    LUM_TRACE_SUBSYSTEMS(LUM_TRACE_SYS_NAME)
+    #undef LUM_TRACE_SYS_NAME
+  }
+  return "?";
+}
+
+} // namespace lum
@@ -0,0 +1,99 @@
+#ifndef _LUM_TRACE_H_
+#define _LUM_TRACE_H_
+
+#include <lum/common.h>
+#include <ostream>
+#include <streambuf>
+
+namespace lum {
+
+// Tracing of what the interpreter is doing, per subsystem.
+//
+// Each subsystem has a trace level which is fixed at compile time by
+// defining LUM_TRACE_<SUBSYSTEM>, or LUM_TRACE_LEVEL for all of them. Level
+// 0, the default, compiles tracing to nothing: the arguments of LUM_TRACE
+// are not even evaluated. Level 1 traces events, and level 2 adds details
+// such as dumps of whole stacks.
+//
+//   LUM_TRACE(EVAL, 1, "apply " << c);
+//
+// Each trace writes one entry to a ring buffer in memory, which keeps the
+// latest kTraceRingSize entries. Writing does not take any lock, so threads
+// do not wait for each other, and trace_dump writes the entries out on
+// demand. Entries longer than kTraceTextSize are truncated.
+
+#ifndef LUM_TRACE_LEVEL
+  #define LUM_TRACE_LEVEL 0
+#endif
+
+#define LUM_TRACE_SUBSYSTEMS(_) \
+  _(EVAL,    "eval") \
+  _(RESULTS, "results") \
+  _(READER,  "reader") \
+  _(COMPILE, "compile") \
+  _(CONS,    "cons") \
+  _(FOLD,    "fold") \
+/**/
+
+#ifndef LUM_TRACE_EVAL
+  #define LUM_TRACE_EVAL LUM_TRACE_LEVEL
+#endif
+#ifndef LUM_TRACE_RESULTS
+  #define LUM_TRACE_RESULTS LUM_TRACE_LEVEL
+#endif
+#ifndef LUM_TRACE_READER
+  #define LUM_TRACE_READER LUM_TRACE_LEVEL
+#endif
+#ifndef LUM_TRACE_COMPILE
+  #define LUM_TRACE_COMPILE LUM_TRACE_LEVEL
+#endif
+#ifndef LUM_TRACE_CONS
+  #define LUM_TRACE_CONS LUM_TRACE_LEVEL
+#endif
+#ifndef LUM_TRACE_FOLD
+  #define LUM_TRACE_FOLD LUM_TRACE_LEVEL
+#endif
+
+enum class TraceSys : uint8_t {
+  #define LUM_TRACE_SYS_ENUM(Name, _) Name,
+  LUM_TRACE_SUBSYSTEMS(LUM_TRACE_SYS_ENUM)
+  #undef LUM_TRACE_SYS_ENUM
+};
+
+#define LUM_TRACE(sys, level, ...) do { \
+    if (LUM_TRACE_##sys >= (level)) { \
+      ::lum::TraceLine _trace_line(::lum::TraceSys::sys); \
+      _trace_line.stream() << __VA_ARGS__; \
+    } \
+  } while (0)
+
+static constexpr size_t kTraceRingSize = 4096; // entries, a power of two
+static constexpr size_t kTraceTextSize = 240;  // bytes per entry
+
+// Write the entries in the ring buffer, oldest first, to `os`. Entries which
+// are being written while dumping are skipped. Returns the number of entries
+// written.
+size_t trace_dump(std::ostream& os);
+
+// Drop all entries from the ring buffer
+void trace_clear();
+
+// Name of a subsystem, e.g. "eval"
+const char* trace_sys_name(TraceSys);
+
+// Writes one entry. Used by LUM_TRACE: the entry is claimed when
+// constructed, and published when destroyed.
+struct TraceLine : private std::streambuf {
+  explicit TraceLine(TraceSys);
+  ~TraceLine();
+  std::ostream& stream() { return _os; }
+private:
+  int_type overflow(int_type ch) override { return traits_type::eof(); }
+  struct TraceEntry* _entry;
+  uint64_t           _seq;
+  std::ostream       _os;
+  LUM_CXX_DISALLOW_COPY(TraceLine);
+};
+
+} // namespace lum
+#endif // _LUM_TRACE_H_
@@ -0,0 +1,85 @@
+#define LUM_TRACE_EVAL 2
+#define LUM_TRACE_CONS 1
+#define LUM_TRACE_COMPILE 0
+#include <lum/trace.h>
+#include "test.h"
+#include <sstream>
+#include <thread>
+
+using namespace lum;
+
+static std::string dump(size_t* count=0) {
+  std::ostringstream os;
+  size_t n = trace_dump(os);
+  if (count != 0) {
+    *count = n;
+  }
+  return os.str();
+}
+
+int main(int argc, const char** argv) {
+  trace_clear();
+
+  // Entries are written for enabled levels only, and disabled ones do not
+  // evaluate their arguments
+  int evaluated = 0;
+  LUM_TRACE(EVAL, 1, "apply " << 1);
+  LUM_TRACE(EVAL, 2, "stack " << 2);
+  LUM_TRACE(CONS, 1, "reuse");
+  LUM_TRACE(CONS, 2, "details " << ++evaluated);
+  LUM_TRACE(COMPILE, 1, "compile " << ++evaluated);
+  assert_eq(evaluated, 0);
+  size_t count;
+  assert_eq(dump(&count), "eval: apply 1\neval: stack 2\ncons: reuse\n");
+  assert_eq(count, 3);
+
+  // Clearing drops what has been written so far
+  trace_clear();
+  assert_eq(dump(&count), "");
+  assert_eq(count, 0);
+
+  // Long entries are truncated
+  LUM_TRACE(EVAL, 1, std::string(kTraceTextSize * 2, 'x'));
+  assert_eq(dump(), "eval: " + std::string(kTraceTextSize, 'x') + "\n");
+  trace_clear();
+
+  // The ring keeps the latest entries
+  for (size_t i = 0; i != kTraceRingSize + 10; ++i) {
+    LUM_TRACE(EVAL, 1, i);
+  }
+  std::string s = dump(&count);
+  assert_eq(count, kTraceRingSize);
+  assert_eq(s.substr(0, s.find('\n')), "eval: 10");
+  trace_clear();
+
+  // Threads write concurrently without losing or mixing entries
+  const int kThreads = 4;
+  const int kPerThread = (int)kTraceRingSize / kThreads;
+  std::vector<std::thread> threads;
+  for (int t = 0; t != kThreads; ++t) {
+    threads.emplace_back([=] {
+      for (int i = 0; i != kPerThread; ++i) {
+        LUM_TRACE(CONS, 1, "thread " << t << " entry " << i);
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  std::istringstream lines(dump(&count));
+  assert_eq(count, (size_t)(kThreads * kPerThread));
+  std::vector<int> next(kThreads, 0);
+  std::string line;
+  while (std::getline(lines, line)) {
+    int t = -1;
+    int i = -1;
+    assert_eq(sscanf(line.c_str(), "cons: thread %d entry %d", &t, &i), 2);
+    assert_true(t >= 0 && t < kThreads);
+    // Entries of one thread are in the order they were written
+    assert_eq(i, next[t]);
+    ++next[t];
+  }
+  trace_clear();
+
+  return 0;
+}
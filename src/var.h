@@ -9,18 +9,28 @@ namespace lum {
 struct Cell;
 
 struct Var {
-  Var(const Sym* symbol, const Cell* v) : _symbol(symbol), _value(v) {}
-  Var(const Var& other) : _symbol(other._symbol), _value(other._value) {}
+  Var(const Sym* symbol, const Cell* v)
+    : _symbol(symbol), _value(v), _is_rebound(false) {}
+  Var(const Var& other)
+    : _symbol(other._symbol), _value(other._value)
+    , _is_rebound(other.is_rebound()) {}
   Cell* set(const Cell* c) {
+    __atomic_store_n(&_is_rebound, true, __ATOMIC_RELEASE);
     return const_cast<Cell*>(LumAtomicSwap(&_value, c));
   }
   Cell* get() const { return const_cast<Cell*>(_value); }
   const Sym* symbol() const { return _symbol; }
+  // True if the Var has been given a new value since it was created. May be
+  // set by another thread at any time.
+  bool is_rebound() const {
+    return __atomic_load_n(&_is_rebound, __ATOMIC_ACQUIRE);
+  }
 private:
   friend std::ostream& operator<< (std::ostream&,const Var*);
   friend struct SymVarMap;
   const Sym* _symbol;
   const Cell* _value;
+  bool _is_rebound;
 };
 
 inline std::ostream& operator<< (std::ostream& os, const Var* p) {
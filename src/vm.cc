@@ -0,0 +1,633 @@
+#include <lum/vm.h>
+#include <lum/fn.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include <lum/bif.h>
+#include <lum/print.h>
+#include <lum/memstats.h>
+#include <lum/jit.h>
+#include <lum/aot.h>
+
+namespace lum {
+
+// ---- compiler ----
+
+// True if `bif` is given the values of its arguments, unlike special forms
+// such as `if`, which are given the arguments themselves
+static bool takes_values(const Bif* bif) {
+  return bif != kBif_def && bif != kBif_fn && bif != kBif_if_ &&
+         bif != kBif_loop && bif != kBif_compiled_loop &&
+         bif != kBif_recur && bif != kBif_future && bif != kBif_in_ns;
+}
+
+namespace {
+
+struct Compiler {
+  explicit Compiler(Code* c) : code(c) {}
+
+  Code* code;
+  bool  ok = true;
+  bool  did_work = false; // compiled arithmetic, a conditional or a call
+
+  static bool is_number(Type t) { return t == Type::INT || t == Type::FLOAT; }
+
+  // The known type of local `offset` from the top, or UNKNOWN
+  Type local_type(size_t offset) const {
+    size_t count = code->param_types.size();
+    return (offset < count) ? code->param_types[count - offset - 1]
+                            : Type::UNKNOWN;
+  }
+
+  void emit(Op op, uint32_t a, uint32_t b=0, uint32_t c=0) {
+    if (a >= Code::kMaxRegisters || b > 0xff || c > 0xff) {
+      ok = false;
+      return;
+    }
+    if (a >= code->reg_count) {
+      code->reg_count = a + 1;
+    }
+    code->instrs.push_back({op, (uint8_t)a, (uint8_t)b, (uint8_t)c});
+  }
+
+  void emit_bx(Op op, uint32_t a, size_t bx) {
+    if (bx > 0xffff) {
+      ok = false;
+      return;
+    }
+    emit(op, a, bx & 0xff, bx >> 8);
+  }
+
+  size_t add_const(Cell* c) {
+    code->consts.push_back(c);
+    return code->consts.size() - 1;
+  }
+
+  size_t add_var(Var* var) {
+    auto& vars = code->vars;
+    size_t i = 0;
+    for (; i != vars.size() && vars[i] != var; ++i) {}
+    if (i == vars.size()) {
+      vars.push_back(var);
+    }
+    return i;
+  }
+
+  // Emit a jump whose target is set later by patch()
+  size_t emit_jump(Op op, uint32_t a) {
+    emit(op, a);
+    return code->instrs.size() - 1;
+  }
+
+  // Make the jump at `at` go to the next instruction emitted
+  void patch(size_t at) {
+    size_t target = code->instrs.size();
+    if (!ok || target > 0xffff) {
+      ok = false;
+      return;
+    }
+    code->instrs[at].b = (uint8_t)(target & 0xff);
+    code->instrs[at].c = (uint8_t)(target >> 8);
+  }
+
+  void add_guard(Var* var, Type type, const Bif* bif) {
+    if (var == 0) {
+      return;
+    }
+    for (auto& g : code->guards) {
+      if (g.var == var) {
+        return;
+      }
+    }
+    code->guards.push_back({var, type, bif});
+  }
+
+  // The instruction for arithmetic BIF `bif`, or RET if it is not one
+  static Op arith_op(const Bif* bif) {
+    return (bif == kBif_sum) ? Op::ADD :
+           (bif == kBif_sub) ? Op::SUB :
+           (bif == kBif_mul) ? Op::MUL :
+           (bif == kBif_div) ? Op::DIV :
+           (bif == kBif_rem) ? Op::REM :
+           Op::RET;
+  }
+
+  // Emit code which leaves the value of `c` in register `dst`. Returns the
+  // type of the value if it is known to be a number, else UNKNOWN. A call
+  // in tail position (`is_tail`) may return from the code instead.
+  Type compile(Cell* c, uint32_t dst, bool is_tail=false) {
+    switch (c->type) {
+      case Type::LOCAL: {
+        Type type = local_type((size_t)c->value.i);
+        Op op = (type == Type::INT)   ? Op::LOCALI :
+                (type == Type::FLOAT) ? Op::LOCALF :
+                Op::LOCAL;
+        emit_bx(op, dst, (size_t)c->value.i);
+        return type;
+      }
+      case Type::VAR: {
+        emit_bx(Op::VAR, dst, add_var((Var*)c->value.p));
+        return Type::UNKNOWN;
+      }
+      case Type::LIST: {
+        return compile_list(c, dst, is_tail);
+      }
+      case Type::QUOTE: {
+        emit_bx(Op::LOADK, dst, add_const((Cell*)c->value.p));
+        return Type::UNKNOWN;
+      }
+      case Type::SYM: {
+        emit_bx(Op::EVAL, dst, add_const(c));
+        return Type::UNKNOWN;
+      }
+      default: {
+        // Evaluates to itself
+        emit_bx(Op::LOADK, dst, add_const(c));
+        Type type = Cell::typeOf(c);
+        return is_number(type) ? type : Type::UNKNOWN;
+      }
+    }
+  }
+
+  // The head of a call is looked up when compiling. A Var which is not bound
+  // yet, as for a function calling itself, is taken to be a function.
+  Type compile_list(Cell* c, uint32_t dst, bool is_tail) {
+    Cell* head = (Cell*)c->value.p;
+    Var* var = (head->type == Type::VAR) ? (Var*)head->value.p : 0;
+    Cell* value = (var != 0) ? var->get() : head;
+    Type type = (value != 0) ? Cell::typeOf(value) : Type::FN;
+    const Bif* bif = (type == Type::BIF) ? Cell::getBif(value) : 0;
+    if (bif != 0 && arith_op(bif) != Op::RET) {
+      add_guard(var, type, bif);
+      return compile_arith(arith_op(bif), head->rest(), dst);
+    } else if (bif == kBif_if_ && is_if(head->rest())) {
+      add_guard(var, type, bif);
+      return compile_if(head->rest(), dst, is_tail);
+    } else if (type == Type::FN || (bif == kBif_recur && is_tail) ||
+               (bif != 0 && takes_values(bif)))
+    {
+      add_guard(var, type, bif);
+      compile(head, dst);
+      // Other BIFs are applied right away, even in tail position
+      bool is_tail_call = is_tail && (bif == 0 || bif == kBif_recur);
+      compile_call(head->rest(), dst, is_tail_call ? Op::TAIL : Op::CALL);
+      return Type::UNKNOWN;
+    } else if (head->type == Type::LOCAL || (var != 0 && bif == 0)) {
+      // Whatever the local or Var holds is checked when running, before the
+      // arguments are evaluated
+      compile(head, dst);
+      size_t not_applicable = emit_jump(Op::JMPX, dst);
+      compile_call(head->rest(), dst, is_tail ? Op::TAIL : Op::CALL);
+      size_t end = emit_jump(Op::JMP, 0);
+      patch(not_applicable);
+      emit_bx(Op::EVAL, dst, add_const(c));
+      patch(end);
+      return Type::UNKNOWN;
+    }
+    emit_bx(Op::EVAL, dst, add_const(c));
+    return Type::UNKNOWN;
+  }
+
+  // Evaluate `args` into the registers after `dst`, which holds the callee,
+  // and apply it with `op`
+  void compile_call(Cell* args, uint32_t dst, Op op) {
+    did_work = true;
+    uint32_t count = 0;
+    for (Cell* arg = args; arg != 0 && ok; arg = arg->rest()) {
+      compile(arg, dst + 1 + count++);
+    }
+    emit(op, dst, count);
+  }
+
+  // True if `args` are those of a well-formed (if test then else)
+  static bool is_if(Cell* args) {
+    return args != 0 && args->rest() != 0 &&
+           (args->rest()->rest() == 0 || args->rest()->rest()->rest() == 0);
+  }
+
+  // The branches of `if` are in tail position if the `if` is
+  Type compile_if(Cell* args, uint32_t dst, bool is_tail) {
+    did_work = true;
+    compile(args, dst);
+    size_t otherwise = emit_jump(Op::JMPF, dst);
+    Type type = compile(args->rest(), dst, is_tail);
+    size_t end = emit_jump(Op::JMP, 0);
+    patch(otherwise);
+    Type other_type = Type::UNKNOWN;
+    if (args->rest()->rest() != 0) {
+      other_type = compile(args->rest()->rest(), dst, is_tail);
+    } else {
+      emit_bx(Op::LOADK, dst, add_const(Cell::createNil()));
+    }
+    patch(end);
+    return (type == other_type) ? type : Type::UNKNOWN;
+  }
+
+  // The variant of `op` for operands of types `a` and `b`
+  static Op typed_op(Op op, Type a, Type b) {
+    if (a != b || !is_number(a)) {
+      return op;
+    }
+    int i = (int)op - (int)Op::ADD;
+    return (Op)(i + (int)((a == Type::INT) ? Op::ADDI : Op::ADDF));
+  }
+
+  // Arguments are folded from left to right, like the arithmetic BIFs do
+  Type compile_arith(Op op, Cell* args, uint32_t dst) {
+    did_work = true;
+    if (args == 0) {
+      emit_bx(Op::LOADK, dst, add_const(Cell::immInt(0)));
+      return Type::INT;
+    }
+    Type type = compile(args, dst);
+    if (args->rest() == 0) {
+      if (!is_number(type)) {
+        emit(Op::NUM, dst);
+      }
+      return type;
+    }
+    for (Cell* arg = args->rest(); arg != 0 && ok; arg = arg->rest()) {
+      Type arg_type = compile(arg, dst + 1);
+      emit(typed_op(op, type, arg_type), dst, dst, dst + 1);
+      // Mixed ints and floats give a float
+      type = (!is_number(type) || !is_number(arg_type)) ? Type::UNKNOWN :
+             (type == arg_type) ? type : Type::FLOAT;
+    }
+    return type;
+  }
+};
+
+} // namespace
+
+
+Code* Code::create(Env* env, Fn* fn, const Type* param_types) {
+  Code* code = new Code;
+  if (param_types != 0) {
+    code->param_types.assign(param_types, param_types + fn->param_count());
+  }
+  Compiler compiler(code);
+  compiler.compile(fn->body(), 0, true);
+  compiler.emit(Op::RET, 0);
+  if (!compiler.ok || !compiler.did_work) {
+    delete code;
+    return 0;
+  }
+  code->instrs.shrink_to_fit();
+  code->consts.shrink_to_fit();
+  code->param_types.shrink_to_fit();
+  mem_note_alloc(kMemKindCode, code->size());
+  aot_attach(code);
+  return code;
+}
+
+
+void Code::free(Code* code) {
+  if (code == 0) {
+    return;
+  }
+  jit_free(code);
+  mem_note_free(kMemKindCode, code->size());
+  delete code;
+}
+
+
+bool Code::is_valid() const {
+  for (const Guard& g : guards) {
+    Cell* value = g.var->get();
+    if (value == 0 || Cell::typeOf(value) != g.type ||
+        (g.bif != 0 && Cell::getBif(value) != g.bif))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+bool Code::matches_args(Env* env) const {
+  size_t count = param_types.size();
+  for (size_t i = 0; i != count; ++i) {
+    Type type = param_types[i];
+    if (type != Type::UNKNOWN &&
+        Cell::typeOf(env->get_local(count - i - 1)) != type)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+size_t Code::size() const {
+  return sizeof(Code) +
+         instrs.capacity() * sizeof(Instr) +
+         consts.capacity() * sizeof(Cell*) +
+         vars.capacity() * sizeof(Var*) +
+         guards.capacity() * sizeof(Guard) +
+         param_types.capacity() * sizeof(Type);
+}
+
+
+// ---- interpreter ----
+
+static inline void load(Reg& r, Cell* c) {
+  r.type = (c == 0) ? Type::UNKNOWN : Cell::typeOf(c);
+  switch (r.type) {
+    case Type::INT:   { r.value.i = Cell::intValue(c); break; }
+    case Type::FLOAT: { r.value.f = Cell::floatValue(c); break; }
+    default:          { r.value.c = c; break; }
+  }
+}
+
+
+static inline Cell* box(const Reg& r) {
+  switch (r.type) {
+    case Type::INT:   { return Cell::immInt(r.value.i); }
+    case Type::FLOAT: { return Cell::immFloat(r.value.f); }
+    default:          { return r.value.c; }
+  }
+}
+
+
+// Returns false after printing an error if `r` is not a number. An unbound
+// value has already been reported, if at all, by whoever produced it.
+static bool check_number(const Reg& r) {
+  if (r.type == Type::INT || r.type == Type::FLOAT) {
+    return true;
+  }
+  if (r.value.c != 0) {
+    std::cerr << "bad argument to built-in function: ";
+    print1(std::cerr, r.value.c) << '\n';
+  }
+  return false;
+}
+
+
+static double to_float(const Reg& r) {
+  if (r.type == Type::FLOAT) {
+    return r.value.f;
+  }
+  int64_t v = r.value.i;
+  if (v > 9007199254740992 || v < -9007199254740992) {
+    fprintf(stderr, "BIF/add: "
+      "error precision loss in int-to-float conversion\n");
+  }
+  return (double)v;
+}
+
+
+template <Op OP>
+static inline bool arith(Reg& dst, const Reg& a, const Reg& b) {
+  if (a.type == Type::INT && b.type == Type::INT) {
+    int64_t x = a.value.i;
+    int64_t y = b.value.i;
+    switch (OP) {
+      case Op::ADD: { x += y; break; }
+      case Op::SUB: { x -= y; break; }
+      case Op::MUL: { x *= y; break; }
+      case Op::DIV: { x /= y; break; }
+      default:      { x %= y; break; }
+    }
+    dst.type = Type::INT;
+    dst.value.i = x;
+    return true;
+  }
+  if (!check_number(a) || !check_number(b)) {
+    return false;
+  }
+  double x = to_float(a);
+  double y = to_float(b);
+  switch (OP) {
+    case Op::ADD: { x += y; break; }
+    case Op::SUB: { x -= y; break; }
+    case Op::MUL: { x *= y; break; }
+    case Op::DIV: { x /= y; break; }
+    default:      { x = fmod(x, y); break; }
+  }
+  dst.type = Type::FLOAT;
+  dst.value.f = x;
+  return true;
+}
+
+
+#define LUM_VM_ARITH(Name) \
+  case Op::Name: { \
+    if (!arith<Op::Name>(r[i.a], r[i.b], r[i.c])) { return 0; } \
+    break; \
+  }
+
+// Arithmetic on operands whose type is known when compiling
+#define LUM_VM_ARITH_TYPED(Name, T, field, expr) \
+  case Op::Name: { \
+    auto x = r[i.b].value.field; \
+    auto y = r[i.c].value.field; \
+    r[i.a].type = Type::T; \
+    r[i.a].value.field = (expr); \
+    break; \
+  }
+
+static Cell tail_call_marker;
+Cell* const kTailCall = &tail_call_marker;
+
+Cell* vm_run(Env* env, const Code* code) {
+  Reg r[Code::kMaxRegisters];
+  Cell* const* k = code->consts.data();
+  const Instr* const start = code->instrs.data();
+  const Instr* ip = start;
+  while (true) {
+    const Instr i = *ip++;
+    switch (i.op) {
+      case Op::LOADK: { load(r[i.a], k[i.bx()]); break; }
+      case Op::LOCAL: { load(r[i.a], env->get_local(i.bx())); break; }
+      case Op::LOCALI: {
+        r[i.a].type = Type::INT;
+        r[i.a].value.i = Cell::intValue(env->get_local(i.bx()));
+        break;
+      }
+      case Op::LOCALF: {
+        r[i.a].type = Type::FLOAT;
+        r[i.a].value.f = Cell::floatValue(env->get_local(i.bx()));
+        break;
+      }
+      case Op::VAR:   { load(r[i.a], code->vars[i.bx()]->get()); break; }
+      case Op::EVAL: {
+        Cell* c = eval(env, k[i.bx()]);
+        if (c == 0) { return 0; }
+        load(r[i.a], c);
+        break;
+      }
+      case Op::NUM: {
+        if (!check_number(r[i.a])) { return 0; }
+        break;
+      }
+      LUM_VM_ARITH(ADD)
+      LUM_VM_ARITH(SUB)
+      LUM_VM_ARITH(MUL)
+      LUM_VM_ARITH(DIV)
+      LUM_VM_ARITH(REM)
+      LUM_VM_ARITH_TYPED(ADDI, INT, i, x + y)
+      LUM_VM_ARITH_TYPED(SUBI, INT, i, x - y)
+      LUM_VM_ARITH_TYPED(MULI, INT, i, x * y)
+      LUM_VM_ARITH_TYPED(DIVI, INT, i, x / y)
+      LUM_VM_ARITH_TYPED(REMI, INT, i, x % y)
+      LUM_VM_ARITH_TYPED(ADDF, FLOAT, f, x + y)
+      LUM_VM_ARITH_TYPED(SUBF, FLOAT, f, x - y)
+      LUM_VM_ARITH_TYPED(MULF, FLOAT, f, x * y)
+      LUM_VM_ARITH_TYPED(DIVF, FLOAT, f, x / y)
+      LUM_VM_ARITH_TYPED(REMF, FLOAT, f, fmod(x, y))
+      case Op::JMP: { ip = start + i.bx(); break; }
+      case Op::JMPF: {
+        if (vm_is_false(r[i.a])) { ip = start + i.bx(); }
+        break;
+      }
+      case Op::JMPX: {
+        if (!vm_is_applicable(r[i.a])) { ip = start + i.bx(); }
+        break;
+      }
+      case Op::CALL: {
+        if (!vm_call(env, &r[i.a], i.b)) { return 0; }
+        break;
+      }
+      case Op::TAIL: { return vm_tail(env, &r[i.a], i.b); }
+      case Op::RET: { return box(r[i.a]); }
+    }
+  }
+}
+
+#undef LUM_VM_ARITH
+#undef LUM_VM_ARITH_TYPED
+
+
+void vm_load(Reg& r, Cell* c) { load(r, c); }
+
+Cell* vm_box(const Reg& r) { return box(r); }
+
+bool vm_check_number(const Reg& r) { return check_number(r); }
+
+bool vm_eval(Env* env, Reg& dst, Cell* c) {
+  // A call whose head is a Var or BIF is applied here if it is a call to a
+  // BIF, doing what eval_list does, and left to `eval` otherwise
+  Cell* head = 0;
+  if (!Cell::isImm(c) && c->type == Type::LIST && c->value.p != 0) {
+    Type head_type = ((Cell*)c->value.p)->type;
+    if (head_type == Type::VAR || head_type == Type::BIF) {
+      head = (Cell*)c->value.p;
+    }
+  }
+  Cell* target = (head != 0) ? eval(env, head) : 0;
+  if (head != 0 && target == 0) {
+    return false;
+  }
+  Cell* result;
+  if (target != 0 && Cell::typeOf(target) == Type::BIF) {
+    if (!env->apply_stack.push(target)) {
+      std::cerr << "stack overflow: maximum call depth ("
+                << env->max_depth() << ") exceeded\n";
+      return false;
+    }
+    const Bif* bif = Cell::getBif(target);
+    Bif::Impl apply = bif->apply;
+    if (c->flags & (Cell::kFlagArity1 | Cell::kFlagArity2)) {
+      apply = bif->apply_fixed((c->flags & Cell::kFlagArity1) ? 1 : 2);
+    }
+    size_t results_index = env->results.index();
+    result = apply(env, head->rest());
+    env->results.unwind(results_index);
+    env->apply_stack.pop();
+    if (result != 0) {
+      env->results.push(result);
+    }
+  } else {
+    result = eval(env, c);
+  }
+  if (result == 0) {
+    return false;
+  }
+  load(dst, result);
+  return true;
+}
+
+bool vm_arith(Op op, Reg& dst, const Reg& a, const Reg& b) {
+  switch (op) {
+    case Op::ADD: { return arith<Op::ADD>(dst, a, b); }
+    case Op::SUB: { return arith<Op::SUB>(dst, a, b); }
+    case Op::MUL: { return arith<Op::MUL>(dst, a, b); }
+    case Op::DIV: { return arith<Op::DIV>(dst, a, b); }
+    default:      { return arith<Op::REM>(dst, a, b); }
+  }
+}
+
+// Like if_branch
+bool vm_is_false(const Reg& r) {
+  return (r.type == Type::BOOL && Cell::intValue(r.value.c) == 0) ||
+         (r.type == Type::SYM && Cell::ptrValue(r.value.c) == kSym_nil);
+}
+
+bool vm_is_applicable(const Reg& r) {
+  return r.type == Type::FN ||
+         (r.type == Type::BIF && takes_values(Cell::getBif(r.value.c)));
+}
+
+bool vm_call(Env* env, Reg* r, uint32_t count) {
+  Cell* target = box(r[0]);
+  if (!vm_is_applicable(r[0])) {
+    std::cerr << "first item in list is not a function\n";
+    return false;
+  }
+  if (!env->apply_stack.push(target)) {
+    std::cerr << "stack overflow: maximum call depth ("
+              << env->max_depth() << ") exceeded\n";
+    return false;
+  }
+  size_t results_index = env->results.index();
+  Cell* result = 0;
+  if (r[0].type == Type::BIF) {
+    // The BIF evaluates its arguments, so they are given to it quoted, and
+    // kept on the results stack while it runs
+    Cell* args = 0;
+    for (uint32_t n = count; n-- != 0; ) {
+      args = Cell::createQuote(box(r[1 + n]), args);
+    }
+    env->results.push(args);
+    result = Cell::getBif(target)->apply_fixed(count)(env, args);
+    env->results.unwind(results_index);
+  } else {
+    // Apply the function in a nursery frame of its own, like eval_list
+    Nursery::Frame frame = env->nursery.enter();
+    bool ok = true;
+    for (uint32_t n = 0; n != count && ok; ++n) {
+      ok = env->results.push(box(r[1 + n]));
+    }
+    if (!ok) {
+      std::cerr << "stack overflow: out of memory for results\n";
+    } else {
+      result = ((Fn*)target->value.p)->apply_values(env, count);
+    }
+    env->results.unwind(results_index);
+    result = env->nursery.leave(frame, result);
+  }
+  assert(env->apply_stack.top() == target);
+  env->apply_stack.pop();
+  if (result == 0) {
+    return false;
+  }
+  // Registers are not roots of the garbage collector
+  env->results.push(result);
+  load(r[0], result);
+  return true;
+}
+
+Cell* vm_tail(Env* env, Reg* r, uint32_t count) {
+  bool is_recur = r[0].type == Type::BIF &&
+                  Cell::getBif(r[0].value.c) == kBif_recur;
+  if (r[0].type != Type::FN && !is_recur) {
+    return vm_call(env, r, count) ? box(r[0]) : 0;
+  }
+  auto& values = env->tail_call_args;
+  values.clear();
+  for (uint32_t n = 0; n != count + 1; ++n) {
+    values.push_back(box(r[n]));
+  }
+  return kTailCall;
+}
+
+} // namespace lum
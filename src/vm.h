@@ -0,0 +1,178 @@
+#ifndef _LUM_VM_H_
+#define _LUM_VM_H_
+
+#include <lum/common.h>
+#include <lum/cell.h>
+
+namespace lum {
+
+struct Env;
+struct Fn;
+struct Var;
+struct Bif;
+
+// Bytecode for function bodies.
+//
+// Fn::compile rewrites the body of a function in place (see fn.cc) and then
+// translates the rewritten body to Code, which Fn::apply runs instead of
+// walking the cell tree. Code is a flat array of register instructions with
+// a pool of constants and a pool of Vars. Values live in registers which are
+// addressed by index, and locals are addressed by their slot on the locals
+// stack, just like LOCAL cells.
+//
+// Arithmetic on numbers is done by the VM itself, `if` becomes conditional
+// jumps, and calls of functions and of BIFs which take the values of their
+// arguments evaluate the arguments into registers and apply the callee to
+// them (see vm_call). A call in tail position of the body, including
+// `recur`, is handed back to Fn::apply, which makes it in place like any
+// other tail call (see eval_body in fn.cc). Any other expression, such as
+// the special forms `fn`, `loop` and `future`, is compiled to an EVAL
+// instruction which hands its cell to the tree-walking `eval`, so every body
+// can be compiled, but only bodies with arithmetic, conditionals or calls
+// are: for others there is nothing to gain. Top-level forms are never
+// compiled.
+//
+// What the Vars called in a body are bound to is looked up when compiling.
+// As Vars can be redefined, the Vars and the types of their values, or the
+// BIFs they were bound to, are recorded as guards, and Fn::apply falls back
+// to the tree-walker should any of them change.
+//
+// Code may also be specialized for the types of a function's arguments, as
+// observed by Fn::apply (see fn.cc). Parameters which are known to be ints
+// or floats are then loaded without checking their type, and arithmetic on
+// operands of known types is done without dispatching on them. Such code
+// is only run when matches_args() says the arguments have those types.
+
+#ifndef LUM_VM
+  #define LUM_VM 1
+#endif
+
+enum class Op : uint8_t {
+  LOADK,  // A = consts[Bx]
+  LOCAL,  // A = locals[Bx]
+  VAR,    // A = vars[Bx]->get()
+  EVAL,   // A = eval(consts[Bx])
+  NUM,    // check that A is a number
+  ADD,    // A = B + C
+  SUB,    // A = B - C
+  MUL,    // A = B * C
+  DIV,    // A = B / C
+  REM,    // A = B rem C
+  LOCALI, // A = locals[Bx], which is an int
+  LOCALF, // A = locals[Bx], which is a float
+  ADDI,   // A = B + C, on ints
+  SUBI,
+  MULI,
+  DIVI,
+  REMI,
+  ADDF,   // A = B + C, on floats
+  SUBF,
+  MULF,
+  DIVF,
+  REMF,
+  JMP,    // jump to Bx
+  JMPF,   // jump to Bx if A is false or nil
+  JMPX,   // jump to Bx unless A can be applied with CALL
+  CALL,   // A = A(A+1 ...A+B)
+  TAIL,   // return A(A+1 ...A+B), see vm_tail
+  RET,    // return A
+};
+
+// Registers hold numbers unboxed, so that intermediate results of arithmetic
+// never need a cell. Any other value is held as the cell it came in.
+struct Reg {
+  Type type;
+  union { int64_t i; double f; Cell* c; } value;
+};
+
+static_assert(sizeof(Reg) == 16 && offsetof(Reg, value) == 8,
+              "native code (see jit.cc) depends on the layout of Reg");
+
+struct Instr {
+  Op      op;
+  uint8_t a;
+  uint8_t b;
+  uint8_t c;
+  uint16_t bx() const { return (uint16_t)(b | (c << 8)); }
+};
+
+struct Code {
+  // A Var which was resolved when compiling, with the type of the value it
+  // was bound to and, if that was a BIF, the BIF. Comparing these rather
+  // than the cell means a Var rebound to a different cell of the same
+  // function does not invalidate the code, and a cell freed and reused for
+  // another value can not be mistaken for the one we saw.
+  struct Guard {
+    Var*       var;
+    Type       type;
+    const Bif* bif;
+  };
+
+  // Translate the compiled body of `fn`. If `param_types` is given, the
+  // code is specialized for parameters of those types, UNKNOWN meaning any
+  // type. Returns NULL if the body is not worth compiling or needs more
+  // registers or constants than Instr can address.
+  static Code* create(Env* env, Fn* fn, const Type* param_types=0);
+  static void free(Code*);
+
+  // True if all Vars which were resolved when compiling are still bound to
+  // values of the type, and BIFs, the code was compiled for
+  bool is_valid() const;
+
+  // True if the arguments on top of env->locals have the types the code is
+  // specialized for, if any
+  bool matches_args(Env* env) const;
+
+  // Memory used by the code, for memory statistics
+  size_t size() const;
+
+  static constexpr size_t kMaxRegisters = 64;
+
+  std::vector<Instr> instrs;
+  std::vector<Cell*> consts;
+  std::vector<Var*>  vars;
+  std::vector<Guard> guards;
+  std::vector<Type>  param_types; // empty unless specialized
+  uint32_t           reg_count = 0;
+
+  // Machine code for `instrs`, from the JIT (see jit.h) or compiled ahead
+  // of time (see aot.h), or NULL
+  Cell* (*native)(Env*, const Code*) = 0;
+  void*              native_mem = 0;
+  size_t             native_size = 0;
+};
+
+// Returned by code which ends in a tail call to a function or in `recur`,
+// with the callee followed by the arguments left in env->tail_call_args
+extern Cell* const kTailCall;
+
+// Run `code` with the arguments of the call on top of env->locals. Returns
+// the value of the body, kTailCall or NULL on error.
+Cell* vm_run(Env* env, const Code* code);
+
+// Like vm_run, but using the machine code for `code` if there is any
+inline Cell* vm_exec(Env* env, const Code* code) {
+  // May be set by another thread at any time, see jit_compile
+  Cell* (*native)(Env*, const Code*) =
+    __atomic_load_n(&code->native, __ATOMIC_ACQUIRE);
+  return (native != 0) ? native(env, code) : vm_run(env, code);
+}
+
+// Single instructions, for machine code to call. Those returning bool
+// return false after printing an error.
+void  vm_load(Reg& r, Cell* c);
+Cell* vm_box(const Reg& r);
+bool  vm_check_number(const Reg& r);
+bool  vm_eval(Env* env, Reg& dst, Cell* c); // calls BIFs directly
+bool  vm_arith(Op op, Reg& dst, const Reg& a, const Reg& b);
+bool  vm_is_false(const Reg& r);
+bool  vm_is_applicable(const Reg& r);
+// Apply the callee in r[0] to the `count` arguments after it, leaving the
+// result in r[0]
+bool  vm_call(Env* env, Reg* r, uint32_t count);
+// Make a tail call like vm_call, returning kTailCall if it is up to the
+// caller to make it, or else the result
+Cell* vm_tail(Env* env, Reg* r, uint32_t count);
+
+} // namespace lum
+#endif // _LUM_VM_H_
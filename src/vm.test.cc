@@ -0,0 +1,188 @@
+#include <lum/vm.h>
+#include <lum/fn.h>
+#include <lum/env.h>
+#include <lum/eval.h>
+#include "test.h"
+
+using namespace lum;
+
+static Cell* value_of(Env& env, const char* name) {
+  return env.resolve_symbol(const_cast<Sym*>(intern_sym(name)))->get();
+}
+
+// Apply `fn` to `a` and `b` both with bytecode and by walking its body, and
+// check that the results are the same
+static Cell* apply_both(Env& env, Fn* fn, Cell* a, Cell* b) {
+  assert_true(fn->_code != 0);
+  env.locals.push(a);
+  env.locals.push(b);
+  Cell* expected = eval(&env, fn->body());
+  Cell* actual = vm_run(&env, fn->_code);
+  env.unwind_locals(0);
+  assert_same(actual, expected);
+  env.results.unwind(0);
+  return actual;
+}
+
+int main(int argc, const char** argv) {
+  #if LUM_VM
+  Env env;
+
+  // (- (* a b) (/ a 2) (rem b 3) 1)
+  Fn* fn = make_fn(env, list(sym("-",
+    list(sym("*", sym("a", sym("b"))),
+    list(sym("/", sym("a", Cell::createInt(2))),
+    list(sym("rem", sym("b", Cell::createInt(3))),
+    Cell::createInt(1)))))));
+  Cell* r = apply_both(env, fn, Cell::createInt(10), Cell::createInt(7));
+  assert_eq(Cell::intValue(r), 10*7 - 10/2 - 7%3 - 1);
+  r = apply_both(env, fn, Cell::createInt(-3000000000), Cell::createInt(5));
+  assert_eq(Cell::intValue(r), -3000000000LL*5 - -3000000000LL/2 - 5%3 - 1);
+  r = apply_both(env, fn, Cell::createFloat(2.5), Cell::createInt(4));
+  assert_true(Cell::typeOf(r) == Type::FLOAT);
+  r = apply_both(env, fn, Cell::createInt(4), Cell::createFloat(-1.5));
+  assert_true(Cell::typeOf(r) == Type::FLOAT);
+
+  // Bad arguments fail the same way
+  r = apply_both(env, fn, Cell::createInt(1), Cell::createBool(true));
+  assert_null(r);
+
+  // (+) (+ a) (* a)
+  fn = make_fn(env, list(sym("+", list(sym("+"),
+    list(sym("+", sym("a")), list(sym("*", sym("a"))))))));
+  r = apply_both(env, fn, Cell::createInt(21), Cell::createInt(0));
+  assert_eq(Cell::intValue(r), 42);
+
+  // Vars and calls to other functions
+  // (def c 100) (def f (fn (a b) (+ a b))) (+ c (f 1 2) a)
+  eval(&env, list(sym("def", sym("c", Cell::createInt(100)))));
+  Fn* f = make_fn(env, list(sym("+", sym("a", sym("b")))));
+  env.define(const_cast<Sym*>(intern_sym("f")), Cell::createFn(f));
+  fn = make_fn(env, list(sym("+", sym("c", list(
+    sym("f", Cell::createInt(1, Cell::createInt(2))), sym("a"))))));
+  r = apply_both(env, fn, Cell::createInt(1000), Cell::createInt(0));
+  assert_eq(Cell::intValue(r), 1103);
+  bool has_call = false;
+  for (const Instr& instr : fn->_code->instrs) {
+    has_call = has_call || instr.op == Op::CALL;
+  }
+  assert_true(has_call);
+
+  // Conditionals, and calls to BIFs other than arithmetic
+  // (if (= a b) (* a 2) (- b 1))
+  fn = make_fn(env, list(sym("if", list(sym("=", sym("a", sym("b"))),
+    list(sym("*", sym("a", Cell::createInt(2))),
+    list(sym("-", sym("b", Cell::createInt(1)))))))));
+  r = apply_both(env, fn, Cell::createInt(3), Cell::createInt(3));
+  assert_eq(Cell::intValue(r), 6);
+  r = apply_both(env, fn, Cell::createInt(3), Cell::createInt(4));
+  assert_eq(Cell::intValue(r), 3);
+
+  // (if a b), which is nil if `a` is false
+  fn = make_fn(env, list(sym("if", sym("a", sym("b")))));
+  r = apply_both(env, fn, Cell::createBool(false), Cell::createInt(1));
+  assert_true(Cell::typeOf(r) == Type::SYM);
+  r = apply_both(env, fn, Cell::createInt(0), Cell::createInt(1));
+  assert_eq(Cell::intValue(r), 1);
+
+  // What a local holds is checked before calling it
+  // (- (a b b) 1)
+  fn = make_fn(env, list(sym("-", list(sym("a", sym("b", sym("b"))),
+    Cell::createInt(1)))));
+  r = apply_both(env, fn, value_of(env, "f"), Cell::createInt(4));
+  assert_eq(Cell::intValue(r), 7);
+  r = apply_both(env, fn, value_of(env, "*"), Cell::createInt(4));
+  assert_eq(Cell::intValue(r), 15);
+  r = apply_both(env, fn, Cell::createInt(1), Cell::createInt(4));
+  assert_null(r);
+
+  // A call to a function in tail position is handed back to the caller
+  // (f b a)
+  fn = make_fn(env, list(sym("f", sym("b", sym("a")))));
+  env.locals.push(Cell::createInt(1));
+  env.locals.push(Cell::createInt(2));
+  assert_eq(vm_run(&env, fn->_code), kTailCall);
+  env.unwind_locals(0);
+  assert_eq(env.tail_call_args.size(), (size_t)3);
+  assert_eq(env.tail_call_args[0], value_of(env, "f"));
+  assert_eq(Cell::intValue(env.tail_call_args[1]), 2);
+  env.results.unwind(0);
+
+  // Bodies which only load a value are left to the tree-walker
+  fn = make_fn(env, sym("b"));
+  assert_null(fn->_code);
+
+  // Code is invalidated when a Var it depends on is redefined
+  // (def plus +) (fn (a b) (plus a b)) (def plus -)
+  Sym* plus = const_cast<Sym*>(intern_sym("plus"));
+  env.define(plus, value_of(env, "+"));
+  fn = make_fn(env, list(sym("plus", sym("a", sym("b")))));
+  r = apply_both(env, fn, Cell::createInt(5), Cell::createInt(3));
+  assert_eq(Cell::intValue(r), 8);
+  assert_true(fn->_code->is_valid());
+  env.define(plus, value_of(env, "-"));
+  assert_false(fn->_code->is_valid());
+  Cell* call = list(Cell::createFn(fn,
+    Cell::createInt(5, Cell::createInt(3))));
+  r = eval(&env, call);
+  assert_eq(Cell::intValue(r), 2);
+  env.results.unwind(0);
+  // and is valid again once the Var is bound to the same BIF as before
+  env.define(plus, value_of(env, "+"));
+  assert_true(fn->_code->is_valid());
+  env.define(plus, value_of(env, "-"));
+
+  // A function which is only given ints is specialized for them once hot
+  // (fn (a b) (+ (* a a) (- b 1) 2))
+  fn = make_fn(env, list(sym("+", list(sym("*", sym("a", sym("a"))),
+    list(sym("-", sym("b", Cell::createInt(1))), Cell::createInt(2))))));
+  for (uint32_t i = 0; i != Fn::kSpecializeAfter; ++i) {
+    assert_null(fn->_special);
+    call = list(Cell::createFn(fn, Cell::createInt(i, Cell::createInt(3))));
+    r = eval(&env, call);
+    assert_eq(Cell::intValue(r), (int64_t)i * i + 4);
+    env.results.unwind(0);
+  }
+  assert_true(fn->_special != 0);
+  assert_true(fn->param(0).type == Type::INT);
+  assert_true(fn->param(1).type == Type::INT);
+  bool has_typed_ops = false;
+  for (const Instr& instr : fn->_special->instrs) {
+    has_typed_ops = has_typed_ops || instr.op == Op::MULI;
+    assert_true(instr.op != Op::MUL && instr.op != Op::LOCAL);
+  }
+  assert_true(has_typed_ops);
+  env.locals.push(Cell::createInt(-3000000000));
+  env.locals.push(Cell::createInt(7));
+  assert_true(fn->_special->matches_args(&env));
+  r = vm_run(&env, fn->_special);
+  assert_eq(Cell::intValue(r), 9000000000000000000LL + 8);
+  env.unwind_locals(0);
+
+  // and falls back to the generic code for arguments of other types
+  call = list(Cell::createFn(fn,
+    Cell::createFloat(1.5, Cell::createInt(3))));
+  r = eval(&env, call);
+  assert_true(Cell::floatValue(r) == 1.5 * 1.5 + 4);
+  env.results.unwind(0);
+  call = list(Cell::createFn(fn,
+    Cell::createInt(2, Cell::createBool(true))));
+  assert_null(eval(&env, call));
+  env.results.unwind(0);
+
+  // A function given arguments of several types is not specialized
+  fn = make_fn(env, list(sym("+", sym("a", sym("b")))));
+  for (uint32_t i = 0; i != Fn::kSpecializeAfter; ++i) {
+    Cell* b = Cell::createInt(1);
+    Cell* a = (i % 2) ? Cell::createInt(i, b) : Cell::createFloat(i, b);
+    call = list(Cell::createFn(fn, a));
+    r = eval(&env, call);
+    assert_true(r != 0);
+    env.results.unwind(0);
+  }
+  assert_true(fn->_is_polymorphic);
+  assert_null(fn->_special);
+  #endif
+
+  return 0;
+}